@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <vector>
 #include <fstream>
@@ -6,90 +8,194 @@
 #include <cstring>
 #include "audio_decoder.hpp"
 #include <fstream>
+#include <vector>
+
+extern "C"
+{
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <vector>
+#include <libswresample/swresample.h>
+}
 
-// TODO: look into avresample from ffmpeg library if this resampler doesn't work
-audioSystem::AudioResampler::AudioResampler(int in_rate, int out_rate, int channels)
+// the resampler is compiled for avx512f, avx2, sse4.2 and the baseline on x86-64 linux and the loader picks the
+// best version for the cpu, see feature_extractor/kernels.hpp
+#if defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__)) &&                     \
+    !defined(AUDIO_SYSTEMS_NO_DISPATCH)
+#define AUDIO_SYSTEMS_DISPATCH __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define AUDIO_SYSTEMS_DISPATCH
+#endif
+
+// writes count output frames starting at input position pos, every position must be in [0, num_frames - 1]
+AUDIO_SYSTEMS_DISPATCH
+static void resample_linear(const float *input, int channels, double pos, double step, float *output, int count)
 {
-    m_src_rate = in_rate;
-    m_dst_rate = out_rate;
-    m_channels = channels;
-    m_data = new float[m_src_rate * m_channels];
-    m_resampled = new float[m_dst_rate * m_channels];
-    m_frac = 0.0f;
+    if (channels == 1)
+    {
+        for (int j = 0; j < count; j++)
+        {
+            const double p = pos + j * step;
+            const int i0 = static_cast<int>(p);
+            const float frac = static_cast<float>(p - i0);
+            const float a = input[i0];
+            const float b = input[i0 + (frac > 0.0f ? 1 : 0)];
+            output[j] = a + (b - a) * frac;
+        }
+        return;
+    }
+
+    for (int j = 0; j < count; j++)
+    {
+        const double p = pos + j * step;
+        const int i0 = static_cast<int>(p);
+        const float frac = static_cast<float>(p - i0);
+        const int i1 = i0 + (frac > 0.0f ? 1 : 0);
+        for (int c = 0; c < channels; c++)
+        {
+            const float a = input[i0 * channels + c];
+            const float b = input[i1 * channels + c];
+            output[j * channels + c] = a + (b - a) * frac;
+        }
+    }
 }
 
-audioSystem::AudioResampler::~AudioResampler()
+audioSystem::AudioResampler::AudioResampler(int in_rate, int out_rate, int channels)
+    : m_src_rate(in_rate), m_dst_rate(out_rate), m_channels(channels), m_last(channels, 0.0f)
 {
-    delete[] m_data;
-    delete[] m_resampled;
 }
 
 int audioSystem::AudioResampler::Resample(const float *input, int num_samples, float *output, int max_output_samples)
 {
-    const float src_rate = static_cast<float>(m_src_rate);
-    const float dst_rate = static_cast<float>(m_dst_rate);
-    const float ratio = dst_rate / src_rate;
-    const int stride = m_channels;
-    int samples_written = 0;
+    if (num_samples <= 0 || max_output_samples <= 0)
+    {
+        return 0;
+    }
 
-    while (num_samples > 0)
+    const double step = static_cast<double>(m_src_rate) / m_dst_rate;
+    int written = 0;
+
+    // frames between the last frame of the previous block and the first of this one
+    while (m_pos < 0.0 && written < max_output_samples)
     {
-        // Copy input to buffer.
-        const int samples_to_copy = std::min(num_samples, m_src_rate - m_buf_pos);
-        memcpy(m_data + m_buf_pos * stride, input, samples_to_copy * stride * sizeof(int16_t));
-        m_buf_pos += samples_to_copy;
-        input += samples_to_copy * stride;
-        num_samples -= samples_to_copy;
-
-        // Resample buffer.
-        int resampled_samples = 0;
-        while (m_buf_pos >= static_cast<int>(std::ceil((resampled_samples + 1) / ratio)))
+        const float frac = static_cast<float>(m_pos + 1.0);
+        for (int c = 0; c < m_channels; c++)
         {
-            const int output_index = resampled_samples * stride;
-            for (int c = 0; c < m_channels; ++c)
-            {
-                const float *src = m_data + static_cast<int>(std::floor(output_index / ratio) + c);
-                const int frac_index = static_cast<int>(m_frac * 65536);
-                const float frac = audioSystem::AudioResampler::s_frac_table[frac_index];
-                const float a = src[0];
-                const float b = src[stride];
-                const float resampled = a * (1.0f - frac) + b * frac;
-                m_resampled[output_index + c] = resampled;
-            }
-            ++resampled_samples;
+            output[written * m_channels + c] = m_last[c] + (input[c] - m_last[c]) * frac;
+        }
+        written++;
+        m_pos += step;
+    }
+
+    if (m_pos <= num_samples - 1)
+    {
+        const int available = static_cast<int>((num_samples - 1 - m_pos) / step) + 1;
+        const int count = std::min(available, max_output_samples - written);
+        resample_linear(input, m_channels, m_pos, step, output + written * m_channels, count);
+        written += count;
+        m_pos += count * step;
+    }
+
+    m_pos -= num_samples;
+    std::copy(input + (num_samples - 1) * m_channels, input + num_samples * m_channels, m_last.begin());
+
+    return written;
+}
+
+// based on https://github.com/guillaumekln/faster-whisper/blob/master/faster_whisper/audio.py
+std::vector<float> audioSystem::AudioDecoder::DecodeAudio(const char *input_path, int sampling_rate)
+{
+    AVFormatContext *format_ctx = nullptr;
+    if (avformat_open_input(&format_ctx, input_path, nullptr, nullptr) < 0)
+    {
+        fprintf(stderr, "%s: could not open '%s'\n", __func__, input_path);
+        return {};
+    }
+
+    if (avformat_find_stream_info(format_ctx, nullptr) < 0)
+    {
+        fprintf(stderr, "%s: could not read stream info of '%s'\n", __func__, input_path);
+        avformat_close_input(&format_ctx);
+        return {};
+    }
+
+    const AVCodec *codec = nullptr;
+    const int stream_index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (stream_index < 0)
+    {
+        fprintf(stderr, "%s: no audio stream in '%s'\n", __func__, input_path);
+        avformat_close_input(&format_ctx);
+        return {};
+    }
+
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(codec_ctx, format_ctx->streams[stream_index]->codecpar);
+    if (avcodec_open2(codec_ctx, codec, nullptr) < 0)
+    {
+        fprintf(stderr, "%s: could not open the decoder for '%s'\n", __func__, input_path);
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&format_ctx);
+        return {};
+    }
+
+    // resample to s16 first like the python decoder does, so both produce the same samples
+    SwrContext *swr_ctx = nullptr;
+    AVChannelLayout out_layout = AV_CHANNEL_LAYOUT_MONO;
+    swr_alloc_set_opts2(&swr_ctx, &out_layout, AV_SAMPLE_FMT_S16, sampling_rate, &codec_ctx->ch_layout,
+                        codec_ctx->sample_fmt, codec_ctx->sample_rate, 0, nullptr);
+    swr_init(swr_ctx);
+
+    std::vector<int16_t> pcm16;
+    auto resample = [&](const AVFrame *frame) {
+        const int in_samples = frame ? frame->nb_samples : 0;
+        const int max_out_samples = swr_get_out_samples(swr_ctx, in_samples);
+        if (max_out_samples <= 0)
+        {
+            return;
         }
-        m_frac += resampled_samples / ratio - std::floor(resampled_samples / ratio);
-        m_buf_pos -= resampled_samples;
-
-        // Write resampled output.
-        const int output_samples = std::min(max_output_samples - samples_written, resampled_samples);
-        memcpy(output + samples_written * stride, m_resampled, output_samples * stride * sizeof(float));
-        samples_written += output_samples;
-        if (samples_written >= max_output_samples)
+
+        const size_t offset = pcm16.size();
+        pcm16.resize(offset + max_out_samples);
+        uint8_t *out = reinterpret_cast<uint8_t *>(pcm16.data() + offset);
+        const int out_samples =
+            swr_convert(swr_ctx, &out, max_out_samples,
+                        frame ? const_cast<const uint8_t **>(frame->extended_data) : nullptr, in_samples);
+        pcm16.resize(offset + std::max(out_samples, 0));
+    };
+
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+
+    while (av_read_frame(format_ctx, packet) >= 0)
+    {
+        // invalid packets are skipped, same as _ignore_invalid_frames
+        if (packet->stream_index == stream_index && avcodec_send_packet(codec_ctx, packet) >= 0)
         {
-            break;
+            while (avcodec_receive_frame(codec_ctx, frame) >= 0)
+            {
+                resample(frame);
+            }
         }
+        av_packet_unref(packet);
     }
 
-    return samples_written;
-}
+    // flush the decoder and then the resampler
+    avcodec_send_packet(codec_ctx, nullptr);
+    while (avcodec_receive_frame(codec_ctx, frame) >= 0)
+    {
+        resample(frame);
+    }
+    resample(nullptr);
 
-float audioSystem::AudioResampler::s_frac_table[AudioResampler::s_frac_table_size];
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    swr_free(&swr_ctx);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&format_ctx);
 
-void audioSystem::AudioDecoder::InitializeFracTable()
-{
-    for (int i = 0; i < audioSystem::AudioResampler::s_frac_table_size; ++i)
+    std::vector<float> pcmf32(pcm16.size());
+    for (size_t i = 0; i < pcm16.size(); i++)
     {
-        AudioResampler::s_frac_table[i] = static_cast<float>(i) / 65536;
+        pcmf32[i] = pcm16[i] / 32768.0f;
     }
+    return pcmf32;
 }
-
-// TODO: complete the audio decoder based on the following code https://github.com/guillaumekln/faster-whisper/blob/master/faster_whisper/audio.py
-std::vector<float> audioSystem::AudioDecoder::DecodeAudio(const char *&input_path)
-{
-    std::vector<float> test;
-    return test;
-}
\ No newline at end of file
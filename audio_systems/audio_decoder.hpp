@@ -4,37 +4,31 @@
 
 namespace audioSystem
 {
+    // streaming linear interpolation resampler for interleaved float frames, the read position and the last frame
+    // are kept between calls so a stream can be fed in blocks of any size
     class AudioResampler
     {
     public:
         AudioResampler(int in_rate, int out_rate, int channels);
 
-        ~AudioResampler();
-
+        // returns the number of frames written, output should hold num_samples * out_rate / in_rate + 1 frames
         int Resample(const float* input, int num_samples, float* output, int max_output_samples);
-        static constexpr int s_frac_table_size = 65537;
-        static float s_frac_table[s_frac_table_size];
 
     private:
         int m_src_rate;
         int m_dst_rate;
         int m_channels;
-        float* m_data;
-        float* m_resampled;
-        float m_frac;
-
-        int m_buf_pos = 0;
+        // input position of the next output frame, relative to the start of the next input block
+        double m_pos = 0.0;
+        // last frame of the previous block, it sits at position -1 of the next one
+        std::vector<float> m_last;
     };
 
     class AudioDecoder
     {
     public:
-        float s_frac_table[AudioResampler::s_frac_table_size];
-
-        static void InitializeFracTable();
-
-    public:
-        static std::vector<float> DecodeAudio(const char*& input_path);
+        // decodes any ffmpeg readable file to mono float pcm at the given sample rate, same as pytests/audio.py
+        static std::vector<float> DecodeAudio(const char* input_path, int sampling_rate = 16000);
     };
 
 }
\ No newline at end of file
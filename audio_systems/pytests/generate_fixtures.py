@@ -0,0 +1,24 @@
+"""Writes the decoded assets/Recording.wav as a .npy file.
+
+The C++ golden test (whisper_golden_test) compares audioSystem::AudioDecoder::DecodeAudio
+against it, so re-run this script whenever audio.py changes and commit the fixture.
+"""
+
+import os
+
+import numpy as np
+
+from audio import decode_audio
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+FIXTURES_DIR = os.path.join(TESTS_DIR, "fixtures")
+
+
+def generate_fixtures():
+    os.makedirs(FIXTURES_DIR, exist_ok=True)
+    audio = decode_audio(os.path.join(TESTS_DIR, "..", "assets", "Recording.wav"))
+    np.save(os.path.join(FIXTURES_DIR, "recording_16k.npy"), audio.astype(np.float32))
+
+
+if __name__ == "__main__":
+    generate_fixtures()
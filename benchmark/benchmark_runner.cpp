@@ -0,0 +1,139 @@
+#include "benchmark_runner.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+static std::string json_string(std::string value)
+{
+    std::replace(value.begin(), value.end(), '"', '\'');
+    std::replace(value.begin(), value.end(), '\\', '/');
+    return "\"" + value + "\"";
+}
+
+BenchmarkRunner::BenchmarkRunner(const std::string &suite, int warmup) : m_Suite(suite), m_Warmup(warmup)
+{
+}
+
+void BenchmarkRunner::SetFilter(const std::string &filter)
+{
+    m_Filter = filter;
+}
+
+bool BenchmarkRunner::IsEnabled(const std::string &name) const
+{
+    return m_Filter.empty() || name.find(m_Filter) != std::string::npos;
+}
+
+void BenchmarkRunner::AddContext(const std::string &key, const std::string &value)
+{
+    m_Context.emplace_back(key, value);
+}
+
+const BenchmarkResult &BenchmarkRunner::Run(const std::string &name, const std::string &params, int iterations,
+                                            const std::function<void()> &fn)
+{
+    for (int i = 0; i < m_Warmup; i++)
+    {
+        fn();
+    }
+
+    std::vector<double> samples_ms;
+    samples_ms.reserve(iterations);
+
+    for (int i = 0; i < iterations; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        samples_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+
+    return AddSamples(name, params, std::move(samples_ms));
+}
+
+const BenchmarkResult &BenchmarkRunner::AddSamples(const std::string &name, const std::string &params,
+                                                   std::vector<double> samples_ms)
+{
+    BenchmarkResult result{name, params, static_cast<int>(samples_ms.size()), 0, 0, 0, 0, 0, 0};
+
+    if (!samples_ms.empty())
+    {
+        std::sort(samples_ms.begin(), samples_ms.end());
+
+        double sum = 0;
+        for (double sample : samples_ms)
+        {
+            sum += sample;
+        }
+        result.MeanMs = sum / samples_ms.size();
+
+        double variance = 0;
+        for (double sample : samples_ms)
+        {
+            variance += (sample - result.MeanMs) * (sample - result.MeanMs);
+        }
+        result.StdDevMs = std::sqrt(variance / samples_ms.size());
+
+        result.MinMs = samples_ms.front();
+        result.MaxMs = samples_ms.back();
+        result.MedianMs = samples_ms[samples_ms.size() / 2];
+        result.P95Ms = samples_ms[std::min(samples_ms.size() - 1, samples_ms.size() * 95 / 100)];
+    }
+
+    std::cout << name << " [" << params << "]: mean " << result.MeanMs << "ms, median " << result.MedianMs
+              << "ms, p95 " << result.P95Ms << "ms (" << result.Iterations << " iterations)\n";
+
+    m_Results.push_back(result);
+    return m_Results.back();
+}
+
+const std::vector<BenchmarkResult> &BenchmarkRunner::Results() const
+{
+    return m_Results;
+}
+
+void BenchmarkRunner::WriteJson(const std::string &filepath) const
+{
+    std::ofstream output(filepath);
+    if (!output)
+    {
+        std::cerr << "could not open benchmark output " << filepath << "\n";
+        return;
+    }
+
+    output << "{\"suite\":" << json_string(m_Suite) << ",";
+    output << "\"timestamp\":" << static_cast<long long>(std::time(nullptr)) << ",";
+
+    output << "\"context\":{";
+    for (size_t i = 0; i < m_Context.size(); i++)
+    {
+        if (i > 0)
+            output << ",";
+        output << json_string(m_Context[i].first) << ":" << json_string(m_Context[i].second);
+    }
+    output << "},";
+
+    output << "\"benchmarks\":[";
+    for (size_t i = 0; i < m_Results.size(); i++)
+    {
+        const auto &result = m_Results[i];
+        if (i > 0)
+            output << ",";
+        output << "{";
+        output << "\"name\":" << json_string(result.Name) << ",";
+        output << "\"params\":" << json_string(result.Params) << ",";
+        output << "\"iterations\":" << result.Iterations << ",";
+        output << "\"mean_ms\":" << result.MeanMs << ",";
+        output << "\"median_ms\":" << result.MedianMs << ",";
+        output << "\"p95_ms\":" << result.P95Ms << ",";
+        output << "\"min_ms\":" << result.MinMs << ",";
+        output << "\"max_ms\":" << result.MaxMs << ",";
+        output << "\"stddev_ms\":" << result.StdDevMs;
+        output << "}";
+    }
+    output << "]}";
+}
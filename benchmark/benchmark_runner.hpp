@@ -0,0 +1,64 @@
+//
+// Parameterised benchmark runner
+//
+// Usage:
+//
+// BenchmarkRunner runner("whisper");
+// runner.Run("fft", "n=400", 100, [&]() {
+//     // Code
+// });
+// runner.WriteJson("whisper_bench.json");
+//
+// Every case runs a few untimed warmup iterations and is then timed per iteration. The results of all cases
+// are written to a single json file so runs of different commits can be compared.
+//
+#pragma once
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct BenchmarkResult
+{
+    std::string Name;
+    std::string Params;
+    int Iterations;
+    double MeanMs;
+    double MedianMs;
+    double P95Ms;
+    double MinMs;
+    double MaxMs;
+    double StdDevMs;
+};
+
+class BenchmarkRunner
+{
+public:
+    BenchmarkRunner(const std::string &suite, int warmup = 1);
+
+    // only run the cases whose name contains the filter
+    void SetFilter(const std::string &filter);
+    bool IsEnabled(const std::string &name) const;
+
+    // extra key/value pairs written at the top of the json, eg. the commit or the thread count
+    void AddContext(const std::string &key, const std::string &value);
+
+    const BenchmarkResult &Run(const std::string &name, const std::string &params, int iterations,
+                               const std::function<void()> &fn);
+
+    // for cases that time themselves, eg. per chunk latencies of a replayed stream
+    const BenchmarkResult &AddSamples(const std::string &name, const std::string &params,
+                                      std::vector<double> samples_ms);
+
+    const std::vector<BenchmarkResult> &Results() const;
+
+    void WriteJson(const std::string &filepath) const;
+
+private:
+    std::string m_Suite;
+    int m_Warmup;
+    std::string m_Filter;
+    std::vector<std::pair<std::string, std::string>> m_Context;
+    std::vector<BenchmarkResult> m_Results;
+};
@@ -87,7 +87,7 @@ void InstrumentationTimer::Stop()
     m_Stopped = true;
 }
 
-Timer::Timer(char *name)
+Timer::Timer(const char *name)
 {
     m_Name = name;
     m_StartTimePoint = std::chrono::high_resolution_clock::now();
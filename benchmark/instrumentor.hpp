@@ -38,13 +38,13 @@ struct InstrumentationSession
 class Timer
 {
 public:
-    Timer(char* name);
+    Timer(const char* name);
     void Stop();
     ~Timer();
 
 private:
     bool stopped = false;
-    char *m_Name = "";
+    const char *m_Name = "";
     std::chrono::time_point<std::chrono::high_resolution_clock> m_StartTimePoint;
 };
 
@@ -1,9 +1,22 @@
 #include <iostream>
+#include <vector>
 
+#include "benchmark_runner.hpp"
 #include "instrumentor.hpp"
 
 int main()
 {
 	Timer timer("test timer");
 	std::cout << "testing timer\n";
-}
\ No newline at end of file
+
+	BenchmarkRunner runner("benchmark_test");
+	std::vector<float> data(1 << 20, 1.0f);
+	runner.Run("sum", "n=1048576", 10, [&]() {
+		volatile float sum = 0;
+		for (float value : data)
+		{
+			sum = sum + value;
+		}
+	});
+	runner.WriteJson("benchmark_test.json");
+}
@@ -1,24 +1,35 @@
 #include "feature_extractor.hpp"
 
-#include "Instrumentor.hpp"
+#include "instrumentor.hpp"
 #include "tokenizer.hpp"
 
 #include <cmath>
 #include <complex>
-#include <corecrt_math_defines.h>
+#include <cstdio>
 #include <stdexcept> // for runtime_error
 #include <iostream>
 #include <vector>
-#include <cmath>
 #include <cstring>
 #include <fftw3.h>
 
+// msvc only defines M_PI with _USE_MATH_DEFINES, which has to come before the first <cmath> of the translation unit
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 
 featureExtractor::FeatureExtractor::FeatureExtractor(int feature_size, int sampling_rate, int hop_length, int chunk_length, int n_fft)
     : n_fft_(n_fft), hop_length_(hop_length), chunk_length_(chunk_length), n_samples_(chunk_length * sampling_rate),
       nb_max_frames(n_samples_ / hop_length), time_per_frame(hop_length / static_cast<float>(sampling_rate)),
-      sampling_rate_(sampling_rate), mel_filters_(get_mel_filters(sampling_rate, n_fft, feature_size))
+      sampling_rate_(sampling_rate), mel_filters_(get_mel_filters(sampling_rate, n_fft, feature_size)),
+      fft_plan_(kernels::make_fft_plan(n_fft)),
+      parallel_for_([](size_t count, const std::function<void(size_t, size_t)> &fn) { fn(0, count); })
+{
+}
+
+void featureExtractor::FeatureExtractor::set_parallel_for(ParallelFor parallel_for)
 {
+    parallel_for_ = std::move(parallel_for);
 }
 
 
@@ -106,11 +117,25 @@ std::vector<std::vector<float>> featureExtractor::FeatureExtractor::get_mel_filt
     return weights;
 }
 
-std::vector<std::vector<size_t>> featureExtractor::FeatureExtractor::get_prompt(Tokenizer tokenizer)
+std::vector<std::vector<size_t>> featureExtractor::FeatureExtractor::get_prompt(const Tokenizer &tokenizer,
+                                                                               const std::string &language,
+                                                                               const std::string &task)
 {
     std::vector<std::vector<size_t>> prompt;
     size_t id = tokenizer.token_to_id("<|startoftranscript|>");
     std::vector<size_t> in_prompt{id};
+    for (const auto &token : {language, task})
+    {
+        const int token_id = token.empty() ? -1 : tokenizer.token_to_id("<|" + token + "|>");
+        if (token_id >= 0)
+        {
+            in_prompt.push_back(token_id);
+        }
+        else if (!token.empty())
+        {
+            fprintf(stderr, "%s: unknown prompt token <|%s|>\n", __func__, token.c_str());
+        }
+    }
     prompt.push_back(in_prompt);
     return prompt;
 }
@@ -144,7 +169,7 @@ std::vector<std::vector<float>> featureExtractor::FeatureExtractor::subtract_out
     return result;
 }
 
-std::vector<std::vector<float>> featureExtractor::FeatureExtractor::from_wave(const std::vector<float> &waveform, bool center = true)
+std::vector<std::vector<float>> featureExtractor::FeatureExtractor::from_wave(const std::vector<float> &waveform, bool center)
 {
     Timer timer("timer from_wave");
     std::vector<std::vector<float>> frames;
@@ -188,9 +213,10 @@ std::vector<std::vector<float>> featureExtractor::FeatureExtractor::from_wave(co
 
                 std::copy(frame.begin(), frame.end(), padded_frame.begin() + padd_width_left);
 
+                // reflect without repeating the edge sample, like np.pad(mode="reflect")
                 for (int j = 0; j < padd_width_right; j++)
                 {
-                    padded_frame[padded_frame.size() - j - 1] = waveform[waveform.size() - j - 1];
+                    padded_frame[frame.size() + j] = waveform[waveform.size() - j - 2];
                 }
 
                 frame = padded_frame;
@@ -269,34 +295,39 @@ std::vector<std::vector<std::complex<float>>> featureExtractor::FeatureExtractor
     int num_fft_bins = (fft_size >> 1) + 1;
 
     std::vector<std::vector<std::complex<float>>> data(num_fft_bins, std::vector<std::complex<float>>(frames.size()));
-    std::vector<float> fft_signal(fft_size);
 
-    for (int f = 0; f < frames.size(); f++)
+    const kernels::FftPlan local_plan = fft_size == fft_plan_.n ? kernels::FftPlan() : kernels::make_fft_plan(fft_size);
+    const kernels::FftPlan &plan = fft_size == fft_plan_.n ? fft_plan_ : local_plan;
+
+    if (window.size() != frame_size)
     {
-        auto frame = frames[f];
+        throw std::invalid_argument("Window size must equal frame size");
+    }
 
-        if (window.size() != frame_size)
-        {
-            throw std::invalid_argument("Window size must equal frame size");
-        }
+    // every range of frames writes its own columns of data
+    parallel_for_(frames.size(), [&](size_t begin, size_t end) {
+        std::vector<float> fft_signal(fft_size, 0.0f);
+        std::vector<float> bins_re(num_fft_bins);
+        std::vector<float> bins_im(num_fft_bins);
+        std::vector<float> scratch(4 * fft_size);
 
-        for (int i = 0; i < frame_size; i++)
+        for (size_t f = begin; f < end; f++)
         {
-            fft_signal[i] = frame[i] * window[i];
-        }
+            const auto &frame = frames[f];
 
-        for (int i = frame_size; i < fft_size; i++)
-        {
-            fft_signal[i] = 0;
-        }
+            for (int i = 0; i < frame_size; i++)
+            {
+                fft_signal[i] = frame[i] * window[i];
+            }
 
-        auto fft_result = fft(fft_signal);
+            kernels::fft_real(plan, fft_signal.data(), bins_re.data(), bins_im.data(), num_fft_bins, scratch.data());
 
-        for (int i = 0; i < num_fft_bins; i++)
-        {
-            data[i][f] = fft_result[i];
+            for (int i = 0; i < num_fft_bins; i++)
+            {
+                data[i][f] = std::complex<float>(bins_re[i], bins_im[i]);
+            }
         }
-    }
+    });
 
     return data;
 }
@@ -305,15 +336,20 @@ std::vector<std::vector<std::complex<float>>> featureExtractor::FeatureExtractor
 std::vector<std::complex<float>> featureExtractor::FeatureExtractor::fft(std::vector<float> &signal)
 {
     int n = signal.size();
-    std::vector<std::complex<float>> signal_cpx(n);
+    const kernels::FftPlan local_plan = n == fft_plan_.n ? kernels::FftPlan() : kernels::make_fft_plan(n);
+    const kernels::FftPlan &plan = n == fft_plan_.n ? fft_plan_ : local_plan;
+
+    std::vector<float> re(n);
+    std::vector<float> im(n);
+    std::vector<float> scratch(4 * n);
+    kernels::fft_real(plan, signal.data(), re.data(), im.data(), n, scratch.data());
 
+    std::vector<std::complex<float>> signal_cpx(n);
     for (int i = 0; i < n; i++)
     {
-        signal_cpx[i] = std::complex<float>(signal[i], 0);
+        signal_cpx[i] = std::complex<float>(re[i], im[i]);
     }
 
-    fft(signal_cpx);
-
     return signal_cpx;
 }
 
@@ -326,6 +362,22 @@ void featureExtractor::FeatureExtractor::fft(std::vector<std::complex<float>> &s
         return;
     }
 
+    // n_fft = 400 = 16 * 25, the radix-2 split stops at odd sizes, those are done as a direct dft
+    if (n % 2 != 0)
+    {
+        std::vector<std::complex<float>> input(signal);
+        for (int k = 0; k < n; k++)
+        {
+            std::complex<double> sum = 0;
+            for (int t = 0; t < n; t++)
+            {
+                sum += std::complex<double>(input[t]) * std::polar(1.0, -2 * M_PI * ((k * t) % n) / n);
+            }
+            signal[k] = std::complex<float>(sum);
+        }
+        return;
+    }
+
     std::vector<std::complex<float>> even(n / 2);
     std::vector<std::complex<float>> odd(n / 2);
 
@@ -367,25 +419,24 @@ std::vector<std::vector<float>> featureExtractor::FeatureExtractor::apply_mel_fi
     const size_t n_frames = magnitudes[0].size();
     std::vector<std::vector<float>> mel_spec(n_mel_filters, std::vector<float>(n_frames, 0.0f));
 
-#pragma omp parallel for
-    for (size_t i = 0; i < n_mel_filters; i++)
-    {
-        const float *mel_filter_ptr = &mel_filters_[i][0];
-        float *mel_spec_ptr = &mel_spec[i][0];
-
-        for (size_t j = 0; j < n_frames; j++)
+    parallel_for_(n_mel_filters, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
         {
-            const float *magnitudes_ptr = &magnitudes[0][j];
-            float sum = 0.0f;
+            const float *mel_filter_ptr = &mel_filters_[i][0];
+            float *mel_spec_ptr = &mel_spec[i][0];
 
             for (size_t k = 0; k < n_magnitudes; k++)
             {
-                sum += mel_filter_ptr[k] * magnitudes_ptr[k];
-            }
+                const float weight = mel_filter_ptr[k];
+                if (weight == 0.0f)
+                {
+                    continue;
+                }
 
-            mel_spec_ptr[j] = sum;
+                kernels::axpy(mel_spec_ptr, &magnitudes[k][0], weight, n_frames);
+            }
         }
-    }
+    });
 
     return mel_spec;
 }
@@ -397,10 +448,7 @@ std::vector<std::vector<float>> featureExtractor::FeatureExtractor::apply_logari
     std::vector<std::vector<float>> output(input.size(), std::vector<float>(input[0].size()));
     for (int i = 0; i < input.size(); i++)
     {
-        for (int j = 0; j < input[i].size(); j++)
-        {
-            output[i][j] = log10(std::max(input[i][j], 1e-10f));
-        }
+        kernels::log10_clamp(input[i].data(), output[i].data(), input[i].size(), 1e-10f);
     }
     return output;
 }
@@ -467,7 +515,8 @@ std::vector<std::vector<float>> featureExtractor::FeatureExtractor::stft_magnitu
     {
         for (int b = 0; b < num_fft_bins - 1; b++)
         {
-            magnitudes[f][b] = std::abs(stft[f][b]);
+            // power spectrum, same as np.abs(stft) ** 2 in the reference
+            magnitudes[f][b] = std::norm(stft[f][b]);
         }
     }
 
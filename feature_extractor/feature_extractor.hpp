@@ -1,11 +1,16 @@
 #pragma once
+#include "kernels.hpp"
 #include "tokenizer.hpp"
 
 #include <complex>
+#include <functional>
 #include <vector>
 
 namespace featureExtractor
 {
+    // runs fn over [0, count) in ranges, possibly on other threads; lets the application plug in its thread pool
+    using ParallelFor = std::function<void(size_t count, const std::function<void(size_t begin, size_t end)>& fn)>;
+
     class FeatureExtractor
     {
     private:
@@ -15,10 +20,28 @@ namespace featureExtractor
         int n_samples_;
         int sampling_rate_;
         std::vector<std::vector<float>> mel_filters_;
+        kernels::FftPlan fft_plan_;
+        ParallelFor parallel_for_;
         std::vector<float> diff(std::vector<float> arr);
         std::vector<std::vector<float>> subtract_outer(std::vector<float> arr1, std::vector<float> arr2);
-        std::vector<std::vector<float>> from_wave(const std::vector<float>& waveform, bool center);
 
+    public:
+        int nb_max_frames;
+        float time_per_frame;
+        FeatureExtractor(int feature_size = 80, int sampling_rate = 16000, int hop_length = 160, int chunk_length = 30,
+            int n_fft = 400);
+        std::vector<std::vector<float>> get_mel_filters(int sampling_rate, int n_fft, int n_mels);
+        const std::vector<std::vector<float>>& mel_filters() const { return mel_filters_; }
+        // <|startoftranscript|> followed by <|language|> and <|task|> when they are given (multilingual models)
+        std::vector<std::vector<size_t>> get_prompt(const Tokenizer& tokenizer, const std::string& language = "",
+            const std::string& task = "");
+        // the stft and the mel filter bank are split over parallel_for, serial until one is set
+        void set_parallel_for(ParallelFor parallel_for);
+
+        std::vector<std::vector<float>> extract(std::vector<float> waveform, bool padding);
+
+        // stages of extract, public so they can be benchmarked and tested on their own
+        std::vector<std::vector<float>> from_wave(const std::vector<float>& waveform, bool center = true);
         std::vector<std::vector<float>> stft_magnitudes(const std::vector<std::vector<std::complex<float>>>& stft);
         std::vector<std::vector<std::complex<float>>> stft(std::vector<std::vector<float>>& frames,
             std::vector<float>& window, int n_fft);
@@ -29,16 +52,5 @@ namespace featureExtractor
             const std::vector<std::vector<float>>& mel_filters_);
         std::vector<std::vector<float>> apply_logarithm(const std::vector<std::vector<float>>& input);
         void normalize(std::vector<std::vector<float>>& input);
-
-    public:
-        int nb_max_frames;
-        float time_per_frame;
-        FeatureExtractor(int feature_size = 80, int sampling_rate = 16000, int hop_length = 160, int chunk_length = 30,
-            int n_fft = 400);
-        std::vector<std::vector<float>> get_mel_filters(int sampling_rate, int n_fft, int n_mels);
-        std::vector<std::vector<size_t>> get_prompt(Tokenizer tokenizer);
-
-        std::vector<std::vector<float>> extract(std::vector<float> waveform, bool padding);
-
     };
 }
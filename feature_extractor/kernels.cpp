@@ -0,0 +1,173 @@
+#include "kernels.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+static constexpr double s_two_pi = 6.283185307179586476925286766559;
+
+featureExtractor::kernels::FftPlan featureExtractor::kernels::make_fft_plan(int n)
+{
+    FftPlan plan;
+    plan.n = n;
+    plan.base = n;
+    while (plan.base > 1 && plan.base % 2 == 0)
+    {
+        plan.base /= 2;
+        plan.levels++;
+    }
+
+    const int m = plan.base;
+    plan.base_cos.resize(m * m);
+    plan.base_sin.resize(m * m);
+    for (int t = 0; t < m; t++)
+    {
+        for (int k = 0; k < m; k++)
+        {
+            const double angle = s_two_pi * ((k * t) % m) / m;
+            plan.base_cos[t * m + k] = static_cast<float>(std::cos(angle));
+            plan.base_sin[t * m + k] = static_cast<float>(-std::sin(angle));
+        }
+    }
+
+    for (int l = 1; l <= plan.levels; l++)
+    {
+        const int size = m << l;
+        for (int k = 0; k < size / 2; k++)
+        {
+            const double angle = s_two_pi * k / size;
+            plan.twiddle_re.push_back(static_cast<float>(std::cos(angle)));
+            plan.twiddle_im.push_back(static_cast<float>(-std::sin(angle)));
+        }
+    }
+
+    return plan;
+}
+
+// direct dfts of the odd sized leaves, leaf o holds the samples o, o + groups, o + 2 * groups, ...
+FEATURE_EXTRACTOR_DISPATCH
+static void fft_leaves(const float *input, int groups, int m, const float *base_cos, const float *base_sin,
+                       float *out_re, float *out_im)
+{
+    for (int o = 0; o < groups; o++)
+    {
+        float *re = out_re + o * m;
+        float *im = out_im + o * m;
+        for (int k = 0; k < m; k++)
+        {
+            re[k] = 0.0f;
+            im[k] = 0.0f;
+        }
+
+        for (int t = 0; t < m; t++)
+        {
+            const float x = input[o + groups * t];
+            const float *c = base_cos + t * m;
+            const float *s = base_sin + t * m;
+            for (int k = 0; k < m; k++)
+            {
+                re[k] += x * c[k];
+                im[k] += x * s[k];
+            }
+        }
+    }
+}
+
+// one radix-2 level: node o combines the even half o and the odd half o + nodes of the previous level
+FEATURE_EXTRACTOR_DISPATCH
+static void fft_level(const float *src_re, const float *src_im, float *dst_re, float *dst_im, int nodes, int half,
+                      const float *w_re, const float *w_im)
+{
+    for (int o = 0; o < nodes; o++)
+    {
+        const float *even_re = src_re + o * half;
+        const float *even_im = src_im + o * half;
+        const float *odd_re = src_re + (o + nodes) * half;
+        const float *odd_im = src_im + (o + nodes) * half;
+        float *lo_re = dst_re + o * 2 * half;
+        float *lo_im = dst_im + o * 2 * half;
+        float *hi_re = lo_re + half;
+        float *hi_im = lo_im + half;
+
+        for (int k = 0; k < half; k++)
+        {
+            const float t_re = w_re[k] * odd_re[k] - w_im[k] * odd_im[k];
+            const float t_im = w_re[k] * odd_im[k] + w_im[k] * odd_re[k];
+            lo_re[k] = even_re[k] + t_re;
+            lo_im[k] = even_im[k] + t_im;
+            hi_re[k] = even_re[k] - t_re;
+            hi_im[k] = even_im[k] - t_im;
+        }
+    }
+}
+
+void featureExtractor::kernels::fft_real(const FftPlan &plan, const float *input, float *out_re, float *out_im,
+                                         int num_bins, float *scratch)
+{
+    const int n = plan.n;
+    const int m = plan.base;
+    const int groups = 1 << plan.levels;
+
+    float *src_re = scratch;
+    float *src_im = scratch + n;
+    float *dst_re = scratch + 2 * n;
+    float *dst_im = scratch + 3 * n;
+
+    fft_leaves(input, groups, m, plan.base_cos.data(), plan.base_sin.data(), src_re, src_im);
+
+    int twiddle_offset = 0;
+    for (int l = 1; l <= plan.levels; l++)
+    {
+        const int half = m << (l - 1);
+        fft_level(src_re, src_im, dst_re, dst_im, groups >> l, half, plan.twiddle_re.data() + twiddle_offset,
+                  plan.twiddle_im.data() + twiddle_offset);
+        twiddle_offset += half;
+        std::swap(src_re, dst_re);
+        std::swap(src_im, dst_im);
+    }
+
+    std::memcpy(out_re, src_re, num_bins * sizeof(float));
+    std::memcpy(out_im, src_im, num_bins * sizeof(float));
+}
+
+FEATURE_EXTRACTOR_DISPATCH
+void featureExtractor::kernels::axpy(float *out, const float *in, float weight, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] += weight * in[i];
+    }
+}
+
+// log10 without a libm call so the loop vectorizes: x = 2^e * m with m in [sqrt(1/2), sqrt(2)), and
+// ln(m) = 2 * atanh((m - 1) / (m + 1)) as a series, the first five terms are exact to float precision
+FEATURE_EXTRACTOR_DISPATCH
+void featureExtractor::kernels::log10_clamp(const float *in, float *out, size_t n, float floor)
+{
+    const float ln2 = 0.693147180559945309f;
+    const float inv_ln10 = 0.434294481903251828f;
+    const float sqrt2 = 1.41421356237309505f;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const float x = in[i] > floor ? in[i] : floor;
+
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        float e = static_cast<float>(static_cast<int32_t>(bits >> 23) - 127);
+        bits = (bits & 0x007fffffu) | 0x3f800000u;
+        float m;
+        std::memcpy(&m, &bits, sizeof(m));
+
+        const bool large = m > sqrt2;
+        m = large ? m * 0.5f : m;
+        e = large ? e + 1.0f : e;
+
+        const float s = (m - 1.0f) / (m + 1.0f);
+        const float s2 = s * s;
+        const float series = s * (2.0f + s2 * (2.0f / 3.0f + s2 * (2.0f / 5.0f + s2 * (2.0f / 7.0f + s2 * (2.0f / 9.0f)))));
+
+        out[i] = (e * ln2 + series) * inv_ln10;
+    }
+}
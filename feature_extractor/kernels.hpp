@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// The hot loops of the feature extractor. On x86-64 linux with gcc/clang every kernel is compiled for avx512f,
+// avx2, sse4.2 and the baseline, and the loader picks the best version for the cpu it runs on (function
+// multiversioning through ifunc), so one binary runs at full speed on every machine. Other platforms get the
+// baseline build only.
+#if defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__)) &&                     \
+    !defined(FEATURE_EXTRACTOR_NO_DISPATCH)
+#define FEATURE_EXTRACTOR_DISPATCH __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define FEATURE_EXTRACTOR_DISPATCH
+#endif
+
+namespace featureExtractor
+{
+    namespace kernels
+    {
+        // precomputed tables for a real input fft of size n = 2^levels * base (base odd), eg. 400 = 16 * 25
+        struct FftPlan
+        {
+            int n = 0;
+            int levels = 0;
+            int base = 0;
+            // base x base dft table, transposed so the inner loop runs over the output bin
+            std::vector<float> base_cos;
+            std::vector<float> base_sin;
+            // twiddles of every radix-2 level one after the other
+            std::vector<float> twiddle_re;
+            std::vector<float> twiddle_im;
+        };
+
+        FftPlan make_fft_plan(int n);
+
+        // fft of n real samples, writes the first num_bins bins; scratch must hold 4 * n floats
+        void fft_real(const FftPlan& plan, const float* input, float* out_re, float* out_im, int num_bins,
+                      float* scratch);
+
+        // out[i] += weight * in[i]
+        void axpy(float* out, const float* in, float weight, size_t n);
+
+        // out[i] = log10(max(in[i], floor))
+        void log10_clamp(const float* in, float* out, size_t n, float floor);
+    }
+}
@@ -1,6 +1,6 @@
 #include "feature_extractor.hpp"
 #include "tokenizer.hpp"
-#include "benchmark/Instrumentor.hpp"
+#include "instrumentor.hpp"
 
 // TODO: write a test for the extract function that measures performance and checks the output to make sure it's the same as in the python __call__ function
 int feature_extractor_test()
@@ -0,0 +1,53 @@
+"""Writes the golden outputs of every FeatureExtractor stage as .npy files.
+
+The C++ golden test (whisper_golden_test) loads them and compares each stage of
+featureExtractor::FeatureExtractor against this reference, so re-run this script
+whenever feature_extractor.py changes and commit the fixtures.
+"""
+
+import os
+
+import numpy as np
+
+from feature_extractor import FeatureExtractor
+
+FIXTURES_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "fixtures")
+
+
+def make_waveform(seconds=2.0, sampling_rate=16000, seed=0):
+    # a chirp with some harmonics and noise, deterministic so the fixtures are reproducible
+    rng = np.random.default_rng(seed)
+    t = np.arange(int(seconds * sampling_rate)) / sampling_rate
+    f0 = 120.0 + 200.0 * t / seconds
+    phase = 2.0 * np.pi * np.cumsum(f0) / sampling_rate
+    waveform = 0.2 * np.sin(phase) + 0.05 * np.sin(3.0 * phase) + 0.01 * rng.standard_normal(t.shape)
+    return waveform.astype(np.float32)
+
+
+def save(name, array):
+    np.save(os.path.join(FIXTURES_DIR, name + ".npy"), np.ascontiguousarray(array, dtype=np.float32))
+
+
+def generate_fixtures():
+    os.makedirs(FIXTURES_DIR, exist_ok=True)
+
+    feature_extractor = FeatureExtractor()
+    waveform = make_waveform()
+
+    # same steps as FeatureExtractor.__call__ without padding, keeping every intermediate result
+    window = np.hanning(feature_extractor.n_fft + 1)[:-1]
+    frames = feature_extractor.fram_wave(waveform)
+    stft = feature_extractor.stft(frames, window=window)
+    magnitudes = np.abs(stft[:, :-1]) ** 2
+    mel_spec = feature_extractor.mel_filters @ magnitudes
+    log_spec = feature_extractor(waveform, padding=False)
+
+    save("waveform", waveform)
+    save("mel_filters", feature_extractor.mel_filters)
+    save("magnitudes", magnitudes)
+    save("mel_spec", mel_spec)
+    save("log_spec", log_spec)
+
+
+if __name__ == "__main__":
+    generate_fixtures()
@@ -7,8 +7,35 @@
 #include <unordered_map>
 #include <vector>
 
+// same table as bytes_to_unicode in the gpt-2 encoder: printable latin-1 bytes stand for themselves, the other
+// bytes are shifted to 256 and up
+static std::unordered_map<uint32_t, char> make_byte_decoder()
+{
+    std::unordered_map<uint32_t, char> byte_decoder;
+    uint32_t shifted = 0;
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        const bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+        byte_decoder[printable ? b : 256 + shifted++] = static_cast<char>(b);
+    }
+    return byte_decoder;
+}
+
+// next code point of a utf-8 string, advances pos
+static uint32_t next_code_point(const std::string &text, size_t &pos)
+{
+    const unsigned char lead = text[pos++];
+    int extra = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    uint32_t code_point = extra == 0 ? lead : lead & (0x3F >> extra);
+    while (extra-- > 0 && pos < text.size())
+    {
+        code_point = (code_point << 6) | (static_cast<unsigned char>(text[pos++]) & 0x3F);
+    }
+    return code_point;
+}
+
 featureExtractor::Tokenizer::Tokenizer(std::string model_path)
-    : num_special_tokens_(0)
+    : num_special_tokens_(0), byte_decoder_(make_byte_decoder())
 {
 
     std::string tokenizer_file = model_path + "/tokenizer.json";
@@ -17,13 +44,31 @@ featureExtractor::Tokenizer::Tokenizer(std::string model_path)
         std::ifstream ifs(tokenizer_file);
         if (ifs)
         {
-            tokenizer_json_;
             ifs >> tokenizer_json_;
 
-            #pragma omp parallel for
+            for (const auto &item : tokenizer_json_["model"]["vocab"].items())
+            {
+                const size_t id = item.value().get<size_t>();
+                if (id >= id_to_token_.size())
+                {
+                    id_to_token_.resize(id + 1);
+                    is_special_.resize(id + 1, false);
+                }
+                id_to_token_[id] = item.key();
+            }
+
             for (const auto &token : tokenizer_json_["added_tokens"])
             {
+                const size_t id = token["id"].get<size_t>();
                 token_to_id_[token["content"]] = token["id"];
+                if (id >= id_to_token_.size())
+                {
+                    id_to_token_.resize(id + 1);
+                    is_special_.resize(id + 1, false);
+                }
+                id_to_token_[id] = token["content"];
+                is_special_[id] = true;
+                num_special_tokens_++;
             }
         }
     }
@@ -57,16 +102,20 @@ std::string featureExtractor::Tokenizer::decode(const std::vector<size_t> &token
     std::string decoded_text;
     for (const auto &token : tokens)
     {
-        if (token <= num_special_tokens_)
+        if (token >= id_to_token_.size() || is_special_[token])
         {
-            // Special token, skip
+            // special or unknown token, skip
             continue;
         }
-        const auto &it =
-            std::find_if(token_map_.begin(), token_map_.end(), [&](const auto &item) { return item.second == token; });
-        if (it != token_map_.end())
+
+        const std::string &piece = id_to_token_[token];
+        for (size_t pos = 0; pos < piece.size();)
         {
-            decoded_text += it->first;
+            const auto it = byte_decoder_.find(next_code_point(piece, pos));
+            if (it != byte_decoder_.end())
+            {
+                decoded_text += it->second;
+            }
         }
     }
     return decoded_text;
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -20,8 +21,12 @@ namespace featureExtractor
         std::string language_;
         int num_special_tokens_;
         std::unordered_map<std::string, int> special_tokens_;
-        std::unordered_map<std::string, int> token_map_;
         std::unordered_map<std::string, int> token_to_id_;
+        // vocabulary indexed by id, the added tokens are flagged as special and skipped by decode
+        std::vector<std::string> id_to_token_;
+        std::vector<bool> is_special_;
+        // byte level bpe stores every byte as a printable unicode character, this maps them back
+        std::unordered_map<uint32_t, char> byte_decoder_;
     };
 
 }
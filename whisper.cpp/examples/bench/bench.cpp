@@ -1,13 +1,21 @@
 #include "whisper.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <ctime>
 #include <string>
 #include <thread>
+#include <vector>
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t what = 0; // what to benchmark: 0 - whisper ecoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t n_decode = 64;        // single token decoder steps after the encoder
+    int32_t cpu_core_offset = -1; // pin the compute threads to the cores from here, -1 - not pinned
+    int32_t mmap = -1;            // -1 - read the model, else map it with these whisper_mmap_flags
+    int32_t n_batch = 1;          // windows to encode one by one and then in a single batch
 
     std::string model = "models/ggml-base.en.bin";
 };
@@ -25,6 +33,10 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
         else if (arg == "-t" || arg == "--threads") { params.n_threads = std::stoi(argv[++i]); }
         else if (arg == "-m" || arg == "--model")   { params.model     = argv[++i]; }
         else if (arg == "-w" || arg == "--what")    { params.what     = atoi(argv[++i]); }
+        else if (arg == "-d" || arg == "--decode")  { params.n_decode = std::stoi(argv[++i]); }
+        else if (arg == "-a" || arg == "--affinity") { params.cpu_core_offset = std::stoi(argv[++i]); }
+        else if (arg == "-mm" || arg == "--mmap")   { params.mmap     = std::stoi(argv[++i]); }
+        else if (arg == "-b" || arg == "--batch")   { params.n_batch  = std::stoi(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params);
@@ -35,6 +47,21 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params) {
     return true;
 }
 
+// wall and process cpu time of fn, cpu / wall above 1 means the threads worked in parallel,
+// and well above the useful work when they spin
+template <typename F>
+static void whisper_bench_time(const char * name, int n, F fn) {
+    const auto   t_wall = std::chrono::steady_clock::now();
+    const clock_t t_cpu = std::clock();
+
+    fn();
+
+    const double cpu_ms  = 1e3*double(std::clock() - t_cpu)/CLOCKS_PER_SEC;
+    const double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_wall).count();
+
+    fprintf(stderr, "%s: %8.3f ms per step, %5.2f cpu / wall\n", name, wall_ms/std::max(n, 1), cpu_ms/std::max(wall_ms, 1e-3));
+}
+
 void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & params) {
     fprintf(stderr, "\n");
     fprintf(stderr, "usage: %s [options]\n", argv[0]);
@@ -43,6 +70,10 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -h,       --help        [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,     --threads N   [%-7d] number of threads to use during computation\n", params.n_threads);
     fprintf(stderr, "  -m FNAME, --model FNAME [%-7s] model path\n",                                  params.model.c_str());
+    fprintf(stderr, "  -d N,     --decode N    [%-7d] number of decoder steps to time after the encoder\n", params.n_decode);
+    fprintf(stderr, "  -a N,     --affinity N  [%-7d] pin the compute threads to cores N.., -1 - not pinned\n", params.cpu_core_offset);
+    fprintf(stderr, "  -mm N,    --mmap N      [%-7d] map the model file, N = flags: 1 - populate, 2 - willneed, -1 - read it\n", params.mmap);
+    fprintf(stderr, "  -b N,     --batch N     [%-7d] time N encoder windows one by one and as one batch\n", params.n_batch);
     fprintf(stderr, "  -w N,     --what N      [%-7d] what to benchmark:\n",                          params.what);
     fprintf(stderr, "                           %-7s  0 - whisper encoder\n",                         "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
@@ -53,7 +84,9 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
 int whisper_bench_encoder(const whisper_params & params) {
     // whisper init
 
-    struct whisper_context * ctx = whisper_init_from_file(params.model.c_str());
+    struct whisper_context * ctx = params.mmap < 0 ?
+        whisper_init_from_file(params.model.c_str()) :
+        whisper_init_from_file_mmap(params.model.c_str(), params.mmap);
 
     {
         fprintf(stderr, "\n");
@@ -70,11 +103,69 @@ int whisper_bench_encoder(const whisper_params & params) {
         return 3;
     }
 
+    whisper_set_cpu_affinity(ctx, params.cpu_core_offset);
+
     if (int ret = whisper_encode(ctx, 0, params.n_threads) != 0) {
         fprintf(stderr, "error: failed to encode model: %d\n", ret);
         return 4;
     }
 
+    // the batched encoder reads the weights once for all windows
+    if (params.n_batch > 1) {
+        std::vector<struct whisper_state *> states;
+        for (int i = 0; i < params.n_batch; ++i) {
+            struct whisper_state * state = whisper_init_state(ctx);
+            if (state == nullptr || whisper_set_mel_with_state(ctx, state, nullptr, 0, WHISPER_N_MEL) != 0) {
+                fprintf(stderr, "error: failed to initialize whisper state %d\n", i);
+                return 6;
+            }
+            states.push_back(state);
+        }
+
+        int ret = 0;
+        fprintf(stderr, "\n");
+        whisper_bench_time("encode", states.size(), [&]() {
+            for (auto * state : states) {
+                ret |= whisper_encode_with_state(ctx, state, 0, params.n_threads);
+            }
+        });
+        whisper_bench_time("batch ", states.size(), [&]() {
+            ret |= whisper_encode_batch(ctx, states.data(), states.size(), 0, params.n_threads);
+        });
+
+        for (auto * state : states) {
+            whisper_free_state(state);
+        }
+
+        if (ret != 0) {
+            fprintf(stderr, "error: failed to encode batch: %d\n", ret);
+            return 7;
+        }
+    }
+
+    // the decoder runs one small graph per token, the cost of waking the threads shows there
+    if (params.n_decode > 0) {
+        const int n_decode = std::min(params.n_decode, whisper_n_text_ctx(ctx)/2);
+
+        int ret = 0;
+        fprintf(stderr, "\n");
+        whisper_bench_time("decode", n_decode, [&]() {
+            whisper_token token = whisper_token_sot(ctx);
+            for (int i = 0; i < n_decode && ret == 0; ++i) {
+                ret = whisper_decode(ctx, &token, 1, i, params.n_threads);
+            }
+        });
+        if (ret != 0) {
+            fprintf(stderr, "error: failed to decode: %d\n", ret);
+            return 5;
+        }
+
+        // the threads are kept between graphs, they must not take any cpu while waiting
+        whisper_bench_time("idle  ", 1, []() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        });
+    }
+
     whisper_print_timings(ctx);
     whisper_free(ctx);
 
@@ -0,0 +1,333 @@
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// rewrites a FP32 or FP16 ggml whisper model with its 2d weights quantized
+//
+// the hparams, the mel filters and the vocab are copied, the ftype of the hparams becomes the new type
+// the biases, norms and positional embeddings stay FP32 and the conv weights FP16, see whisper_model_load()
+
+// the magic of the model file, the aligned one has a padding field after every tensor header, see whisper_model_load()
+#define WHISPER_FILE_MAGIC         0x67676d6c // "ggml"
+#define WHISPER_FILE_MAGIC_ALIGNED 0x67676d61 // "ggma"
+
+// the ftype values of the model file
+enum whisper_ftype {
+    WHISPER_FTYPE_F32  = 0,
+    WHISPER_FTYPE_F16  = 1,
+    WHISPER_FTYPE_Q4_0 = 2,
+    WHISPER_FTYPE_Q8_0 = 3,
+};
+
+template<typename T>
+static void read_safe(std::ifstream & fin, T & dest) {
+    fin.read((char *) &dest, sizeof(T));
+}
+
+template<typename T>
+static void write_safe(std::ofstream & fout, const T & data) {
+    fout.write((const char *) &data, sizeof(T));
+}
+
+static bool whisper_model_quantize(const std::string & fname_inp, const std::string & fname_out, int32_t ftype_out) {
+    printf("%s: loading model from '%s'\n", __func__, fname_inp.c_str());
+
+    auto finp = std::ifstream(fname_inp, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_inp.c_str());
+        return false;
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    // the output is always aligned so that whisper_init_from_file_mmap() can use its weights in place
+    bool aligned_inp = false;
+
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(finp, magic);
+        if (magic != WHISPER_FILE_MAGIC && magic != WHISPER_FILE_MAGIC_ALIGNED) {
+            fprintf(stderr, "%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp.c_str());
+            return false;
+        }
+        aligned_inp = magic == WHISPER_FILE_MAGIC_ALIGNED;
+
+        write_safe(fout, (uint32_t) WHISPER_FILE_MAGIC_ALIGNED);
+    }
+
+    // hparams, the last one is the ftype
+    {
+        int32_t hparams[11];
+        for (int i = 0; i < 11; ++i) {
+            read_safe(finp, hparams[i]);
+        }
+
+        const int32_t ftype_inp = hparams[10];
+        if (ftype_inp != WHISPER_FTYPE_F32 && ftype_inp != WHISPER_FTYPE_F16) {
+            fprintf(stderr, "%s: the model is already quantized (ftype = %d)\n", __func__, ftype_inp);
+            return false;
+        }
+
+        hparams[10] = ftype_out;
+
+        for (int i = 0; i < 11; ++i) {
+            write_safe(fout, hparams[i]);
+        }
+    }
+
+    // mel filters
+    {
+        int32_t n_mel;
+        int32_t n_fft;
+
+        read_safe(finp, n_mel);
+        read_safe(finp, n_fft);
+
+        std::vector<float> filters(n_mel*n_fft);
+        finp.read((char *) filters.data(), filters.size()*sizeof(float));
+
+        write_safe(fout, n_mel);
+        write_safe(fout, n_fft);
+        fout.write((const char *) filters.data(), filters.size()*sizeof(float));
+    }
+
+    // vocab
+    {
+        int32_t n_vocab = 0;
+        read_safe(finp, n_vocab);
+        write_safe(fout, n_vocab);
+
+        std::vector<char> word;
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            read_safe(finp, len);
+
+            word.resize(len);
+            finp.read(word.data(), len);
+
+            write_safe(fout, len);
+            fout.write(word.data(), len);
+        }
+    }
+
+    // weights
+    {
+        size_t total_size_org = 0;
+        size_t total_size_new = 0;
+
+        std::vector<float>       data_f32;
+        std::vector<ggml_fp16_t> data_f16;
+        std::vector<uint8_t>     data_u8;
+        std::vector<char>        work;
+
+        std::vector<int64_t> hist_all(1 << 4, 0);
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ftype;
+
+            read_safe(finp, n_dims);
+            read_safe(finp, length);
+            read_safe(finp, ftype);
+
+            if (finp.eof()) {
+                break;
+            }
+
+            if (n_dims < 1 || n_dims > 3 || (ftype != WHISPER_FTYPE_F32 && ftype != WHISPER_FTYPE_F16)) {
+                fprintf(stderr, "%s: invalid tensor header (n_dims = %d, ftype = %d)\n", __func__, n_dims, ftype);
+                return false;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[3] = { 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(finp, ne[i]);
+                nelements *= ne[i];
+            }
+
+            std::string name(length, 0);
+            finp.read(&name[0], length);
+
+            if (aligned_inp) {
+                int32_t n_pad;
+                read_safe(finp, n_pad);
+                if (n_pad < 0 || n_pad >= 32) {
+                    fprintf(stderr, "%s: invalid padding of tensor '%s' (%d)\n", __func__, name.c_str(), n_pad);
+                    return false;
+                }
+                finp.ignore(n_pad);
+            }
+
+            const size_t bpe = ftype == WHISPER_FTYPE_F16 ? sizeof(ggml_fp16_t) : sizeof(float);
+
+            data_u8.resize(nelements*bpe);
+            finp.read((char *) data_u8.data(), data_u8.size());
+
+            if (!finp) {
+                fprintf(stderr, "%s: unexpected end of file in tensor '%s'\n", __func__, name.c_str());
+                return false;
+            }
+
+            printf("%48s - [%5d, %5d, %5d], type = %6s ", name.c_str(), ne[0], ne[1], ne[2], ftype == WHISPER_FTYPE_F16 ? "f16" : "f32");
+
+            // the weights of the linear layers and the token embedding, the model types them with the ftype of the hparams
+            const bool quantize = n_dims == 2 && name.size() > 7 && name.compare(name.size() - 7, 7, ".weight") == 0 && ne[0] % ggml_blck_size(GGML_TYPE_Q4_0) == 0;
+
+            // the conv weights of a quantized model are FP16
+            const bool to_f16 = n_dims == 3 && ftype == WHISPER_FTYPE_F32;
+
+            int32_t ftype_new = ftype;
+            const char * data_new = (const char *) data_u8.data();
+            size_t size_new = data_u8.size();
+
+            if (quantize) {
+                data_f32.resize(nelements);
+                if (ftype == WHISPER_FTYPE_F16) {
+                    const ggml_fp16_t * src = (const ggml_fp16_t *) data_u8.data();
+                    for (int i = 0; i < nelements; ++i) {
+                        data_f32[i] = ggml_fp16_to_fp32(src[i]);
+                    }
+                } else {
+                    memcpy(data_f32.data(), data_u8.data(), nelements*sizeof(float));
+                }
+
+                work.resize(nelements*sizeof(float)); // upper bound of the quantized size
+
+                std::vector<int64_t> hist_cur(1 << 4, 0);
+
+                switch (ftype_out) {
+                    case WHISPER_FTYPE_Q4_0:
+                        {
+                            size_new = ggml_quantize_q4_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
+                        } break;
+                    case WHISPER_FTYPE_Q8_0:
+                        {
+                            size_new = ggml_quantize_q8_0(data_f32.data(), work.data(), nelements, ne[0], hist_cur.data());
+                        } break;
+                }
+
+                ftype_new = ftype_out;
+                data_new  = work.data();
+
+                printf("quantized, size = %8.3f MB -> %8.3f MB | hist: ", data_u8.size()/1024.0/1024.0, size_new/1024.0/1024.0);
+                for (size_t i = 0; i < hist_cur.size(); ++i) {
+                    hist_all[i] += hist_cur[i];
+                    printf("%5.3f ", hist_cur[i]/(float) nelements);
+                }
+                printf("\n");
+            } else if (to_f16) {
+                data_f16.resize(nelements);
+
+                const float * src = (const float *) data_u8.data();
+                for (int i = 0; i < nelements; ++i) {
+                    data_f16[i] = ggml_fp32_to_fp16(src[i]);
+                }
+
+                ftype_new = WHISPER_FTYPE_F16;
+                data_new  = (const char *) data_f16.data();
+                size_new  = nelements*sizeof(ggml_fp16_t);
+
+                printf("to f16, size = %8.3f MB -> %8.3f MB\n", data_u8.size()/1024.0/1024.0, size_new/1024.0/1024.0);
+            } else {
+                printf("size = %8.3f MB\n", data_u8.size()/1024.0/1024.0);
+            }
+
+            write_safe(fout, n_dims);
+            write_safe(fout, length);
+            write_safe(fout, ftype_new);
+            for (int i = 0; i < n_dims; ++i) {
+                write_safe(fout, ne[i]);
+            }
+            fout.write(name.data(), length);
+
+            // the zeros after the header make the data start at a multiple of 32 bytes in the file
+            {
+                const int32_t n_pad = (32 - ((size_t) fout.tellp() + sizeof(int32_t)) % 32) % 32;
+                const char zeros[32] = { 0 };
+                write_safe(fout, n_pad);
+                fout.write(zeros, n_pad);
+            }
+
+            fout.write(data_new, size_new);
+
+            total_size_org += data_u8.size();
+            total_size_new += size_new;
+        }
+
+        printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+        printf("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+
+        {
+            int64_t sum_all = 0;
+            for (size_t i = 0; i < hist_all.size(); ++i) {
+                sum_all += hist_all[i];
+            }
+
+            printf("%s: hist: ", __func__);
+            for (size_t i = 0; i < hist_all.size(); ++i) {
+                printf("%5.3f ", sum_all ? hist_all[i]/(float) sum_all : 0.0f);
+            }
+            printf("\n");
+        }
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s model-f16.bin model-quant.bin type\n", argv[0]);
+        fprintf(stderr, "  type = q4_0 - 4-bit weights, a float scale per block of 32\n");
+        fprintf(stderr, "  type = q8_0 - 8-bit weights, a float scale per block of 32\n");
+        return 1;
+    }
+
+    // needed to initialize the f16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    const std::string fname_inp = argv[1];
+    const std::string fname_out = argv[2];
+    const std::string type      = argv[3];
+
+    int32_t ftype = 0;
+    if (type == "q4_0") {
+        ftype = WHISPER_FTYPE_Q4_0;
+    } else if (type == "q8_0") {
+        ftype = WHISPER_FTYPE_Q8_0;
+    } else {
+        fprintf(stderr, "%s: unknown type '%s'\n", __func__, type.c_str());
+        return 1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_model_quantize(fname_inp, fname_out, ftype)) {
+        fprintf(stderr, "%s: failed to quantize model from '%s'\n", __func__, fname_inp.c_str());
+        return 1;
+    }
+
+    printf("\n");
+    printf("%s: quantize time = %8.2f ms\n", __func__, (ggml_time_us() - t_start_us)/1000.0);
+
+    return 0;
+}
@@ -328,6 +328,7 @@ bool gpt2_model_load(const std::string & fname, gpt2_model & model, gpt_vocab &
         struct ggml_init_params params;
         params.mem_size   = ctx_size;
         params.mem_buffer = NULL;
+        params.no_alloc   = false;
 
         model.ctx = ggml_init(params);
         if (!model.ctx) {
@@ -531,6 +532,7 @@ bool gpt2_eval(
     struct ggml_init_params params;
     params.mem_size   = buf_size;
     params.mem_buffer = buf;
+    params.no_alloc   = false;
 
     struct ggml_context * ctx0 = ggml_init(params);
 
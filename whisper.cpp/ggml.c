@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
 #include "ggml.h"
 
 #if defined(_MSC_VER) || defined(__MINGW32__)
@@ -13,6 +17,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
 
 // if C99 - static_assert is noop
 // ref: https://stackoverflow.com/a/53923785/4039976
@@ -75,6 +80,13 @@ static int sched_yield (void) {
 typedef void* thread_ret_t;
 #endif
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #ifdef __HAIKU__
 #define static_assert(cond, msg) _Static_assert(cond, msg)
 #endif
@@ -86,6 +98,9 @@ typedef void* thread_ret_t;
 #define GGML_SOFT_MAX_UNROLL 4
 #define GGML_VEC_DOT_UNROLL  2
 
+// positions per step of the online softmax of ggml_flash_attn_kv
+#define GGML_FLASH_ATTN_KV_BLOCK 32
+
 #ifdef GGML_USE_ACCELERATE
 // uncomment to use vDSP for soft max computation
 // note: not sure if it is actually faster
@@ -1035,6 +1050,39 @@ inline static void ggml_vec_mad_f16(const int n, ggml_fp16_t * restrict y, ggml_
 #endif
 }
 
+// y += x*v with y in F32
+inline static void ggml_vec_mad_f32_f16(const int n, float * restrict y, ggml_fp16_t * restrict x, const float v) {
+#if defined(GGML_SIMD) && GGML_F16_EPR == GGML_F32_EPR
+    // y is loaded with the F32 macros at the F16 offsets, so this needs F16 vectors that are F32 registers converted
+    // when loaded (AVX, SSE3, POWER9, WASM, NEON without FP16 arithmetic); anything else takes the scalar loop
+    const int np = (n & ~(GGML_F16_STEP - 1));
+
+    GGML_F32_VEC vx = GGML_F32_VEC_SET1(v);
+
+    GGML_F32_VEC ax[GGML_F16_ARR];
+    GGML_F32_VEC ay[GGML_F16_ARR];
+
+    for (int i = 0; i < np; i += GGML_F16_STEP) {
+        for (int j = 0; j < GGML_F16_ARR; j++) {
+            ax[j] = GGML_F16_VEC_LOAD(x + i + j*GGML_F16_EPR, j);
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j*GGML_F16_EPR);
+            ay[j] = GGML_F32_VEC_FMA(ay[j], ax[j], vx);
+
+            GGML_F32_VEC_STORE(y + i + j*GGML_F16_EPR, ay[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] += GGML_FP16_TO_FP32(x[i])*v;
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+        y[i] += GGML_FP16_TO_FP32(x[i])*v;
+    }
+#endif
+}
+
 //inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) { for (int i = 0; i < n; ++i) y[i] *= v;          }
 inline static void ggml_vec_scale_f32(const int n, float * y, const float   v) {
 #if defined(GGML_SIMD)
@@ -1130,6 +1178,364 @@ inline static void ggml_vec_max_f32(const int n, float * s, const float * x) {
 
 inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x) { ggml_vec_norm_f32(n, s, x); *s = 1./(*s); }
 
+//
+// quantization
+//
+
+// QK weights per block with a float scale d, the weight is d*q
+// Q4_0 keeps weight j of the block in the low nibble of qs[j] and weight j + QK/2 in the high one, as q + 8,
+// so both halves are unpacked with one shift and mask
+#define QK 32
+
+typedef struct {
+    float   d;
+    uint8_t qs[QK/2];
+} block_q4_0;
+static_assert(sizeof(block_q4_0) == sizeof(float) + QK/2, "wrong q4_0 block size/padding");
+
+typedef struct {
+    float  d;
+    int8_t qs[QK];
+} block_q8_0;
+static_assert(sizeof(block_q8_0) == sizeof(float) + QK, "wrong q8_0 block size/padding");
+
+static void quantize_row_q4_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    block_q4_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        // the weight of largest magnitude becomes -8, the one 4-bit value without a positive twin
+        float amax = 0.0f;
+        float max  = 0.0f;
+        for (int j = 0; j < QK; j++) {
+            const float v = x[i*QK + j];
+            if (fabsf(v) > amax) {
+                amax = fabsf(v);
+                max  = v;
+            }
+        }
+
+        const float d  = max / -8;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int j = 0; j < QK/2; ++j) {
+            const float x0 = x[i*QK + j]*id;
+            const float x1 = x[i*QK + QK/2 + j]*id;
+
+            const uint8_t q0 = MIN(15, (int8_t)(x0 + 8.5f));
+            const uint8_t q1 = MIN(15, (int8_t)(x1 + 8.5f));
+
+            y[i].qs[j] = q0 | (q1 << 4);
+        }
+    }
+}
+
+// also the activations of the quantized matrix multiplications, so it is vectorized
+static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    for (int i = 0; i < nb; i++) {
+        __m256 v0 = _mm256_loadu_ps(x + i*QK);
+        __m256 v1 = _mm256_loadu_ps(x + i*QK + 8);
+        __m256 v2 = _mm256_loadu_ps(x + i*QK + 16);
+        __m256 v3 = _mm256_loadu_ps(x + i*QK + 24);
+
+        const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+        __m256 amax = _mm256_andnot_ps(sign_bit, v0);
+        amax = _mm256_max_ps(amax, _mm256_andnot_ps(sign_bit, v1));
+        amax = _mm256_max_ps(amax, _mm256_andnot_ps(sign_bit, v2));
+        amax = _mm256_max_ps(amax, _mm256_andnot_ps(sign_bit, v3));
+
+        __m128 max4 = _mm_max_ps(_mm256_extractf128_ps(amax, 1), _mm256_castps256_ps128(amax));
+        max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+        max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+        const float max_scalar = _mm_cvtss_f32(max4);
+
+        y[i].d = max_scalar / 127.f;
+
+        const __m256 id = _mm256_set1_ps(max_scalar != 0.0f ? 127.f/max_scalar : 0.0f);
+
+        __m256i i0 = _mm256_cvtps_epi32(_mm256_round_ps(_mm256_mul_ps(v0, id), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        __m256i i1 = _mm256_cvtps_epi32(_mm256_round_ps(_mm256_mul_ps(v1, id), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        __m256i i2 = _mm256_cvtps_epi32(_mm256_round_ps(_mm256_mul_ps(v2, id), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        __m256i i3 = _mm256_cvtps_epi32(_mm256_round_ps(_mm256_mul_ps(v3, id), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+
+        // the packs work on 128-bit lanes, the permute puts the 32 bytes back in order
+        i0 = _mm256_packs_epi32(i0, i1);
+        i2 = _mm256_packs_epi32(i2, i3);
+        i0 = _mm256_packs_epi16(i0, i2);
+        i0 = _mm256_permutevar8x32_epi32(i0, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+
+        _mm256_storeu_si256((__m256i *) y[i].qs, i0);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (int i = 0; i < nb; i++) {
+        float32x4_t srcv[8];
+        float32x4_t asrcv[8];
+
+        for (int l = 0; l < 8; l++) srcv[l]  = vld1q_f32(x + i*QK + 4*l);
+        for (int l = 0; l < 8; l++) asrcv[l] = vabsq_f32(srcv[l]);
+        for (int l = 0; l < 4; l++) asrcv[2*l] = vmaxq_f32(asrcv[2*l], asrcv[2*l + 1]);
+        for (int l = 0; l < 2; l++) asrcv[4*l] = vmaxq_f32(asrcv[4*l], asrcv[4*l + 2]);
+
+        const float amax = vmaxvq_f32(vmaxq_f32(asrcv[0], asrcv[4]));
+
+        const float d  = amax / 127.f;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int l = 0; l < 8; l++) {
+            const int32x4_t vi = vcvtnq_s32_f32(vmulq_n_f32(srcv[l], id));
+
+            y[i].qs[4*l + 0] = vgetq_lane_s32(vi, 0);
+            y[i].qs[4*l + 1] = vgetq_lane_s32(vi, 1);
+            y[i].qs[4*l + 2] = vgetq_lane_s32(vi, 2);
+            y[i].qs[4*l + 3] = vgetq_lane_s32(vi, 3);
+        }
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f;
+        for (int j = 0; j < QK; j++) {
+            amax = MAX(amax, fabsf(x[i*QK + j]));
+        }
+
+        const float d  = amax / 127.f;
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int j = 0; j < QK; ++j) {
+            y[i].qs[j] = roundf(x[i*QK + j]*id);
+        }
+    }
+#endif
+}
+
+static void dequantize_row_q4_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    const block_q4_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = x[i].d;
+
+        for (int j = 0; j < QK/2; ++j) {
+            y[i*QK + j]        = ((x[i].qs[j] & 0x0F) - 8)*d;
+            y[i*QK + QK/2 + j] = ((x[i].qs[j] >>   4) - 8)*d;
+        }
+    }
+}
+
+static void dequantize_row_q8_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    const block_q8_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = x[i].d;
+
+        for (int j = 0; j < QK; ++j) {
+            y[i*QK + j] = x[i].qs[j]*d;
+        }
+    }
+}
+
+#if defined(__AVX2__)
+static inline float hsum_float_8(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+// the 32 weights of a q4_0 block as signed bytes
+static inline __m256i bytes_from_q4_0(const uint8_t * qs) {
+    const __m128i tmp   = _mm_loadu_si128((const __m128i *) qs);
+    const __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(tmp), _mm_srli_epi16(tmp, 4), 1);
+
+    return _mm256_sub_epi8(_mm256_and_si256(bytes, _mm256_set1_epi8(0x0F)), _mm256_set1_epi8(8));
+}
+
+// 8 partial sums of the products of the signed bytes of x and y, none of them -128
+static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
+    // the multiply-add takes unsigned bytes on the left, the sign of x moves to y
+    const __m256i ax = _mm256_sign_epi8(x, x);
+    const __m256i sy = _mm256_sign_epi8(y, x);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    const __m256i summed = _mm256_dpbusd_epi32(_mm256_setzero_si256(), ax, sy);
+#else
+    const __m256i summed = _mm256_madd_epi16(_mm256_set1_epi16(1), _mm256_maddubs_epi16(ax, sy));
+#endif
+    return _mm256_cvtepi32_ps(summed);
+}
+
+static inline __m256 madd_float_8(const __m256 a, const __m256 b, const __m256 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#elif defined(__ARM_NEON)
+// 4 partial sums of the products of the signed bytes of x0:x1 and y0:y1
+static inline int32x4_t ggml_neon_dot_i8(const int8x16_t x0, const int8x16_t x1, const int8x16_t y0, const int8x16_t y1) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    return vdotq_s32(vdotq_s32(vdupq_n_s32(0), x0, y0), x1, y1);
+#else
+    const int16x8_t p0 = vmull_s8(vget_low_s8 (x0), vget_low_s8 (y0));
+    const int16x8_t p1 = vmull_s8(vget_high_s8(x0), vget_high_s8(y0));
+    const int16x8_t p2 = vmull_s8(vget_low_s8 (x1), vget_low_s8 (y1));
+    const int16x8_t p3 = vmull_s8(vget_high_s8(x1), vget_high_s8(y1));
+
+    return vaddq_s32(vaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1)), vaddq_s32(vpaddlq_s16(p2), vpaddlq_s16(p3)));
+#endif
+}
+#endif
+
+static void ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK == 0);
+    const int nb = n / QK;
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(x[i].d*y[i].d);
+
+        const __m256i bx = bytes_from_q4_0(x[i].qs);
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = madd_float_8(d, mul_sum_i8_pairs_float(bx, by), acc);
+    }
+
+    *s = hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        const int8x16_t x0 = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(v0, m4b)), s8b);
+        const int8x16_t x1 = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0, 4)), s8b);
+
+        const int32x4_t p = ggml_neon_dot_i8(x0, x1, vld1q_s8(y[i].qs), vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), x[i].d*y[i].d);
+    }
+
+    *s = vaddvq_f32(sumv);
+#else
+    float sumf = 0.0f;
+
+    for (int i = 0; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK/2; j++) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += v0*y[i].qs[j] + v1*y[i].qs[j + QK/2];
+        }
+
+        sumf += sumi*x[i].d*y[i].d;
+    }
+
+    *s = sumf;
+#endif
+}
+
+static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK == 0);
+    const int nb = n / QK;
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(x[i].d*y[i].d);
+
+        const __m256i bx = _mm256_loadu_si256((const __m256i *) x[i].qs);
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = madd_float_8(d, mul_sum_i8_pairs_float(bx, by), acc);
+    }
+
+    *s = hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const int32x4_t p = ggml_neon_dot_i8(
+                vld1q_s8(x[i].qs), vld1q_s8(x[i].qs + 16),
+                vld1q_s8(y[i].qs), vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), x[i].d*y[i].d);
+    }
+
+    *s = vaddvq_f32(sumv);
+#else
+    float sumf = 0.0f;
+
+    for (int i = 0; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += sumi*x[i].d*y[i].d;
+    }
+
+    *s = sumf;
+#endif
+}
+
+// the rows of a quantized src0 are multiplied with the rows of src1 quantized to q8_0
+typedef void (*quantize_row_t)(const float * restrict x, void * restrict y, int k);
+typedef void (*dequantize_row_t)(const void * restrict x, float * restrict y, int k);
+typedef void (*vec_dot_q_t)(const int n, float * restrict s, const void * restrict x, const void * restrict y);
+
+typedef struct {
+    quantize_row_t   quantize_row;
+    dequantize_row_t dequantize_row;
+    vec_dot_q_t      vec_dot_q8_0;
+} quantize_fns_t;
+
+static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = {
+        .quantize_row   = quantize_row_q4_0,
+        .dequantize_row = dequantize_row_q4_0,
+        .vec_dot_q8_0   = ggml_vec_dot_q4_0_q8_0,
+    },
+    [GGML_TYPE_Q8_0] = {
+        .quantize_row   = quantize_row_q8_0,
+        .dequantize_row = dequantize_row_q8_0,
+        .vec_dot_q8_0   = ggml_vec_dot_q8_0_q8_0,
+    },
+};
+
 //
 // logging
 //
@@ -1158,12 +1564,34 @@ inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x
 // data types
 //
 
+static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
+    1,
+    1,
+    1,
+    1,
+    1,
+    QK,
+    QK,
+};
+
 static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     sizeof(int8_t ),
     sizeof(int16_t),
     sizeof(int32_t),
     sizeof(ggml_fp16_t),
     sizeof(float  ),
+    sizeof(block_q4_0),
+    sizeof(block_q8_0),
+};
+
+static const char * GGML_TYPE_NAME[GGML_TYPE_COUNT] = {
+    "i8",
+    "i16",
+    "i32",
+    "f16",
+    "f32",
+    "q4_0",
+    "q8_0",
 };
 
 static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
@@ -1204,6 +1632,7 @@ static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
 
     "FLASH_ATTN",
     "FLASH_FF",
+    "FLASH_ATTN_KV",
 };
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
@@ -1244,6 +1673,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
 
     "flash_attn(x)",
     "flash_ff(x)",
+    "flash_attn_kv(x)",
 };
 
 //
@@ -1272,6 +1702,7 @@ struct ggml_context {
     size_t mem_size;
     void * mem_buffer;
     bool   mem_buffer_owned;
+    bool   no_alloc;
 
     int n_objects;
 
@@ -1370,13 +1801,25 @@ int ggml_nrows(const struct ggml_tensor * tensor) {
 size_t ggml_nbytes(const struct ggml_tensor * tensor) {
     static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
 
-    return ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type];
+    return (ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type])/GGML_BLCK_SIZE[tensor->type];
+}
+
+int ggml_blck_size(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type];
 }
 
 size_t ggml_type_size(enum ggml_type type) {
     return GGML_TYPE_SIZE[type];
 }
 
+float ggml_type_sizef(enum ggml_type type) {
+    return ((float)(GGML_TYPE_SIZE[type]))/GGML_BLCK_SIZE[type];
+}
+
+const char * ggml_type_name(enum ggml_type type) {
+    return GGML_TYPE_NAME[type];
+}
+
 size_t ggml_element_size(const struct ggml_tensor * tensor) {
     return GGML_TYPE_SIZE[tensor->type];
 }
@@ -1413,7 +1856,7 @@ static inline bool ggml_is_contiguous(const struct ggml_tensor * tensor) {
 
     return
         tensor->nb[0] == GGML_TYPE_SIZE[tensor->type] &&
-        tensor->nb[1] == tensor->nb[0]*tensor->ne[0] &&
+        tensor->nb[1] == (tensor->nb[0]*tensor->ne[0])/GGML_BLCK_SIZE[tensor->type] &&
         tensor->nb[2] == tensor->nb[1]*tensor->ne[1] &&
         tensor->nb[3] == tensor->nb[2]*tensor->ne[2];
 }
@@ -1538,6 +1981,7 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         .mem_size         = params.mem_size,
         .mem_buffer       = params.mem_buffer ? params.mem_buffer : malloc(params.mem_size),
         .mem_buffer_owned = params.mem_buffer ? false : true,
+        .no_alloc         = params.no_alloc,
         .n_objects        = 0,
         .objects_begin    = NULL,
         .objects_end      = NULL,
@@ -1585,14 +2029,29 @@ size_t ggml_used_mem(const struct ggml_context * ctx) {
     return ctx->objects_end->offset + ctx->objects_end->size;
 }
 
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor) + GGML_MEM_ALIGN;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
+// view_src != NULL makes a view of its memory, starting view_offs bytes into it
 struct ggml_tensor * ggml_new_tensor_impl(
         struct ggml_context * ctx,
         enum   ggml_type type,
         int    n_dims,
         const int* ne,
-        void*  data) {
+        struct ggml_tensor * view_src,
+        size_t view_offs) {
+    // a view of a view shares the memory of the first one
+    if (view_src != NULL && view_src->view_src != NULL) {
+        view_offs += view_src->view_offs;
+        view_src   = view_src->view_src;
+    }
+
+    // the data of a view in a no_alloc context is set once its source is allocated
+    void * data = view_src != NULL && view_src->data != NULL ? (char *) view_src->data + view_offs : NULL;
+
     // always insert objects at the end of the context's memory pool
     struct ggml_object * obj_cur = ctx->objects_end;
 
@@ -1602,9 +2061,11 @@ struct ggml_tensor * ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL) {
-        size_needed += GGML_TYPE_SIZE[type];
-        for (int i = 0; i < n_dims; i++) {
+    GGML_ASSERT(ne[0] % GGML_BLCK_SIZE[type] == 0);
+
+    if (view_src == NULL && !ctx->no_alloc) {
+        size_needed += GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
+        for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
         }
         // align to GGML_MEM_ALIGN
@@ -1659,7 +2120,9 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ data == NULL ? (void *)(result + 1) : data,
+        /*.data         =*/ (view_src == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.view_src     =*/ view_src,
+        /*.view_offs    =*/ view_offs,
         /*.pad          =*/ { 0 },
     };
 
@@ -1670,7 +2133,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
     }
 
     result->nb[0] = GGML_TYPE_SIZE[type];
-    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+    result->nb[1] = result->nb[0]*(result->ne[0]/GGML_BLCK_SIZE[type]);
+    for (int i = 2; i < GGML_MAX_DIMS; i++) {
         result->nb[i] = result->nb[i - 1]*result->ne[i - 1];
     }
 
@@ -1684,7 +2148,7 @@ struct ggml_tensor * ggml_new_tensor(
         enum   ggml_type type,
         int    n_dims,
         const int* ne) {
-    return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL);
+    return ggml_new_tensor_impl(ctx, type, n_dims, ne, NULL, 0);
 }
 
 struct ggml_tensor * ggml_new_tensor_1d(
@@ -1724,8 +2188,20 @@ struct ggml_tensor * ggml_new_tensor_4d(
     return ggml_new_tensor(ctx, type, 4, ne);
 }
 
+// the scalars and op parameters are written when the graph is built, they get their memory from the context also
+// when it only holds the metadata of the tensors
+static struct ggml_tensor * ggml_new_param_1d(struct ggml_context * ctx, enum ggml_type type, int ne0) {
+    const bool no_alloc = ctx->no_alloc;
+
+    ctx->no_alloc = false;
+    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, type, ne0);
+    ctx->no_alloc = no_alloc;
+
+    return result;
+}
+
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
-    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    struct ggml_tensor * result = ggml_new_param_1d(ctx, GGML_TYPE_I32, 1);
 
     ggml_set_i32(result, value);
 
@@ -1733,7 +2209,7 @@ struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
-    struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    struct ggml_tensor * result = ggml_new_param_1d(ctx, GGML_TYPE_F32, 1);
 
     ggml_set_f32(result, value);
 
@@ -1741,7 +2217,7 @@ struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
 }
 
 struct ggml_tensor * ggml_dup_tensor(struct ggml_context * ctx, const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL);
+    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL, 0);
 }
 
 struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor) {
@@ -1792,6 +2268,8 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1844,6 +2322,8 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1880,6 +2360,8 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1916,6 +2398,8 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1950,6 +2434,8 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1986,6 +2472,8 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2004,8 +2492,8 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
 
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
-        const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+        struct ggml_tensor  * src) {
+    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src, 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2714,7 +3202,7 @@ struct ggml_tensor * ggml_reshape(
         is_node = true;
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -2740,7 +3228,7 @@ struct ggml_tensor * ggml_reshape_2d(
     }
 
     const int ne[2] = { ne0, ne1 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -2767,7 +3255,7 @@ struct ggml_tensor * ggml_reshape_3d(
     }
 
     const int ne[3] = { ne0, ne1, ne2 };
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a, 0);
 
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -2788,7 +3276,7 @@ struct ggml_tensor * ggml_view_1d(
         assert(false); // gradient propagation is not supported
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, a, offset);
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -2813,7 +3301,7 @@ struct ggml_tensor * ggml_view_2d(
 
     const int ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -2960,7 +3448,7 @@ struct ggml_tensor * ggml_diag_mask_inf(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
+    struct ggml_tensor * b = ggml_new_param_1d(ctx, GGML_TYPE_I32, 1);
     ((int32_t *) b->data)[0] = n_past;
 
     result->op   = GGML_OP_DIAG_MASK_INF;
@@ -3015,7 +3503,7 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
-    struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+    struct ggml_tensor * b = ggml_new_param_1d(ctx, GGML_TYPE_I32, 3);
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
@@ -3113,6 +3601,39 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_kv
+
+struct ggml_tensor * ggml_flash_attn_kv(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        bool                  masked) {
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->type == v->type);
+    GGML_ASSERT(q->ne[0] == k->ne[0] && q->ne[2] == k->ne[2] && q->ne[3] == k->ne[3]);
+    GGML_ASSERT(ggml_are_same_shape(k, v));
+    GGML_ASSERT(!masked || q->ne[1] <= k->ne[1]);
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, q->ne);
+
+    result->op   = GGML_OP_FLASH_ATTN_KV;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = q;
+    result->src1 = k;
+    result->opt[0] = v;
+    result->opt[1] = ggml_new_i32(ctx, masked ? 1 : 0);
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -3383,6 +3904,8 @@ static void ggml_compute_forward_dup(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3459,6 +3982,8 @@ static void ggml_compute_forward_add(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3509,6 +4034,8 @@ static void ggml_compute_forward_sub(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3559,6 +4086,8 @@ static void ggml_compute_forward_mul(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3609,6 +4138,8 @@ static void ggml_compute_forward_div(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3655,6 +4186,8 @@ static void ggml_compute_forward_sqr(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3701,6 +4234,8 @@ static void ggml_compute_forward_sqrt(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3757,6 +4292,8 @@ static void ggml_compute_forward_sum(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3832,6 +4369,8 @@ static void ggml_compute_forward_mean(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3894,6 +4433,8 @@ static void ggml_compute_forward_repeat(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3940,6 +4481,8 @@ static void ggml_compute_forward_abs(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3986,6 +4529,8 @@ static void ggml_compute_forward_sgn(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4032,6 +4577,8 @@ static void ggml_compute_forward_neg(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4078,6 +4625,8 @@ static void ggml_compute_forward_step(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4124,6 +4673,8 @@ static void ggml_compute_forward_relu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4187,6 +4738,8 @@ static void ggml_compute_forward_gelu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4269,6 +4822,8 @@ static void ggml_compute_forward_norm(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4302,54 +4857,306 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
-static void ggml_compute_forward_mul_mat_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * src0,
-        const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+// blocked matrix multiplication for the large F16 / F32 products
+//
+// the products are computed in register tiles of GGML_GEMM_MR src0 rows x GGML_GEMM_NR src1 columns.
+// the operands are packed (and converted to F32) into panels so that the micro-kernel reads
+// them sequentially, a block of GGML_GEMM_MC x GGML_GEMM_KC of src0 stays in L2 while a panel
+// of GGML_GEMM_KC x GGML_GEMM_NR of src1 stays in L1. each thread computes its own 2D block of dst
+//
+// GGML_GEMM_MR - dst rows in a register tile, 2 vectors
+// GGML_GEMM_NR - dst columns in a register tile, one accumulator for each vector of the rows
+//
 
-    const int ne00 = src0->ne[0];
-    const int ne01 = src0->ne[1];
-    const int ne02 = src0->ne[2];
-    const int ne03 = src0->ne[3];
+#if defined(GGML_SIMD)
 
-    const int ne10 = src1->ne[0];
-    const int ne11 = src1->ne[1];
-    const int ne12 = src1->ne[2];
-    const int ne13 = src1->ne[3];
+#define GGML_GEMM_MR (2*GGML_F32_EPR)
 
-    const int ne0  = dst->ne[0];
-    const int ne1  = dst->ne[1];
-    const int ne2  = dst->ne[2];
-    const int ne3  = dst->ne[3];
-    const int ne   = ne0*ne1*ne2*ne3;
+#if defined(__AVX512VL__) || defined(__aarch64__)
+// 32 vector registers: 28 accumulators. there is no AVX-512 macro set, the AVX one is used and the vectors are
+// 8-wide ymm registers (GGML_F32_EPR = 8), ymm16-31 need AVX-512VL; aarch64 has 4-wide ones
+#define GGML_GEMM_NR 14
+#else
+// 16 vector registers: 12 accumulators
+#define GGML_GEMM_NR 6
+#endif
 
-    const int nb00 = src0->nb[0];
-    const int nb01 = src0->nb[1];
-    const int nb02 = src0->nb[2];
-    const int nb03 = src0->nb[3];
+#define GGML_GEMM_KC 256
+#define GGML_GEMM_MC (8*GGML_GEMM_MR)
+#define GGML_GEMM_NC (64*GGML_GEMM_NR)
 
-    const int nb10 = src1->nb[0];
-    const int nb11 = src1->nb[1];
-    const int nb12 = src1->nb[2];
-    const int nb13 = src1->nb[3];
+// packed operands of one thread
+#define GGML_GEMM_WSIZE (sizeof(float)*(GGML_GEMM_MC + GGML_GEMM_NC)*GGML_GEMM_KC)
 
-    const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    const int nb2  = dst->nb[2];
-    const int nb3  = dst->nb[3];
+static bool ggml_compute_forward_mul_mat_use_gemm(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
+        return false;
+    }
+#endif
 
-    const int ith = params->ith;
-    const int nth = params->nth;
+    if (src0->type != GGML_TYPE_F16 && src0->type != GGML_TYPE_F32) {
+        return false;
+    }
 
-    assert(ne02 == ne12);
-    assert(ne03 == ne13);
-    assert(ne2  == ne12);
-    assert(ne3  == ne13);
+    // the rows of both operands are read as they are, the products of a few rows are left to ggml_vec_dot
+    return src1->type == GGML_TYPE_F32 &&
+        src0->nb[0] == GGML_TYPE_SIZE[src0->type] && src0->nb[1] >= src0->nb[0] &&
+        src1->nb[0] == sizeof(float) &&
+        dst->ne[0] >= 32 && dst->ne[1] >= 32 && src0->ne[0] >= 32;
+}
 
-    // TODO: we don't support permuted src0
+// pack n rows of kc values into panels of nr rows, interleaved by column
+// the panels are written in order, the missing rows of the last panel are zero
+static void ggml_gemm_pack(
+        const int n, const int kc, const int nr, float * restrict dst,
+        const char * restrict src, const size_t nb, const enum ggml_type type) {
+    for (int p = 0; p < n; p += nr) {
+        const int np = MIN(nr, n - p);
+
+        float * restrict d = dst + p*kc;
+
+        if (type == GGML_TYPE_F16) {
+            for (int k = 0; k < kc; ++k) {
+                for (int r = 0; r < np; ++r) {
+                    d[k*nr + r] = GGML_FP16_TO_FP32(((const ggml_fp16_t *) (src + (p + r)*nb))[k]);
+                }
+            }
+        } else {
+            for (int k = 0; k < kc; ++k) {
+                for (int r = 0; r < np; ++r) {
+                    d[k*nr + r] = ((const float *) (src + (p + r)*nb))[k];
+                }
+            }
+        }
+
+        for (int r = np; r < nr; ++r) {
+            for (int k = 0; k < kc; ++k) {
+                d[k*nr + r] = 0.0f;
+            }
+        }
+    }
+}
+
+// c[j*ldc + i] (+)= sum_k a[k*MR + i]*b[k*NR + j]
+inline static void ggml_gemm_kernel(
+        const int kc, const float * restrict a, const float * restrict b,
+        float * restrict c, const int ldc, const bool acc) {
+    GGML_F32_VEC cv[GGML_GEMM_NR][2];
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        cv[j][0] = GGML_F32_VEC_ZERO;
+        cv[j][1] = GGML_F32_VEC_ZERO;
+    }
+
+    for (int k = 0; k < kc; ++k) {
+        const GGML_F32_VEC a0 = GGML_F32_VEC_LOAD(a + k*GGML_GEMM_MR);
+        const GGML_F32_VEC a1 = GGML_F32_VEC_LOAD(a + k*GGML_GEMM_MR + GGML_F32_EPR);
+
+        for (int j = 0; j < GGML_GEMM_NR; ++j) {
+            const GGML_F32_VEC bj = GGML_F32_VEC_SET1(b[k*GGML_GEMM_NR + j]);
+
+            cv[j][0] = GGML_F32_VEC_FMA(cv[j][0], a0, bj);
+            cv[j][1] = GGML_F32_VEC_FMA(cv[j][1], a1, bj);
+        }
+    }
+
+    for (int j = 0; j < GGML_GEMM_NR; ++j) {
+        if (acc) {
+            cv[j][0] = GGML_F32_VEC_ADD(cv[j][0], GGML_F32_VEC_LOAD(c + j*ldc));
+            cv[j][1] = GGML_F32_VEC_ADD(cv[j][1], GGML_F32_VEC_LOAD(c + j*ldc + GGML_F32_EPR));
+        }
+
+        GGML_F32_VEC_STORE(c + j*ldc,                 cv[j][0]);
+        GGML_F32_VEC_STORE(c + j*ldc + GGML_F32_EPR, cv[j][1]);
+    }
+}
+
+static void ggml_compute_forward_mul_mat_gemm(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const int ne11 = src1->ne[1];
+
+    const size_t nb00 = src0->nb[0];
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
+
+    const size_t nb1  = dst->nb[1];
+    const size_t nb2  = dst->nb[2];
+    const size_t nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(ne00 == src1->ne[0]);
+    GGML_ASSERT(ne02 == src1->ne[2]);
+    GGML_ASSERT(ne03 == src1->ne[3]);
+    GGML_ASSERT(ne01 == dst->ne[0]);
+    GGML_ASSERT(ne11 == dst->ne[1]);
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+    GGML_ASSERT(nb1 % sizeof(float) == 0);
+    GGML_ASSERT(params->wsize >= GGML_GEMM_WSIZE*nth);
+
+    // split dst in a grid of pm x pn blocks, the one with the smallest blocks
+    const int nm = (ne01 + GGML_GEMM_MR - 1)/GGML_GEMM_MR;
+    const int nn = (ne11 + GGML_GEMM_NR - 1)/GGML_GEMM_NR;
+
+    int pm = 1;
+    {
+        int64_t best = INT64_MAX;
+        for (int p = 1; p <= nth; ++p) {
+            if (nth % p != 0) {
+                continue;
+            }
+
+            const int64_t bm = (nm + p - 1)/p;
+            const int64_t bn = (nn + nth/p - 1)/(nth/p);
+
+            // the area, then the perimeter (the packing) of a block
+            const int64_t cost = (bm*GGML_GEMM_MR*bn*GGML_GEMM_NR) << 20 | (bm*GGML_GEMM_MR + bn*GGML_GEMM_NR);
+            if (cost < best) {
+                best = cost;
+                pm   = p;
+            }
+        }
+    }
+    const int pn = nth/pm;
+
+    // block of dst rows and columns for this thread
+    const int dm = (nm + pm - 1)/pm*GGML_GEMM_MR;
+    const int dn = (nn + pn - 1)/pn*GGML_GEMM_NR;
+
+    const int m0 = MIN(dm*(ith%pm), ne01);
+    const int m1 = MIN(m0 + dm, ne01);
+    const int n0 = MIN(dn*(ith/pm), ne11);
+    const int n1 = MIN(n0 + dn, ne11);
+
+    if (m0 >= m1 || n0 >= n1) {
+        return;
+    }
+
+    float * const ap = (float *) ((char *) params->wdata + GGML_GEMM_WSIZE*ith);
+    float * const bp = ap + GGML_GEMM_MC*GGML_GEMM_KC;
+
+    const int ldc = nb1/sizeof(float);
+
+    for (int i03 = 0; i03 < ne03; ++i03) {
+        for (int i02 = 0; i02 < ne02; ++i02) {
+            const char * a = (const char *) src0->data + i02*nb02 + i03*nb03;
+            const char * b = (const char *) src1->data + i02*nb12 + i03*nb13;
+
+            float * c = (float *) ((char *) dst->data + i02*nb2 + i03*nb3);
+
+            for (int jc = n0; jc < n1; jc += GGML_GEMM_NC) {
+                const int nc = MIN(GGML_GEMM_NC, n1 - jc);
+
+                for (int pc = 0; pc < ne00; pc += GGML_GEMM_KC) {
+                    const int kc = MIN(GGML_GEMM_KC, ne00 - pc);
+
+                    ggml_gemm_pack(nc, kc, GGML_GEMM_NR, bp, b + jc*nb11 + pc*sizeof(float), nb11, GGML_TYPE_F32);
+
+                    for (int ic = m0; ic < m1; ic += GGML_GEMM_MC) {
+                        const int mc = MIN(GGML_GEMM_MC, m1 - ic);
+
+                        ggml_gemm_pack(mc, kc, GGML_GEMM_MR, ap, a + ic*nb01 + pc*nb00, nb01, src0->type);
+
+                        for (int jr = 0; jr < nc; jr += GGML_GEMM_NR) {
+                            for (int ir = 0; ir < mc; ir += GGML_GEMM_MR) {
+                                float * cp = c + (jc + jr)*ldc + ic + ir;
+
+                                if (ir + GGML_GEMM_MR <= mc && jr + GGML_GEMM_NR <= nc) {
+                                    ggml_gemm_kernel(kc, ap + ir*kc, bp + jr*kc, cp, ldc, pc > 0);
+                                    continue;
+                                }
+
+                                // edge of the block
+                                float tmp[GGML_GEMM_NR*GGML_GEMM_MR];
+
+                                ggml_gemm_kernel(kc, ap + ir*kc, bp + jr*kc, tmp, GGML_GEMM_MR, false);
+
+                                for (int j = 0; j < MIN(GGML_GEMM_NR, nc - jr); ++j) {
+                                    for (int i = 0; i < MIN(GGML_GEMM_MR, mc - ir); ++i) {
+                                        cp[j*ldc + i] = (pc > 0 ? cp[j*ldc + i] : 0.0f) + tmp[j*GGML_GEMM_MR + i];
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif // GGML_SIMD
+
+static void ggml_compute_forward_mul_mat_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
+    const int ne2  = dst->ne[2];
+    const int ne3  = dst->ne[3];
+    const int ne   = ne0*ne1*ne2*ne3;
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+    const int nb03 = src0->nb[3];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+    const int nb12 = src1->nb[2];
+    const int nb13 = src1->nb[3];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    assert(ne02 == ne12);
+    assert(ne03 == ne13);
+    assert(ne2  == ne12);
+    assert(ne3  == ne13);
+
+    // TODO: we don't support permuted src0
     assert(nb00 == sizeof(float) || nb01 == sizeof(float));
 
     // dst cannot be transposed or permuted
@@ -4849,8 +5656,178 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     //    printf("nb00 = %5d, nb01 = %5d, nb02 = %5d, nb03 = %5d\n", nb00, nb01, nb02, nb03);
     //    printf("ne10 = %5d, ne11 = %5d, ne12 = %5d, ne13 = %5d\n", ne10, ne11, ne12, ne13);
 
-    //    printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX task %d/%d: %d us, acc = %d\n", ith, nth, (int) (t1 - t0), (int) acc);
-    //}
+    //    printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX task %d/%d: %d us, acc = %d\n", ith, nth, (int) (t1 - t0), (int) acc);
+    //}
+}
+
+static void ggml_compute_forward_mul_mat_q_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
+    const int ne2  = dst->ne[2];
+    const int ne3  = dst->ne[3];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+    const int nb03 = src0->nb[3];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+    const int nb12 = src1->nb[2];
+    const int nb13 = src1->nb[3];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(ne02 == ne12);
+    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne2  == ne12);
+    GGML_ASSERT(ne3  == ne13);
+
+    const enum ggml_type type = src0->type;
+    const quantize_row_t   quantize_row_q8   = quantize_fns[GGML_TYPE_Q8_0].quantize_row;
+    const dequantize_row_t dequantize_row_q  = quantize_fns[type].dequantize_row;
+    const vec_dot_q_t      vec_dot_q8_0      = quantize_fns[type].vec_dot_q8_0;
+
+    // the blocks of src0 are along its rows, it cannot be transposed or permuted
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    GGML_ASSERT(ne0 == ne01);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne2 == ne02);
+    GGML_ASSERT(ne3 == ne03);
+
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
+        if (params->ith != 0) {
+            return;
+        }
+
+        if (params->type == GGML_TASK_INIT) {
+            return;
+        }
+
+        if (params->type == GGML_TASK_FINALIZE) {
+            return;
+        }
+
+        float * const wdata = params->wdata;
+
+        for (int i03 = 0; i03 < ne03; i03++) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                for (int i01 = 0; i01 < ne01; ++i01) {
+                    dequantize_row_q((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01, wdata + i01*ne00, ne00);
+                }
+
+                const float * x = wdata;
+                const float * y = (float *) ((char *) src1->data + i02*nb12 + i03*nb13);
+
+                float * d = (float *) ((char *) dst->data + i02*nb2 + i03*nb3);
+
+                // zT = y * xT
+                cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                        ne11, ne01, ne10,
+                        1.0f,    y, ne10,
+                                 x, ne00,
+                        0.0f,    d, ne01);
+            }
+        }
+
+        return;
+    }
+#else
+    UNUSED(dequantize_row_q);
+#endif
+
+    // size of a src1 row in q8_0
+    const size_t row_size = ne10*GGML_TYPE_SIZE[GGML_TYPE_Q8_0]/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
+
+    if (params->type == GGML_TASK_INIT) {
+        char * wdata = params->wdata;
+
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    quantize_row_q8((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
+                    wdata += row_size;
+                }
+            }
+        }
+
+        GGML_ASSERT((size_t)(wdata - (char *) params->wdata) <= params->wsize);
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // parallelize by src0 rows using the dot product with the q8_0 rows of src1
+
+    // total rows in src0
+    const int nr = ne01*ne02*ne03;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const char * wdata = params->wdata;
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // src0 indices
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const int i13 = i03;
+        const int i12 = i02;
+
+        const int i0 = i01;
+        const int i2 = i02;
+        const int i3 = i03;
+
+        const void * src0_row = (const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03);
+        const char * src1_col = wdata + (i12*ne11 + i13*ne12*ne11)*row_size;
+
+        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+        for (int ic = 0; ic < ne11; ++ic) {
+            vec_dot_q8_0(ne00, &dst_col[ic*ne0], src0_row, (const void *) (src1_col + ic*row_size));
+        }
+    }
 }
 
 static void ggml_compute_forward_mul_mat(
@@ -4858,6 +5835,13 @@ static void ggml_compute_forward_mul_mat(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
+#if defined(GGML_SIMD)
+    if (ggml_compute_forward_mul_mat_use_gemm(src0, src1, dst)) {
+        ggml_compute_forward_mul_mat_gemm(params, src0, src1, dst);
+        return;
+    }
+#endif
+
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -4867,6 +5851,11 @@ static void ggml_compute_forward_mul_mat(
             {
                 ggml_compute_forward_mul_mat_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -4928,6 +5917,8 @@ static void ggml_compute_forward_scale(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4988,6 +5979,35 @@ static void ggml_compute_forward_transpose(
 
 // ggml_compute_forward_get_rows
 
+static void ggml_compute_forward_get_rows_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+
+    const dequantize_row_t dequantize_row_q = quantize_fns[src0->type].dequantize_row;
+
+    assert( dst->ne[0] == nc);
+    assert( dst->ne[1] == nr);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[src0->type]);
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        dequantize_row_q(
+                (const void *) ((char *) src0->data + r*src0->nb[1]),
+                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
+    }
+}
+
 static void ggml_compute_forward_get_rows_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -5057,6 +6077,11 @@ static void ggml_compute_forward_get_rows(
             {
                 ggml_compute_forward_get_rows_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_get_rows_q(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
@@ -5119,6 +6144,8 @@ static void ggml_compute_forward_diag_mask_inf(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5210,6 +6237,8 @@ static void ggml_compute_forward_soft_max(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5290,6 +6319,8 @@ static void ggml_compute_forward_rope(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5556,6 +6587,8 @@ static void ggml_compute_forward_conv_1d_1s(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5822,6 +6855,8 @@ static void ggml_compute_forward_conv_1d_2s(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -6305,6 +7340,8 @@ static void ggml_compute_forward_flash_attn(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -6514,6 +7551,8 @@ static void ggml_compute_forward_flash_ff(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -6521,6 +7560,162 @@ static void ggml_compute_forward_flash_ff(
     }
 }
 
+// ggml_compute_forward_flash_attn_kv
+
+static void ggml_compute_forward_flash_attn_kv(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const bool masked,
+             struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int neq0 = q->ne[0];
+    const int neq1 = q->ne[1];
+    const int neq2 = q->ne[2];
+    const int neq3 = q->ne[3];
+
+    const int nek1 = k->ne[1];
+
+    const size_t nbq1 = q->nb[1];
+    const size_t nbq2 = q->nb[2];
+    const size_t nbq3 = q->nb[3];
+
+    const size_t nbk1 = k->nb[1];
+    const size_t nbk2 = k->nb[2];
+    const size_t nbk3 = k->nb[3];
+
+    const size_t nbv1 = v->nb[1];
+    const size_t nbv2 = v->nb[2];
+    const size_t nbv3 = v->nb[3];
+
+    const size_t nb1  = dst->nb[1];
+    const size_t nb2  = dst->nb[2];
+    const size_t nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int D = neq0;
+    const int N = neq1;
+    const int P = nek1 - N;
+
+    const int B = GGML_FLASH_ATTN_KV_BLOCK;
+
+    GGML_ASSERT(k->type == GGML_TYPE_F16 || k->type == GGML_TYPE_F32);
+    GGML_ASSERT(v->type == k->type);
+
+    GGML_ASSERT(q->nb[0] == sizeof(float));
+    GGML_ASSERT(k->nb[0] == GGML_TYPE_SIZE[k->type]);
+    GGML_ASSERT(v->nb[0] == GGML_TYPE_SIZE[v->type]);
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+
+    GGML_ASSERT(!masked || P >= 0);
+    GGML_ASSERT(params->wsize >= sizeof(float)*(2*D + B + CACHE_LINE_SIZE_F32)*nth);
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const bool is_f16 = k->type == GGML_TYPE_F16;
+
+    // parallelize by q rows, i.e. by heads for a single query
+
+    // total rows in q
+    const int nr = neq1*neq2*neq3;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    // output row, scores of a block and the query in F16
+    float       * acc = (float *) params->wdata + ith*(2*D + B + CACHE_LINE_SIZE_F32);
+    float       * S   = acc + D;
+    ggml_fp16_t * q16 = (ggml_fp16_t *) (S + B);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // q indices
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        float * qrow = (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+
+        char * kdata = (char *) k->data + (iq2*nbk2 + iq3*nbk3);
+        char * vdata = (char *) v->data + (iq2*nbv2 + iq3*nbv3);
+
+        if (is_f16) {
+            for (int i = 0; i < D; ++i) {
+                q16[i] = GGML_FP32_TO_FP16(qrow[i]);
+            }
+        }
+
+        // the positions after the query are masked
+        const int M = masked ? P + iq1 + 1 : nek1;
+
+        float      max = -INFINITY;
+        ggml_float sum = 0.0;
+
+        ggml_vec_set_f32(D, acc, 0.0f);
+
+        for (int ic0 = 0; ic0 < M; ic0 += B) {
+            const int nc = MIN(B, M - ic0);
+
+            for (int ic = 0; ic < nc; ++ic) {
+                if (is_f16) {
+                    ggml_vec_dot_f16(D, S + ic, (ggml_fp16_t *) (kdata + (ic0 + ic)*nbk1), q16);
+                } else {
+                    ggml_vec_dot_f32(D, S + ic, (float *) (kdata + (ic0 + ic)*nbk1), qrow);
+                }
+            }
+
+            float max_block = -INFINITY;
+            ggml_vec_max_f32(nc, &max_block, S);
+
+            // rescale the sum of the previous blocks to the new maximum
+            if (max_block > max) {
+                if (sum > 0.0) {
+                    const float s = expf(max - max_block);
+                    ggml_vec_scale_f32(D, acc, s);
+                    sum *= s;
+                }
+                max = max_block;
+            }
+
+            uint16_t scvt;
+            for (int ic = 0; ic < nc; ++ic) {
+                ggml_fp16_t s = GGML_FP32_TO_FP16(S[ic] - max);
+                memcpy(&scvt, &s, sizeof(scvt));
+                const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt]);
+
+                sum += val;
+
+                if (is_f16) {
+                    ggml_vec_mad_f32_f16(D, acc, (ggml_fp16_t *) (vdata + (ic0 + ic)*nbv1), val);
+                } else {
+                    ggml_vec_mad_f32(D, acc, (float *) (vdata + (ic0 + ic)*nbv1), val);
+                }
+            }
+        }
+
+        assert(sum > 0.0);
+
+        float * drow = (float *) ((char *) dst->data + (iq1*nb1 + iq2*nb2 + iq3*nb3));
+
+        ggml_vec_cpy_f32  (D, drow, acc);
+        ggml_vec_scale_f32(D, drow, 1.0/sum);
+    }
+}
+
 /////////////////////////////////
 
 static void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
@@ -6658,6 +7853,11 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_flash_ff(params, tensor->src0, tensor->src1, tensor->opt[0], tensor->opt[1], tensor->opt[2], tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_KV:
+            {
+                const bool masked = ggml_get_i32_1d(tensor->opt[1], 0) != 0;
+                ggml_compute_forward_flash_attn_kv(params, tensor->src0, tensor->src1, tensor->opt[0], masked, tensor);
+            } break;
         case GGML_OP_NONE:
             {
                 // nop
@@ -6904,6 +8104,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // not supported
             } break;
+        case GGML_OP_FLASH_ATTN_KV:
+            {
+                GGML_ASSERT(false); // not supported
+            } break;
         case GGML_OP_NONE:
             {
                 // nop
@@ -6997,6 +8201,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_threads    =*/ 0,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
+        /*.threadpool   =*/ NULL,
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
@@ -7051,8 +8256,7 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 //
 // thread data
 //
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
+// synchronization is done via short busy loops followed by a futex wait, see the thread pool below
 //
 
 #ifdef __APPLE__
@@ -7107,16 +8311,60 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+//
+// thread pool
+//
+// the workers of ggml_graph_compute live as long as the pool and are reused by every graph computed with it.
+// a node is handed to the workers by bumping n_gen; a worker spins for a while waiting for the next node, then
+// sleeps on a futex (linux) or a condition variable, so the small per-token graphs of a decoder do not start threads
+// and an idle pool does not burn cpu
+//
 
-    int n_threads;
+// iterations a waiting thread spins before it goes to sleep
+#ifndef GGML_THREADPOOL_SPIN
+#define GGML_THREADPOOL_SPIN 4096
+#endif
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
-};
+#if defined(_MSC_VER)
+#define ggml_cpu_relax() YieldProcessor()
+#elif defined(__x86_64__) || defined(__i386__)
+#define ggml_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define ggml_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define ggml_cpu_relax()
+#endif
+
+#if !defined(__linux__)
+// without futex the sleepers wait on a condition variable of the pool
+#if defined(_MSC_VER) || defined(__MINGW32__)
+typedef SRWLOCK            ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(x)    InitializeSRWLock(x)
+#define ggml_mutex_destroy(x) UNUSED(x)
+#define ggml_mutex_lock       AcquireSRWLockExclusive
+#define ggml_mutex_unlock     ReleaseSRWLockExclusive
+#define ggml_cond_init(x)     InitializeConditionVariable(x)
+#define ggml_cond_destroy(x)  UNUSED(x)
+#define ggml_cond_wait(c, m)  SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ggml_cond_broadcast   WakeAllConditionVariable
+#else
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(x)    pthread_mutex_init(x, NULL)
+#define ggml_mutex_destroy    pthread_mutex_destroy
+#define ggml_mutex_lock       pthread_mutex_lock
+#define ggml_mutex_unlock     pthread_mutex_unlock
+#define ggml_cond_init(x)     pthread_cond_init(x, NULL)
+#define ggml_cond_destroy     pthread_cond_destroy
+#define ggml_cond_wait        pthread_cond_wait
+#define ggml_cond_broadcast   pthread_cond_broadcast
+#endif
+#endif
+
+struct ggml_threadpool;
 
 struct ggml_compute_state {
     ggml_thread_t thrd;
@@ -7124,290 +8372,467 @@ struct ggml_compute_state {
     struct ggml_compute_params params;
     struct ggml_tensor * node;
 
-    struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool;
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+struct ggml_threadpool {
+    int n_threads; // the workers plus the thread calling ggml_graph_compute
 
-    const int n_threads = state->shared->n_threads;
+    // synchronization primitives
+    atomic_int  n_gen;      // bumped for every task handed to the workers
+    atomic_int  n_pending;  // workers that have not finished the current task
+    atomic_int  n_sleeping; // threads blocked in ggml_threadpool_sleep
+    atomic_bool stop;       // stop all threads
+
+#if !defined(__linux__)
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;
+#endif
 
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
-            }
+    struct ggml_compute_state * workers; // n_threads - 1
+};
+
+// blocks while *addr == val, may return early
+static void ggml_threadpool_sleep(struct ggml_threadpool * pool, atomic_int * addr, int val) {
+#if defined(__linux__)
+    UNUSED(pool);
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    ggml_mutex_lock(&pool->mutex);
+    while (atomic_load(addr) == val) {
+        ggml_cond_wait(&pool->cond, &pool->mutex);
+    }
+    ggml_mutex_unlock(&pool->mutex);
+#endif
+}
+
+// wakes the threads sleeping on addr, to be called after *addr changed
+static void ggml_threadpool_notify(struct ggml_threadpool * pool, atomic_int * addr) {
+#if defined(__linux__)
+    UNUSED(pool);
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    // under the mutex, so a sleeper between its check of *addr and the wait does not miss it
+    UNUSED(addr);
+    ggml_mutex_lock(&pool->mutex);
+    ggml_cond_broadcast(&pool->cond);
+    ggml_mutex_unlock(&pool->mutex);
+#endif
+}
+
+// returns once *addr != val
+static void ggml_threadpool_wait_while(struct ggml_threadpool * pool, atomic_int * addr, int val) {
+    for (int i = 0; i < GGML_THREADPOOL_SPIN; i++) {
+        if (atomic_load(addr) != val) {
+            return;
         }
+        ggml_cpu_relax();
+    }
+
+    // the waker checks n_sleeping after changing *addr, and the sleep does not block once *addr changed
+    atomic_fetch_add(&pool->n_sleeping, 1);
+    while (atomic_load(addr) == val) {
+        ggml_threadpool_sleep(pool, addr, val);
+    }
+    atomic_fetch_sub(&pool->n_sleeping, 1);
+}
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+static void ggml_threadpool_wake(struct ggml_threadpool * pool, atomic_int * addr) {
+    if (atomic_load(&pool->n_sleeping) > 0) {
+        ggml_threadpool_notify(pool, addr);
+    }
+}
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * pool = state->pool;
+
+    int n_gen = 0;
 
+    while (true) {
         // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
-        }
+        ggml_threadpool_wait_while(pool, &pool->n_gen, n_gen);
+        n_gen = atomic_load(&pool->n_gen);
 
         // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
+        if (atomic_load(&pool->stop)) {
             break;
         }
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
-            }
+        if (state->node && state->params.ith < state->params.nth) {
+            ggml_compute_forward(&state->params, state->node);
+        }
 
-            state->node = NULL;
-        } else {
-            break;
+        state->node = NULL;
+
+        if (atomic_fetch_sub(&pool->n_pending, 1) == 1) {
+            ggml_threadpool_wake(pool, &pool->n_pending);
         }
     }
 
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    if (cgraph->n_threads <= 0) {
-        cgraph->n_threads = 8;
-    }
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, int cpu_core_offset) {
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
 
-    const int n_threads = cgraph->n_threads;
+    pool->n_threads = MAX(1, n_threads);
+    atomic_store(&pool->n_gen,      0);
+    atomic_store(&pool->n_pending,  0);
+    atomic_store(&pool->n_sleeping, 0);
+    atomic_store(&pool->stop,       false);
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
-
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
-
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
+#if !defined(__linux__)
+    ggml_mutex_init(&pool->mutex);
+    ggml_cond_init(&pool->cond);
+#endif
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            assert(rc == 0);
-            UNUSED(rc);
+    pool->workers = pool->n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(pool->n_threads - 1)) : NULL;
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .params = { 0 },
+            .node   = NULL,
+            .pool   = pool,
+        };
+
+        int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_graph_compute_thread, &pool->workers[j]);
+        assert(rc == 0);
+        UNUSED(rc);
+
+#if defined(__linux__)
+        if (cpu_core_offset >= 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu_core_offset + j, &cpuset);
+            if (pthread_setaffinity_np(pool->workers[j].thrd, sizeof(cpu_set_t), &cpuset) != 0) {
+                fprintf(stderr, "%s: failed to pin worker %d to core %d\n", __func__, j, cpu_core_offset + j);
+            }
         }
+#else
+        UNUSED(cpu_core_offset);
+#endif
     }
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
-
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
-
-            switch (node->op) {
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
-
-                        // TODO: better way to determine if the matrix is transposed
-                        if (node->src0->nb[1] < node->src0->nb[0]) {
-                            cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
-                        } else {
-                            if (node->src0->type == GGML_TYPE_F16 &&
-                                node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                       //       the threads are still spinning
-                                    cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
-                                } else {
-                                    cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-                                }
-#else
-                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    atomic_store(&pool->stop, true);
+    atomic_fetch_add(&pool->n_gen, 1);
+    ggml_threadpool_notify(pool, &pool->n_gen);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        assert(rc == 0);
+        UNUSED(rc);
+    }
+
+#if !defined(__linux__)
+    ggml_mutex_destroy(&pool->mutex);
+    ggml_cond_destroy(&pool->cond);
 #endif
-                            } else if (node->src0->type == GGML_TYPE_F32 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-                                cur = 0;
-                            } else {
-                                GGML_ASSERT(false);
-                            }
-                        }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CPY:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+// hands node to the workers, the caller computes its own part (ith = 0) meanwhile and then waits in
+// ggml_threadpool_finish
+static void ggml_threadpool_start(
+        struct ggml_threadpool * pool,
+          struct ggml_tensor * node,
+        enum ggml_task_type    type,
+           struct ggml_cgraph * cgraph) {
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        pool->workers[j].params = (struct ggml_compute_params) {
+            .type  = type,
+            .ith   = j + 1,
+            .nth   = node->n_tasks,
+            .wsize = cgraph->work ? cgraph->work_size : 0,
+            .wdata = cgraph->work,
+        };
+        pool->workers[j].node = node;
+    }
+
+    atomic_store(&pool->n_pending, pool->n_threads - 1);
+    atomic_fetch_add(&pool->n_gen, 1);
+    ggml_threadpool_wake(pool, &pool->n_gen);
+}
+
+static void ggml_threadpool_finish(struct ggml_threadpool * pool) {
+    int n_pending;
+    while ((n_pending = atomic_load(&pool->n_pending)) != 0) {
+        ggml_threadpool_wait_while(pool, &pool->n_pending, n_pending);
+    }
+}
+
+// only the transposed mul_mat reduces the per-thread results in the FINALIZE pass, every other op returns
+// right away there and the workers are not woken for it
+static bool ggml_graph_node_finalize_parallel(const struct ggml_tensor * node) {
+    return node->op == GGML_OP_MUL_MAT && node->src0->nb[1] < node->src0->nb[0];
+}
+
+// the number of threads the graph is computed with, at most the workers of its pool
+static int ggml_graph_n_threads(struct ggml_cgraph * cgraph) {
+    struct ggml_threadpool * pool = cgraph->threadpool;
+
+    if (cgraph->n_threads <= 0) {
+        cgraph->n_threads = pool ? pool->n_threads : 8;
+    }
+
+    if (pool && cgraph->n_threads > pool->n_threads) {
+        cgraph->n_threads = pool->n_threads;
+    }
+
+    return cgraph->n_threads;
+}
+
+// sets the number of tasks of the nodes and returns the size of the work buffer they need
+static size_t ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        switch (node->op) {
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_ADD:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_MUL:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_SUM:
+            case GGML_OP_MEAN:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    node->n_tasks = n_threads;
 
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
+
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
+
+                    size_t cur = 0;
+
+                    // TODO: better way to determine if the matrix is transposed
+                    if (node->src0->nb[1] < node->src0->nb[0]) {
+                        cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
+#if defined(GGML_SIMD)
+                    } else if (ggml_compute_forward_mul_mat_use_gemm(node->src0, node->src1, node)) {
+                        cur = GGML_GEMM_WSIZE*node->n_tasks;
+#endif
+                    } else {
                         if (node->src0->type == GGML_TYPE_F16 &&
                             node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1; // TODO: this actually is doing nothing
+                                                   //       the threads are still spinning
+                                cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else {
+                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+                            }
+#else
+                            cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+#endif
                         } else if (node->src0->type == GGML_TYPE_F32 &&
                                    node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
+                            cur = 0;
+                        } else if (quantize_fns[node->src0->type].vec_dot_q8_0 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1;
+                                cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else
+#endif
+                            {
+                                cur = GGML_TYPE_SIZE[GGML_TYPE_Q8_0]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
+                            }
                         } else {
                             GGML_ASSERT(false);
                         }
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CPY:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CONV_1D_1S:
+            case GGML_OP_CONV_1D_2S:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-                        size_t cur = 0;
+                    size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        assert(false);
-                    } break;
-            }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN_KV:
+                {
+                    node->n_tasks = n_threads;
+
+                    // output row, scores of a block and the query in F16 of each thread
+                    const size_t cur = sizeof(float)*(2*node->src0->ne[0] + GGML_FLASH_ATTN_KV_BLOCK + CACHE_LINE_SIZE_F32)*node->n_tasks;
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    assert(false);
+                } break;
         }
+    }
+
+    return work_size > 0 ? work_size + CACHE_LINE_SIZE*(n_threads - 1) : 0;
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_threadpool * pool = cgraph->threadpool;
+
+    const int n_threads = ggml_graph_n_threads(cgraph);
+
+    // without a pool the workers only live for this graph
+    struct ggml_threadpool * pool_local = NULL;
+    if (pool == NULL && n_threads > 1) {
+        pool = pool_local = ggml_threadpool_new(n_threads, -1);
+    }
+
+    // initialize tasks + work buffer
+    {
+        const size_t work_size = ggml_graph_plan(cgraph, n_threads);
 
         if (cgraph->work != NULL && work_size > cgraph->work_size) {
             assert(false); // TODO: better handling
         }
 
         if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+            // the graphs of no_alloc contexts get their work buffer from ggml_allocr_alloc_graph()
+            GGML_ASSERT(!ctx->no_alloc);
+
+            cgraph->work_size = work_size;
 
             GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size)->data;
         }
     }
 
@@ -7432,43 +8857,15 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             /*.type  =*/ GGML_TASK_INIT,
             /*.ith   =*/ 0,
             /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
+            /*.wsize =*/ cgraph->work ? cgraph->work_size : 0,
+            /*.wdata =*/ cgraph->work,
         };
 
         ggml_compute_forward(&params, node);
 
         // COMPUTE
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_store(&state_shared.has_work, true);
+            ggml_threadpool_start(pool, node, GGML_TASK_COMPUTE, cgraph);
         }
 
         params.type = GGML_TASK_COMPUTE;
@@ -7476,76 +8873,22 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
         // wait for thread pool
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_threadpool_finish(pool);
         }
 
         // FINALIZE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+        const bool finalize_parallel = node->n_tasks > 1 && ggml_graph_node_finalize_parallel(node);
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_store(&state_shared.has_work, true);
+        if (finalize_parallel) {
+            ggml_threadpool_start(pool, node, GGML_TASK_FINALIZE, cgraph);
         }
 
         params.type = GGML_TASK_FINALIZE;
         ggml_compute_forward(&params, node);
 
         // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
-
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
-
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+        if (finalize_parallel) {
+            ggml_threadpool_finish(pool);
         }
 
         // performance stats (node)
@@ -7559,19 +8902,7 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         }
     }
 
-    // join thread pool
-    if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            assert(rc == 0);
-            UNUSED(rc);
-        }
-
-        ggml_lock_destroy(&state_shared.spin);
-    }
+    ggml_threadpool_free(pool_local);
 
     // performance stats (graph)
     {
@@ -7591,6 +8922,347 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+// graph allocator
+
+#define GGML_ALLOCR_MAX_FREE_BLOCKS 256
+#define GGML_ALLOCR_HASH_SIZE       (2*GGML_MAX_NODES + 1)
+
+// the addresses of a measure allocator, only their offsets matter
+#define GGML_ALLOCR_MEASURE_BASE    ((char *) 0x1000)
+#define GGML_ALLOCR_MEASURE_SIZE    (SIZE_MAX/2)
+
+struct ggml_allocr_block {
+    size_t offset;
+    size_t size;
+};
+
+// what the allocator knows about a tensor, valid while gen matches the allocator's
+struct ggml_allocr_entry {
+    const struct ggml_tensor * tensor;
+
+    uint32_t gen;
+
+    int  n_children; // nodes of the graph that read the tensor and are not placed yet
+    int  n_views;    // views of the tensor in the graph that are still read
+    bool read;       // the graph reads the tensor, directly or through a view
+    bool owned;      // the graph placed the tensor and gives its memory back
+};
+
+struct ggml_allocr {
+    char * data;
+    size_t size;
+    size_t max_size;
+
+    bool measure;
+
+    // sorted by offset, the last block ends at the end of the buffer and may be empty
+    int n_free;
+    struct ggml_allocr_block free_blocks[GGML_ALLOCR_MAX_FREE_BLOCKS];
+
+    // open addressing on the tensor address, ggml_allocr_reset() only moves to the next generation
+    uint32_t gen;
+    struct ggml_allocr_entry hash[GGML_ALLOCR_HASH_SIZE];
+};
+
+static struct ggml_allocr * ggml_allocr_new_impl(void * data, size_t size, bool measure) {
+    struct ggml_allocr * alloc = calloc(1, sizeof(struct ggml_allocr));
+    if (alloc == NULL) {
+        return NULL;
+    }
+
+    // the buffer starts at an aligned address, the tensors are aligned relative to it
+    const size_t pad = (GGML_MEM_ALIGN - ((uintptr_t) data % GGML_MEM_ALIGN)) % GGML_MEM_ALIGN;
+
+    alloc->data    = (char *) data + MIN(pad, size);
+    alloc->size    = size - MIN(pad, size);
+    alloc->measure = measure;
+
+    ggml_allocr_reset(alloc);
+
+    return alloc;
+}
+
+struct ggml_allocr * ggml_allocr_new(void * data, size_t size) {
+    return ggml_allocr_new_impl(data, size, false);
+}
+
+struct ggml_allocr * ggml_allocr_new_measure(void) {
+    return ggml_allocr_new_impl(GGML_ALLOCR_MEASURE_BASE, GGML_ALLOCR_MEASURE_SIZE, true);
+}
+
+void ggml_allocr_free(struct ggml_allocr * alloc) {
+    free(alloc);
+}
+
+bool ggml_allocr_is_measure(const struct ggml_allocr * alloc) {
+    return alloc->measure;
+}
+
+size_t ggml_allocr_max_size(const struct ggml_allocr * alloc) {
+    // a buffer of the measured size fits at any address
+    return alloc->max_size + (alloc->measure ? GGML_MEM_ALIGN - 1 : 0);
+}
+
+void ggml_allocr_reset(struct ggml_allocr * alloc) {
+    alloc->n_free = 1;
+    alloc->free_blocks[0] = (struct ggml_allocr_block) {
+        .offset = 0,
+        .size   = alloc->size,
+    };
+
+    alloc->gen++;
+}
+
+static struct ggml_allocr_entry * ggml_allocr_entry(struct ggml_allocr * alloc, const struct ggml_tensor * tensor) {
+    size_t i = ((uintptr_t) tensor/GGML_MEM_ALIGN) % GGML_ALLOCR_HASH_SIZE;
+
+    for (int n = 0; n < GGML_ALLOCR_HASH_SIZE; n++) {
+        struct ggml_allocr_entry * entry = &alloc->hash[i];
+
+        if (entry->gen != alloc->gen) {
+            *entry = (struct ggml_allocr_entry) {
+                .tensor = tensor,
+                .gen    = alloc->gen,
+            };
+            return entry;
+        }
+
+        if (entry->tensor == tensor) {
+            return entry;
+        }
+
+        i = (i + 1) % GGML_ALLOCR_HASH_SIZE;
+    }
+
+    GGML_PRINT("%s: too many tensors, reset the allocator between graphs\n", __func__);
+    GGML_ASSERT(false);
+    return NULL;
+}
+
+static size_t ggml_allocr_tensor_size(const struct ggml_tensor * tensor) {
+    return ((ggml_nbytes(tensor) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+}
+
+// best fit among the free blocks before the last one. The last block borders the unused end of the buffer and is
+// only taken when nothing else fits, so the choices do not depend on the size of the buffer and a measured size
+// holds for the real one
+static size_t ggml_allocr_alloc_block(struct ggml_allocr * alloc, size_t size) {
+    int best = -1;
+
+    for (int i = 0; i < alloc->n_free - 1; i++) {
+        if (alloc->free_blocks[i].size >= size && (best < 0 || alloc->free_blocks[i].size < alloc->free_blocks[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best < 0) {
+        best = alloc->n_free - 1;
+
+        if (alloc->free_blocks[best].size < size) {
+            GGML_PRINT("%s: not enough space in the buffer (needed %zu, available %zu)\n",
+                    __func__, size, alloc->free_blocks[best].size);
+            GGML_ASSERT(false);
+        }
+    }
+
+    struct ggml_allocr_block * block = &alloc->free_blocks[best];
+
+    const size_t offset = block->offset;
+
+    block->offset += size;
+    block->size   -= size;
+
+    if (block->size == 0 && best < alloc->n_free - 1) {
+        for (int i = best; i < alloc->n_free - 1; i++) {
+            alloc->free_blocks[i] = alloc->free_blocks[i + 1];
+        }
+        alloc->n_free--;
+    }
+
+    alloc->max_size = MAX(alloc->max_size, offset + size);
+
+    return offset;
+}
+
+static void ggml_allocr_free_block(struct ggml_allocr * alloc, size_t offset, size_t size) {
+    // the first block after the freed one, there is always the last one
+    int i = 0;
+    while (alloc->free_blocks[i].offset < offset) {
+        i++;
+    }
+
+    struct ggml_allocr_block * next = &alloc->free_blocks[i];
+    struct ggml_allocr_block * prev = i > 0 ? &alloc->free_blocks[i - 1] : NULL;
+
+    const bool merge_prev = prev != NULL && prev->offset + prev->size == offset;
+    const bool merge_next = offset + size == next->offset;
+
+    if (merge_prev && merge_next) {
+        prev->size += size + next->size;
+        for (int j = i; j < alloc->n_free - 1; j++) {
+            alloc->free_blocks[j] = alloc->free_blocks[j + 1];
+        }
+        alloc->n_free--;
+    } else if (merge_prev) {
+        prev->size += size;
+    } else if (merge_next) {
+        next->offset  = offset;
+        next->size   += size;
+    } else {
+        GGML_ASSERT(alloc->n_free < GGML_ALLOCR_MAX_FREE_BLOCKS && "too many free blocks");
+        for (int j = alloc->n_free; j > i; j--) {
+            alloc->free_blocks[j] = alloc->free_blocks[j - 1];
+        }
+        alloc->free_blocks[i] = (struct ggml_allocr_block) {
+            .offset = offset,
+            .size   = size,
+        };
+        alloc->n_free++;
+    }
+}
+
+static void ggml_allocr_place(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    tensor->data = alloc->data + ggml_allocr_alloc_block(alloc, ggml_allocr_tensor_size(tensor));
+}
+
+void ggml_allocr_alloc(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    GGML_ASSERT(tensor->data == NULL && tensor->view_src == NULL);
+
+    ggml_allocr_place(alloc, tensor);
+}
+
+// gives the tensors of the graph without data their memory, the views get the memory of their source
+static void ggml_allocr_init_tensor(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    if (tensor->data != NULL) {
+        return;
+    }
+
+    if (tensor->view_src != NULL) {
+        ggml_allocr_init_tensor(alloc, tensor->view_src);
+        tensor->data = (char *) tensor->view_src->data + tensor->view_offs;
+        return;
+    }
+
+    ggml_allocr_place(alloc, tensor);
+    ggml_allocr_entry(alloc, tensor)->owned = true;
+}
+
+// the graph is done with the tensor, a view is done with its source once no other view of it is read
+static void ggml_allocr_release(struct ggml_allocr * alloc, struct ggml_tensor * tensor) {
+    struct ggml_allocr_entry * entry = ggml_allocr_entry(alloc, tensor);
+
+    if (entry->n_children > 0 || entry->n_views > 0) {
+        return;
+    }
+
+    if (tensor->view_src != NULL) {
+        struct ggml_allocr_entry * src = ggml_allocr_entry(alloc, tensor->view_src);
+
+        src->n_views--;
+        if (src->read) {
+            ggml_allocr_release(alloc, tensor->view_src);
+        }
+        return;
+    }
+
+    if (entry->owned) {
+        entry->owned = false;
+        ggml_allocr_free_block(alloc, (char *) tensor->data - alloc->data, ggml_allocr_tensor_size(tensor));
+    }
+}
+
+static struct ggml_tensor * ggml_allocr_src(const struct ggml_tensor * node, int i) {
+    switch (i) {
+        case 0:  return node->src0;
+        case 1:  return node->src1;
+        default: return node->opt[i - 2];
+    }
+}
+
+void ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * cgraph) {
+    const int n_src = 2 + GGML_MAX_OPT;
+
+    // the tensors of an earlier graph placed by this allocator keep their memory, but not their readers
+    for (int i = 0; i < cgraph->n_nodes + cgraph->n_leafs; i++) {
+        struct ggml_tensor * tensor = i < cgraph->n_nodes ? cgraph->nodes[i] : cgraph->leafs[i - cgraph->n_nodes];
+
+        for (int j = 0; j < 2; j++) {
+            struct ggml_tensor * t = j == 0 ? tensor : tensor->view_src;
+            if (t == NULL) {
+                continue;
+            }
+
+            struct ggml_allocr_entry * entry = ggml_allocr_entry(alloc, t);
+            entry->n_children = 0;
+            entry->n_views    = 0;
+            entry->read       = false;
+        }
+    }
+
+    // the readers of every tensor, the readers of a view also read its source
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (node->view_src != NULL) {
+            ggml_allocr_entry(alloc, node->view_src)->n_views++;
+        }
+
+        for (int j = 0; j < n_src; j++) {
+            struct ggml_tensor * src = ggml_allocr_src(node, j);
+            if (src == NULL) {
+                continue;
+            }
+
+            ggml_allocr_entry(alloc, src)->n_children++;
+            ggml_allocr_entry(alloc, src)->read = true;
+            if (src->view_src != NULL) {
+                ggml_allocr_entry(alloc, src->view_src)->read = true;
+            }
+        }
+    }
+
+    // the work buffer is used by every node, its memory is given back after the last one
+    const size_t work_size = ggml_graph_plan(cgraph, ggml_graph_n_threads(cgraph));
+    const size_t work_offs = work_size > 0 ? ggml_allocr_alloc_block(alloc, work_size) : 0;
+
+    cgraph->work_size = work_size;
+    cgraph->work      = work_size > 0 ? alloc->data + work_offs : NULL;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        for (int j = 0; j < n_src; j++) {
+            struct ggml_tensor * src = ggml_allocr_src(node, j);
+            if (src != NULL) {
+                ggml_allocr_init_tensor(alloc, src);
+            }
+        }
+
+        ggml_allocr_init_tensor(alloc, node);
+
+        for (int j = 0; j < n_src; j++) {
+            struct ggml_tensor * src = ggml_allocr_src(node, j);
+            if (src == NULL) {
+                continue;
+            }
+
+            ggml_allocr_entry(alloc, src)->n_children--;
+            ggml_allocr_release(alloc, src);
+        }
+
+        // a view that nothing reads only writes into its source, e.g. the destination of ggml_cpy
+        if (node->view_src != NULL && ggml_allocr_entry(alloc, node)->n_children == 0) {
+            ggml_allocr_release(alloc, node);
+        }
+    }
+
+    if (work_size > 0) {
+        ggml_allocr_free_block(alloc, work_offs, work_size);
+    }
+}
+
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
     for (int i = 0; i < cgraph->n_nodes; i++) {
         struct ggml_tensor * grad = cgraph->grads[i];
@@ -8411,6 +10083,7 @@ enum ggml_opt_result ggml_opt(
         struct ggml_init_params params_ctx = {
             .mem_size   = 16*1024*1024,
             .mem_buffer = NULL,
+            .no_alloc   = false,
         };
 
         ctx = ggml_init(params_ctx);
@@ -8457,6 +10130,51 @@ enum ggml_opt_result ggml_opt(
 
 ////////////////////////////////////////////////////////////////////////////////
 
+size_t ggml_quantize_q4_0(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    for (int j = 0; j < n; j += k) {
+        block_q4_0 * restrict y = (block_q4_0 *) dst + j/QK;
+
+        quantize_row_q4_0(src + j, y, k);
+
+        if (hist) {
+            for (int i = 0; i < nb; i++) {
+                for (int l = 0; l < QK/2; l++) {
+                    hist[y[i].qs[l] & 0x0F]++;
+                    hist[y[i].qs[l] >>   4]++;
+                }
+            }
+        }
+    }
+
+    return (n/QK*sizeof(block_q4_0));
+}
+
+size_t ggml_quantize_q8_0(const float * src, void * dst, int n, int k, int64_t * hist) {
+    assert(k % QK == 0);
+    const int nb = k / QK;
+
+    for (int j = 0; j < n; j += k) {
+        block_q8_0 * restrict y = (block_q8_0 *) dst + j/QK;
+
+        quantize_row_q8_0(src + j, y, k);
+
+        if (hist) {
+            for (int i = 0; i < nb; i++) {
+                for (int l = 0; l < QK; l++) {
+                    hist[(y[i].qs[l] + 128)/16]++;
+                }
+            }
+        }
+    }
+
+    return (n/QK*sizeof(block_q8_0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int ggml_cpu_has_avx(void) {
 #if defined(__AVX__)
     return 1;
@@ -35,6 +35,7 @@
 //       struct ggml_init_params params = {
 //           .mem_size   = 16*1024*1024,
 //           .mem_buffer = NULL,
+//           .no_alloc   = false,
 //       };
 //
 //       // memory allocation happens here
@@ -203,6 +204,8 @@ enum ggml_type {
     GGML_TYPE_I32,
     GGML_TYPE_F16,
     GGML_TYPE_F32,
+    GGML_TYPE_Q4_0, // blocks of 32 4-bit weights with a scale
+    GGML_TYPE_Q8_0, // blocks of 32 8-bit weights with a scale
     GGML_TYPE_COUNT,
 };
 
@@ -245,6 +248,7 @@ enum ggml_op {
 
     GGML_OP_FLASH_ATTN,
     GGML_OP_FLASH_FF,
+    GGML_OP_FLASH_ATTN_KV,
 
     GGML_OP_COUNT,
 };
@@ -279,17 +283,27 @@ struct ggml_tensor {
     int64_t perf_time_us;
 
     void * data;
+
+    // the tensor that owns the memory of a view, its data starts view_offs bytes into it
+    struct ggml_tensor * view_src;
+    size_t               view_offs;
+
     char padding[8];
 };
 
 // computation graph
+struct ggml_threadpool;
+
 struct ggml_cgraph {
     int n_nodes;
     int n_leafs;
     int n_threads;
 
     size_t work_size;
-    struct ggml_tensor * work;
+    void * work;
+
+    // workers to compute the graph with, NULL starts n_threads - 1 threads for this graph only
+    struct ggml_threadpool * threadpool;
 
     struct ggml_tensor * nodes[GGML_MAX_NODES];
     struct ggml_tensor * grads[GGML_MAX_NODES];
@@ -305,6 +319,7 @@ struct ggml_init_params {
     // memory pool
     size_t mem_size;   // bytes
     void * mem_buffer; // if NULL, memory will be allocated internally
+    bool   no_alloc;   // don't allocate memory for the tensor data, the caller sets tensor->data or uses ggml_allocr
 };
 
 void    ggml_time_init(void); // call this once at the beginning of the program
@@ -319,14 +334,23 @@ void ggml_print_objects(const struct ggml_context * ctx);
 int    ggml_nelements(const struct ggml_tensor * tensor);
 size_t ggml_nbytes   (const struct ggml_tensor * tensor);
 
-size_t ggml_type_size   (enum ggml_type type);
+// the quantized types store ggml_blck_size() elements in ggml_type_size() bytes,
+// the first dimension of their tensors must be a multiple of the block size
+int    ggml_blck_size   (enum ggml_type type);
+size_t ggml_type_size   (enum ggml_type type); // size in bytes of a block
+float  ggml_type_sizef  (enum ggml_type type); // ggml_type_size()/ggml_blck_size()
 size_t ggml_element_size(const struct ggml_tensor * tensor);
 
+const char * ggml_type_name(enum ggml_type type);
+
 struct ggml_context * ggml_init(struct ggml_init_params params);
 void ggml_free(struct ggml_context * ctx);
 
 size_t ggml_used_mem(const struct ggml_context * ctx);
 
+// the memory a tensor without data takes in a context, the scalar op parameters included
+size_t ggml_tensor_overhead(void);
+
 struct ggml_tensor * ggml_new_tensor(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -363,7 +387,7 @@ struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
 
 struct ggml_tensor * ggml_dup_tensor (struct ggml_context * ctx, const struct ggml_tensor * src);
-struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, const struct ggml_tensor * src);
+struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, struct ggml_tensor * src);
 
 struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor);
 struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value);
@@ -596,6 +620,17 @@ struct ggml_tensor * ggml_flash_ff(
         struct ggml_tensor  * c0,
         struct ggml_tensor  * c1);
 
+// attention of the rows of q over the positions of a K/V cache, one row per position in both k and v:
+//   q: [D, N, n_head], k, v: [D, M, n_head] -> [D, N, n_head]
+// q and k are not scaled. The softmax is computed online over blocks of positions, no KQ tensor is made.
+// masked: the N queries are the last N positions of the cache, query i attends to the positions [0, M - N + i]
+struct ggml_tensor * ggml_flash_attn_kv(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        bool                  masked);
+
 //
 // automatic differentiation
 //
@@ -610,8 +645,38 @@ struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
 struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+
+// long-lived workers for ggml_graph_compute, shared by every graph that sets cgraph->threadpool. n_threads counts
+// the thread calling ggml_graph_compute, which computes its share of every node. Idle workers spin briefly and then
+// sleep until the next node. cpu_core_offset >= 0 pins worker i to core cpu_core_offset + i (linux only).
+// A pool runs one graph at a time.
+struct ggml_threadpool * ggml_threadpool_new(int n_threads, int cpu_core_offset);
+void ggml_threadpool_free(struct ggml_threadpool * pool);
+int  ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+// graph allocator
+//
+// places the data of the tensors of no_alloc contexts in a buffer. ggml_allocr_alloc_graph() goes through the nodes
+// in order and gives the memory of a tensor back once the last node that reads it, or a view of it, is placed, so
+// the tensors whose lifetimes do not overlap share memory. The nodes that nothing reads are the outputs and keep
+// their memory, so do the tensors placed with ggml_allocr_alloc(), until ggml_allocr_reset(). A graph must be
+// computed before the next one is placed with the same allocator.
+//
+// A measure allocator places the tensors at made-up addresses and only records the size of the buffer that the
+// same graphs need, ggml_allocr_max_size() is the largest one since the allocator was made.
+struct ggml_allocr;
+
+struct ggml_allocr * ggml_allocr_new(void * data, size_t size);
+struct ggml_allocr * ggml_allocr_new_measure(void);
+void ggml_allocr_free(struct ggml_allocr * alloc);
+
+bool   ggml_allocr_is_measure (const struct ggml_allocr * alloc);
+size_t ggml_allocr_max_size   (const struct ggml_allocr * alloc);
+void   ggml_allocr_reset      (struct ggml_allocr * alloc);
+void   ggml_allocr_alloc      (struct ggml_allocr * alloc, struct ggml_tensor * tensor);
+void   ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * cgraph);
+
 // print info and performance information for the graph
 void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
@@ -717,6 +782,15 @@ enum ggml_opt_result ggml_opt(
         struct ggml_opt_params params,
         struct ggml_tensor * f);
 
+//
+// quantization
+//
+
+// quantize the n floats of src, in rows of k, into dst and return the bytes written
+// hist, if not NULL, gets the counts of the quantized values in 16 bins
+size_t ggml_quantize_q4_0(const float * src, void * dst, int n, int k, int64_t * hist);
+size_t ggml_quantize_q8_0(const float * src, void * dst, int n, int k, int64_t * hist);
+
 //
 // system info
 //
@@ -245,7 +245,7 @@ if len(sys.argv) > 4:
 
 fout = open(fname_out, "wb")
 
-fout.write(struct.pack("i", 0x67676d6c)) # magic: ggml in hex
+fout.write(struct.pack("i", 0x67676d61)) # magic: ggma in hex, ggml with a padding field after every tensor header
 fout.write(struct.pack("i", hparams["n_vocab"]))
 fout.write(struct.pack("i", hparams["n_audio_ctx"]))
 fout.write(struct.pack("i", hparams["n_audio_state"]))
@@ -317,6 +317,12 @@ for name in list_vars.keys():
         fout.write(struct.pack("i", data.shape[n_dims - 1 - i]))
     fout.write(str);
 
+    # the number of zeros that follow, so that the data starts at a multiple of 32 bytes in the file and
+    # whisper_init_from_file_mmap() can use the weights in place
+    n_pad = (32 - (fout.tell() + 4) % 32) % 32
+    fout.write(struct.pack("i", n_pad))
+    fout.write(b'\0' * n_pad)
+
     # data
     data.tofile(fout)
 
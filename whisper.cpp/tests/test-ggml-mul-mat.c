@@ -0,0 +1,278 @@
+// compares ggml_mul_mat with a naive double precision reference
+//
+//   - F32 and F16 weights: the blocked GEMM (edge tiles, more than one KC block, permuted src0) and the
+//     ggml_vec_dot path of the small products
+//   - Q4_0 and Q8_0 weights: quantize -> dequantize round trip (through ggml_get_rows) and the quantized vec_dot
+//
+// every case runs with 1 to 5 threads
+
+#include "ggml.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS 5
+
+static int n_failed = 0;
+static int n_checked = 0;
+
+static float frand(void) {
+    return (float) rand()/(float) RAND_MAX - 0.5f;
+}
+
+static struct ggml_context * make_context(void) {
+    struct ggml_init_params params = { 128*1024*1024, NULL, false };
+    return ggml_init(params);
+}
+
+static void compute(struct ggml_context * ctx, struct ggml_tensor * t, int n_threads) {
+    struct ggml_cgraph gf = ggml_build_forward(t);
+    gf.n_threads = n_threads;
+    ggml_graph_compute(ctx, &gf);
+}
+
+static void report(const char * name, bool ok, double err, double tol) {
+    n_checked++;
+    if (!ok) {
+        n_failed++;
+        fprintf(stderr, "FAILED %s: error %e, tolerance %e\n", name, err, tol);
+    }
+}
+
+// F32 / F16 weights of K x M x H, activations of K x N x H; perm stores src0 with the rows and heads swapped and
+// multiplies the permuted view, the way the attention does with K
+static void test_float(enum ggml_type type, int M, int N, int K, int H, bool perm, int n_threads) {
+    struct ggml_context * ctx = make_context();
+
+    float * a = malloc(sizeof(float)*K*M*H);
+    for (int i = 0; i < K*M*H; ++i) {
+        // the reference uses the weights as they are stored
+        a[i] = type == GGML_TYPE_F16 ? ggml_fp16_to_fp32(ggml_fp32_to_fp16(frand())) : frand();
+    }
+
+    struct ggml_tensor * src0;
+    if (perm) {
+        struct ggml_tensor * t = ggml_new_tensor_3d(ctx, type, K, H, M);
+        for (int h = 0; h < H; ++h) {
+            for (int m = 0; m < M; ++m) {
+                for (int k = 0; k < K; ++k) {
+                    char * dst = (char *) t->data + k*t->nb[0] + h*t->nb[1] + m*t->nb[2];
+                    const float v = a[(h*M + m)*K + k];
+                    if (type == GGML_TYPE_F16) {
+                        *(ggml_fp16_t *) dst = ggml_fp32_to_fp16(v);
+                    } else {
+                        *(float *) dst = v;
+                    }
+                }
+            }
+        }
+        src0 = ggml_permute(ctx, t, 0, 2, 1, 3);
+    } else {
+        src0 = ggml_new_tensor_3d(ctx, type, K, M, H);
+        for (int i = 0; i < K*M*H; ++i) {
+            if (type == GGML_TYPE_F16) {
+                ((ggml_fp16_t *) src0->data)[i] = ggml_fp32_to_fp16(a[i]);
+            } else {
+                ((float *) src0->data)[i] = a[i];
+            }
+        }
+    }
+
+    struct ggml_tensor * src1 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, K, N, H);
+    float * b = (float *) src1->data;
+    for (int i = 0; i < K*N*H; ++i) {
+        b[i] = frand();
+    }
+
+    struct ggml_tensor * dst = ggml_mul_mat(ctx, src0, src1);
+    compute(ctx, dst, n_threads);
+
+    // the small products round the activations to F16 for the F16 weights
+    const double rel = type == GGML_TYPE_F16 ? 1e-3 : 1e-5;
+
+    double max_err = 0.0;
+    double max_tol = 0.0;
+    bool ok = true;
+    for (int h = 0; h < H; ++h) {
+        for (int n = 0; n < N; ++n) {
+            for (int m = 0; m < M; ++m) {
+                double sum  = 0.0;
+                double sabs = 0.0;
+                for (int k = 0; k < K; ++k) {
+                    const double p = (double) a[(h*M + m)*K + k]*b[(h*N + n)*K + k];
+                    sum  += p;
+                    sabs += fabs(p);
+                }
+                const double err = fabs(((float *) dst->data)[(h*N + n)*M + m] - sum);
+                const double tol = rel*sabs + 1e-6;
+                if (err > tol) {
+                    ok = false;
+                }
+                if (err > max_err) {
+                    max_err = err;
+                    max_tol = tol;
+                }
+            }
+        }
+    }
+
+    char name[128];
+    snprintf(name, sizeof(name), "mul_mat %s M = %d, N = %d, K = %d, H = %d, perm = %d, n_threads = %d",
+            ggml_type_name(type), M, N, K, H, perm, n_threads);
+    report(name, ok, max_err, max_tol);
+
+    free(a);
+    ggml_free(ctx);
+}
+
+// Q4_0 / Q8_0 weights of K x M, activations of K x N; the activations are quantized to Q8_0 by the product
+static void test_quantized(enum ggml_type type, int M, int N, int K, int n_threads) {
+    struct ggml_context * ctx = make_context();
+
+    const int qk = ggml_blck_size(type);
+
+    float * a = malloc(sizeof(float)*K*M);
+    for (int i = 0; i < K*M; ++i) {
+        a[i] = frand();
+    }
+
+    int64_t hist[16] = { 0 };
+
+    struct ggml_tensor * src0 = ggml_new_tensor_2d(ctx, type, K, M);
+    if (type == GGML_TYPE_Q4_0) {
+        ggml_quantize_q4_0(a, src0->data, K*M, K, hist);
+    } else {
+        ggml_quantize_q8_0(a, src0->data, K*M, K, hist);
+    }
+
+    // dequantized weights, every row
+    struct ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, M);
+    for (int m = 0; m < M; ++m) {
+        ((int32_t *) rows->data)[m] = m;
+    }
+    struct ggml_tensor * deq = ggml_get_rows(ctx, src0, rows);
+    compute(ctx, deq, n_threads);
+    const float * ad = (const float *) deq->data;
+
+    char name[128];
+
+    // round trip: the weights are rounded to the nearest step of amax/127 (Q8_0) or amax/8 (Q4_0), where the
+    // maximum is -8 steps and values above 7.5 steps of the other sign are clamped to 7 steps
+    {
+        const double steps = type == GGML_TYPE_Q4_0 ? 8.0 : 127.0;
+
+        double max_err = 0.0;
+        double max_tol = 0.0;
+        bool ok = true;
+        for (int ib = 0; ib < K*M/qk; ++ib) {
+            double amax = 0.0;
+            for (int j = 0; j < qk; ++j) {
+                amax = fmax(amax, fabs(a[ib*qk + j]));
+            }
+            const double step = amax/steps;
+            for (int j = 0; j < qk; ++j) {
+                const bool clamped = type == GGML_TYPE_Q4_0 && fabs(a[ib*qk + j]) > 7.5*step;
+                const double tol = (clamped ? 1.0 : 0.5)*step*(1.0 + 1e-5) + 1e-7;
+                const double err = fabs(ad[ib*qk + j] - a[ib*qk + j]);
+                if (err > tol) {
+                    ok = false;
+                }
+                if (err > max_err) {
+                    max_err = err;
+                    max_tol = tol;
+                }
+            }
+        }
+
+        snprintf(name, sizeof(name), "dequantize %s M = %d, K = %d, n_threads = %d", ggml_type_name(type), M, K, n_threads);
+        report(name, ok, max_err, max_tol);
+    }
+
+    struct ggml_tensor * src1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, K, N);
+    float * b = (float *) src1->data;
+    for (int i = 0; i < K*N; ++i) {
+        b[i] = frand();
+    }
+
+    struct ggml_tensor * dst = ggml_mul_mat(ctx, src0, src1);
+    compute(ctx, dst, n_threads);
+
+    // against the dequantized weights, the error is the Q8_0 rounding of the activations, half a step of their
+    // block maximum/127
+    {
+        double max_err = 0.0;
+        double max_tol = 0.0;
+        bool ok = true;
+        for (int n = 0; n < N; ++n) {
+            for (int m = 0; m < M; ++m) {
+                double sum  = 0.0;
+                double sabs = 0.0;
+                double tol  = 1e-5;
+                for (int ib = 0; ib < K/qk; ++ib) {
+                    double bmax = 0.0;
+                    double aabs = 0.0;
+                    for (int j = 0; j < qk; ++j) {
+                        const int k = ib*qk + j;
+                        const double p = (double) ad[m*K + k]*b[n*K + k];
+                        sum  += p;
+                        sabs += fabs(p);
+                        aabs += fabs(ad[m*K + k]);
+                        bmax  = fmax(bmax, fabs(b[n*K + k]));
+                    }
+                    tol += aabs*bmax/254.0*1.01;
+                }
+                tol += 1e-5*sabs;
+
+                const double err = fabs(((float *) dst->data)[n*M + m] - sum);
+                if (err > tol) {
+                    ok = false;
+                }
+                if (err > max_err) {
+                    max_err = err;
+                    max_tol = tol;
+                }
+            }
+        }
+
+        snprintf(name, sizeof(name), "mul_mat %s M = %d, N = %d, K = %d, n_threads = %d",
+                ggml_type_name(type), M, N, K, n_threads);
+        report(name, ok, max_err, max_tol);
+    }
+
+    free(a);
+    ggml_free(ctx);
+}
+
+int main(void) {
+    srand(0);
+
+    for (int n_threads = 1; n_threads <= MAX_THREADS; ++n_threads) {
+        for (int t = 0; t < 2; ++t) {
+            const enum ggml_type type = t == 0 ? GGML_TYPE_F32 : GGML_TYPE_F16;
+
+            // the GEMM: partial tiles in both directions, K over one and two KC blocks, several heads
+            test_float(type,  67,  45,  300, 2, false, n_threads);
+            test_float(type,  33,  97,  513, 1, false, n_threads);
+            test_float(type, 128,  64,   64, 3, false, n_threads);
+            test_float(type,  64,  77,  130, 2, true,  n_threads);
+
+            // ggml_vec_dot: a single token and a few ones
+            test_float(type,  96,   1,  384, 1, false, n_threads);
+            test_float(type,  40,   5,   64, 2, true,  n_threads);
+        }
+
+        for (int t = 0; t < 2; ++t) {
+            const enum ggml_type type = t == 0 ? GGML_TYPE_Q4_0 : GGML_TYPE_Q8_0;
+
+            test_quantized(type, 37,  1,  96, n_threads);
+            test_quantized(type, 64, 13, 512, n_threads);
+        }
+    }
+
+    printf("%s: %d of %d checks passed\n", __func__, n_checked - n_failed, n_checked);
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -17,6 +17,19 @@
 #include <regex>
 #include <random>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define WHISPER_ASSERT(x) \
     do { \
         if (!(x)) { \
@@ -40,6 +53,11 @@
 #define WHISPER_USE_FLASH_ATTN
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
+#define WHISPER_KV_BLOCK     16 // tokens per block of the self-attention KV cache
+
+// model file magic, the aligned files add a padding field after every tensor header, see whisper_model_load()
+#define WHISPER_FILE_MAGIC         0x67676d6c // "ggml"
+#define WHISPER_FILE_MAGIC_ALIGNED 0x67676d61 // "ggma"
 
 // available whisper models
 enum e_model {
@@ -179,37 +197,10 @@ static const std::map<e_model, size_t> MEM_REQ_KV_CROSS = {
     { MODEL_LARGE,   235ull*MB },
 };
 
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,     80ull*MB },
-    { MODEL_BASE,    128ull*MB },
-    { MODEL_SMALL,   300ull*MB },
-    { MODEL_MEDIUM,  680ull*MB },
-    { MODEL_LARGE,  1100ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_ENCODE_LAYER = {
-    { MODEL_TINY,    104ull*MB },
-    { MODEL_BASE,    138ull*MB },
-    { MODEL_SMALL,   208ull*MB },
-    { MODEL_MEDIUM,  280ull*MB },
-    { MODEL_LARGE,   354ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,    200ull*MB },
-    { MODEL_BASE,    202ull*MB },
-    { MODEL_SMALL,   204ull*MB },
-    { MODEL_MEDIUM,  206ull*MB },
-    { MODEL_LARGE,   208ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE_LAYER = {
-    { MODEL_TINY,     32ull*MB },
-    { MODEL_BASE,     44ull*MB },
-    { MODEL_SMALL,    64ull*MB },
-    { MODEL_MEDIUM,   84ull*MB },
-    { MODEL_LARGE,   110ull*MB },
-};
+// the metadata of the tensors of a graph context, their data is placed by the graph allocators
+static size_t whisper_graph_meta_size() {
+    return 2*GGML_MAX_NODES*ggml_tensor_overhead();
+}
 
 struct whisper_mel {
     int n_len;
@@ -285,7 +276,7 @@ struct whisper_hparams {
     int32_t n_text_head   = 6;
     int32_t n_text_layer  = 4;
     int32_t n_mels        = 80;
-    int32_t f16           = 1;
+    int32_t ftype         = 1;
 };
 
 // audio encoding layer
@@ -386,6 +377,26 @@ struct whisper_kv_cache {
     int n; // number of tokens currently in the cache
 };
 
+// self-attention KV cache of the decoders, paged in blocks of WHISPER_KV_BLOCK tokens
+//
+// each decoder has a table of the blocks that hold its tokens. The decoders that continue the same tokens (the prompt,
+// the common prefix of the beams) use the same blocks and a block is copied only when a decoder writes into a block
+// that another table still uses, so a beam search step does not copy the caches of the beams
+struct whisper_kv_pool {
+    whisper_kv_cache cache; // layer il holds the rows [il*n_rows, (il + 1)*n_rows) of cache.k and cache.v
+
+    int n_rows = 0; // WHISPER_KV_BLOCK*number of blocks
+
+    std::vector<int> refs; // number of tables using each block
+};
+
+// the blocks of the self-attention KV cache used by a decoder, token i is in row i%WHISPER_KV_BLOCK of blocks[i/WHISPER_KV_BLOCK]
+struct whisper_kv_table {
+    std::vector<int> blocks;
+
+    int n = 0; // number of tokens currently in the cache
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -426,6 +437,9 @@ struct whisper_model {
     // the model memory buffer is read-only and can be shared between processors
     std::vector<uint8_t> * buf;
 
+    // the model file when it is memory-mapped, the weights point into it
+    struct whisper_mmap * mapping = nullptr;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -446,8 +460,8 @@ struct whisper_sequence {
 
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
-    // each decoders keeps its own KV-cache
-    whisper_kv_cache kv_self;
+    // each decoders keeps its own table in the self-attention KV cache
+    whisper_kv_table kv_self;
 
     // the currently generated sequence of tokens
     whisper_sequence sequence;
@@ -466,13 +480,20 @@ struct whisper_decoder {
     std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
 };
 
-struct whisper_context {
-    int64_t t_load_us   = 0;
+// the tensor data of the graphs is placed in the buffer by the graph allocator, the dry runs of the graphs with the
+// measure allocator record the size of the buffer
+struct whisper_allocr {
+    struct ggml_allocr * alloc   = nullptr;
+    struct ggml_allocr * measure = nullptr;
+
+    std::vector<uint8_t> data;
+};
+
+struct whisper_state {
     int64_t t_mel_us    = 0;
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
     int64_t t_decode_us = 0;
-    int64_t t_start_us  = 0;
 
     int32_t n_sample = 0; // number of tokens sampled
     int32_t n_encode = 0; // number of encoder calls
@@ -480,23 +501,25 @@ struct whisper_context {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
-    ggml_type wtype; // weight type (FP32 or FP16)
-
     whisper_mel mel;
 
-    whisper_model model;
-    whisper_vocab vocab;
-
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
 
+    // self-attention KV cache, the decoders have their tables in it
+    whisper_kv_pool kv_self;
+
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
-    // memory buffers used by encode / decode contexts
+    // the metadata of the tensors of the encode / decode contexts, the data is in the allocators of the contexts.
+    // A dry run of the graphs before every evaluation sizes the buffers of the allocators
     std::vector<uint8_t> buf_compute;
     std::vector<uint8_t> buf_compute_layer;
 
+    whisper_allocr alloc;
+    whisper_allocr alloc_layer;
+
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
@@ -515,7 +538,26 @@ struct whisper_context {
     std::vector<float> energy; // PCM signal energy
 
     // [EXPERIMENTAL] speed-up techniques
-    int32_t exp_n_audio_ctx; // 0 - use default
+    int32_t exp_n_audio_ctx = 0; // 0 - use default
+
+    // workers of the encoder and decoder graphs, kept between calls
+    struct ggml_threadpool * threadpool = nullptr;
+    int cpu_core_offset = -1;
+};
+
+// the model is read-only after loading, any number of states can run against it at the same time
+struct whisper_context {
+    int64_t t_load_us  = 0;
+    int64_t t_start_us = 0;
+
+    ggml_type wtype = GGML_TYPE_F16; // type of the 2d weights (FP32, FP16 or quantized)
+    ggml_type itype = GGML_TYPE_F16; // type of the conv weights, the kv caches and the intermediate results (FP32 or FP16)
+
+    whisper_model model;
+    whisper_vocab vocab;
+
+    // the state of the whisper_*() calls without a state argument, null for the *_no_state contexts
+    whisper_state * state = nullptr;
 };
 
 template<typename T>
@@ -534,6 +576,7 @@ static bool kv_cache_init(
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size();
     params.mem_buffer = cache.buf.data();
+    params.no_alloc   = false;
 
     cache.ctx = ggml_init(params);
 
@@ -554,50 +597,335 @@ static bool kv_cache_init(
     return true;
 }
 
-static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
-    WHISPER_ASSERT(cache.ctx);
+static void kv_cache_free(struct whisper_kv_cache & cache) {
+    if (cache.ctx) {
+        ggml_free(cache.ctx);
+        cache.ctx = nullptr;
+    }
+}
 
-    const int n_elements = ggml_nelements(cache.k);
-    WHISPER_ASSERT(n_elements == ggml_nelements(cache.v));
+static bool kv_pool_init(
+        const struct whisper_hparams & hparams,
+                        const size_t   mem_bytes,
+              struct whisper_kv_pool & pool,
+                           ggml_type   wtype,
+                                 int   n_blocks) {
+    if (!kv_cache_init(hparams, mem_bytes, pool.cache, wtype, n_blocks*WHISPER_KV_BLOCK)) {
+        return false;
+    }
 
-    const ggml_type wtype = cache.k->type;
-    WHISPER_ASSERT(wtype == cache.v->type);
+    pool.n_rows = n_blocks*WHISPER_KV_BLOCK;
+    pool.refs.assign(n_blocks, 0);
 
-    WHISPER_ASSERT(cache.buf.size() >= 2*n_elements*ggml_type_size(wtype));
+    return true;
+}
 
-    struct ggml_init_params params;
-    params.mem_size   = cache.buf.size();
-    params.mem_buffer = cache.buf.data();
+// the pool has room for the tables of n_decoders full decoders, the tables are cleared when it has to grow
+static bool kv_pool_reserve(const struct whisper_context & wctx, struct whisper_state & wstate, int n_decoders) {
+    const auto & hparams = wctx.model.hparams;
 
-    cache.ctx = ggml_init(params);
+    const int n_blocks = n_decoders*((hparams.n_text_ctx + WHISPER_KV_BLOCK - 1)/WHISPER_KV_BLOCK);
 
-    if (!cache.ctx) {
-        fprintf(stderr, "%s: failed to allocate memory for kv cache\n", __func__);
-        return false;
+    if ((int) wstate.kv_self.refs.size() >= n_blocks) {
+        return true;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+        wstate.decoders[j].kv_self.blocks.clear();
+        wstate.decoders[j].kv_self.n = 0;
+    }
+
+    kv_cache_free(wstate.kv_self.cache);
+
+    const size_t scale = wctx.itype == GGML_TYPE_F16 ? 1 : 2;
+
+    return kv_pool_init(hparams, n_decoders*scale*MEM_REQ_KV_SELF.at(wctx.model.type), wstate.kv_self, wctx.itype, n_blocks);
+}
+
+// a free block, the first one from hint on
+static int kv_pool_alloc(struct whisper_kv_pool & pool, int hint) {
+    const int n_blocks = pool.refs.size();
+
+    for (int i = 0; i < n_blocks; ++i) {
+        const int b = (hint + i) % n_blocks;
+        if (pool.refs[b] == 0) {
+            pool.refs[b] = 1;
+            return b;
+        }
+    }
+
+    return -1;
+}
+
+static int kv_table_row(const struct whisper_kv_table & table, int i) {
+    return table.blocks[i/WHISPER_KV_BLOCK]*WHISPER_KV_BLOCK + i%WHISPER_KV_BLOCK;
+}
+
+static void kv_table_release(struct whisper_kv_pool & pool, struct whisper_kv_table & table) {
+    for (const int b : table.blocks) {
+        --pool.refs[b];
+    }
+
+    table.blocks.clear();
+    table.n = 0;
+}
+
+// dst shares the blocks of src
+static void kv_table_copy(struct whisper_kv_pool & pool, struct whisper_kv_table & dst, const struct whisper_kv_table & src) {
+    if (&dst == &src) {
+        return;
+    }
+
+    for (const int b : src.blocks) {
+        ++pool.refs[b];
+    }
+
+    kv_table_release(pool, dst);
+
+    dst = src;
+}
+
+// prepare the table for writing the tokens [n_past, n_past + n_tokens): the blocks after them are dropped, the
+// missing ones allocated and the ones shared with other tables copied (only their rows before n_past)
+static bool kv_table_prepare(
+        struct whisper_kv_pool & pool,
+       struct whisper_kv_table & table,
+                           int   n_past,
+                           int   n_tokens,
+                           int   n_layer,
+                           int   n_state) {
+    const int n_used = (n_past + n_tokens + WHISPER_KV_BLOCK - 1)/WHISPER_KV_BLOCK;
+
+    while ((int) table.blocks.size() > n_used) {
+        --pool.refs[table.blocks.back()];
+        table.blocks.pop_back();
+    }
+
+    for (int ib = std::min(n_past/WHISPER_KV_BLOCK, (int) table.blocks.size()); ib < n_used; ++ib) {
+        if (ib < (int) table.blocks.size() && pool.refs[table.blocks[ib]] == 1) {
+            continue;
+        }
+
+        const int b = kv_pool_alloc(pool, ib > 0 ? table.blocks[ib - 1] + 1 : 0);
+        if (b < 0) {
+            return false;
+        }
+
+        if (ib == (int) table.blocks.size()) {
+            table.blocks.push_back(b);
+            continue;
+        }
+
+        // copy-on-write
+        const int b_src  = table.blocks[ib];
+        const int n_copy = n_past - ib*WHISPER_KV_BLOCK;
+
+        if (n_copy > 0) {
+            const size_t row_size = ggml_element_size(pool.cache.k)*n_state;
+
+            for (int il = 0; il < n_layer; ++il) {
+                const size_t offs_src = row_size*(il*pool.n_rows + b_src*WHISPER_KV_BLOCK);
+                const size_t offs_dst = row_size*(il*pool.n_rows + b    *WHISPER_KV_BLOCK);
+
+                memcpy((char *) pool.cache.k->data + offs_dst, (const char *) pool.cache.k->data + offs_src, n_copy*row_size);
+                memcpy((char *) pool.cache.v->data + offs_dst, (const char *) pool.cache.v->data + offs_src, n_copy*row_size);
+            }
+        }
+
+        --pool.refs[b_src];
+        table.blocks[ib] = b;
+    }
 
     return true;
 }
 
-static void kv_cache_free(struct whisper_kv_cache & cache) {
-    if (cache.ctx) {
-        ggml_free(cache.ctx);
-        cache.ctx = nullptr;
+// a model file mapped into memory, read by the loader like a file
+//
+// the data of a tensor is used in place when its offset in the file is aligned for its type, the read-only pages are
+// then shared with every process that maps the same file; other tensors are copied into the model buffer
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    size_t pos = 0; // read position of the loader
+};
+
+static whisper_mmap * whisper_mmap_open(const char * path, int flags) {
+#if defined(_WIN32)
+    (void) flags; // the pages are read on first use
+
+    HANDLE hfile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return nullptr;
     }
+
+    LARGE_INTEGER size;
+    HANDLE hmap = GetFileSizeEx(hfile, &size) ? CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    CloseHandle(hfile);
+    if (hmap == NULL) {
+        return nullptr;
+    }
+
+    void * addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmap); // the view keeps the mapping
+    if (addr == NULL) {
+        return nullptr;
+    }
+
+    whisper_mmap * mapping = new whisper_mmap;
+    mapping->addr = addr;
+    mapping->size = size.QuadPart;
+
+    return mapping;
+#elif defined(__unix__) || defined(__APPLE__)
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    int mflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (flags & WHISPER_MMAP_POPULATE) {
+        mflags |= MAP_POPULATE;
+    }
+#endif
+
+    void * addr = mmap(NULL, st.st_size, PROT_READ, mflags, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    if (flags & WHISPER_MMAP_WILLNEED) {
+        if (madvise(addr, st.st_size, MADV_WILLNEED) != 0) {
+            fprintf(stderr, "%s: warning: madvise(MADV_WILLNEED) failed\n", __func__);
+        }
+    }
+
+    whisper_mmap * mapping = new whisper_mmap;
+    mapping->addr = addr;
+    mapping->size = st.st_size;
+
+    return mapping;
+#else
+    (void) path;
+    (void) flags;
+
+    return nullptr;
+#endif
+}
+
+static void whisper_mmap_close(whisper_mmap * mapping) {
+    if (mapping == nullptr) {
+        return;
+    }
+
+#if defined(_WIN32)
+    UnmapViewOfFile(mapping->addr);
+#elif defined(__unix__) || defined(__APPLE__)
+    munmap(mapping->addr, mapping->size);
+#endif
+
+    delete mapping;
+}
+
+// the data of a tensor can be used in place when it is aligned for its elements (or the floats of its blocks)
+static bool whisper_mmap_aligned(size_t offset, ggml_type type) {
+    return offset % (type == GGML_TYPE_F16 ? sizeof(ggml_fp16_t) : sizeof(float)) == 0;
+}
+
+// the type of the weights in the model file: the ftype of the hparams for the 2d weights
+// (the conv weights are FP16 in a quantized model) and the ftype of each tensor
+//
+//   0 - FP32, 1 - FP16, 2 - Q4_0, 3 - Q8_0
+//
+// GGML_TYPE_COUNT for an unknown value
+static ggml_type whisper_ftype_to_ggml_type(int32_t ftype) {
+    switch (ftype) {
+        case 0: return GGML_TYPE_F32;
+        case 1: return GGML_TYPE_F16;
+        case 2: return GGML_TYPE_Q4_0;
+        case 3: return GGML_TYPE_Q8_0;
+    }
+
+    return GGML_TYPE_COUNT;
+}
+
+// bytes of the tensors of a mapped file, from the read position on, that cannot be used in place
+// each is copied to a 16 byte boundary of the model buffer
+static size_t whisper_mmap_copy_size(const whisper_mmap & mapping, bool aligned) {
+    const uint8_t * data = (const uint8_t *) mapping.addr;
+
+    size_t size = 0;
+    size_t pos  = mapping.pos;
+
+    while (pos + 3*sizeof(int32_t) <= mapping.size) {
+        int32_t header[3]; // n_dims, length, ftype
+        memcpy(header, data + pos, sizeof(header));
+        pos += sizeof(header);
+
+        const ggml_type type = whisper_ftype_to_ggml_type(header[2]);
+
+        // the loader reports the broken headers
+        if (header[0] < 1 || header[0] > 3 || header[1] < 0 || type == GGML_TYPE_COUNT ||
+            pos + header[0]*sizeof(int32_t) > mapping.size) {
+            break;
+        }
+
+        size_t nelements = 1;
+        for (int i = 0; i < header[0]; ++i) {
+            int32_t ne;
+            memcpy(&ne, data + pos, sizeof(ne));
+            pos += sizeof(ne);
+            nelements *= ne;
+        }
+
+        pos += header[1];
+
+        if (aligned) {
+            int32_t n_pad;
+            if (pos + sizeof(n_pad) > mapping.size) {
+                break;
+            }
+            memcpy(&n_pad, data + pos, sizeof(n_pad));
+            if (n_pad < 0 || n_pad >= 32) {
+                break;
+            }
+            pos += sizeof(n_pad) + n_pad;
+        }
+
+        const size_t nbytes = (nelements*ggml_type_size(type))/ggml_blck_size(type);
+        if (!whisper_mmap_aligned(pos, type)) {
+            size += nbytes + 16;
+        }
+
+        pos += nbytes;
+    }
+
+    return size;
 }
 
 // load the model from a ggml file
 //
 // file format:
 //
+//   - magic
 //   - hparams
 //   - pre-computed mel filters
 //   - vocab
 //   - weights
 //
+// every tensor of the weights is a header (n_dims, name length, ftype, dims, name) followed by its data. with
+// WHISPER_FILE_MAGIC_ALIGNED the header ends with the number of zeros written after it, so that the data starts at
+// a multiple of 32 bytes in the file and whisper_init_from_file_mmap() can use it in place. loaders that only
+// know WHISPER_FILE_MAGIC reject these files at the magic
+//
 // see the convert-pt-to-ggml.py script for details
 //
 static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
@@ -610,14 +938,18 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     auto & model = wctx.model;
     auto & vocab = wctx.vocab;
 
+    bool aligned = false;
+
     // verify magic
     {
         uint32_t magic;
         read_safe(loader, magic);
-        if (magic != 0x67676d6c) {
+        if (magic != WHISPER_FILE_MAGIC && magic != WHISPER_FILE_MAGIC_ALIGNED) {
             fprintf(stderr, "%s: invalid model data (bad magic)\n", __func__);
             return false;
         }
+
+        aligned = magic == WHISPER_FILE_MAGIC_ALIGNED;
     }
 
     //load hparams
@@ -634,7 +966,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         read_safe(loader, hparams.n_text_head);
         read_safe(loader, hparams.n_text_layer);
         read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.f16);
+        read_safe(loader, hparams.ftype);
 
         assert(hparams.n_text_state == hparams.n_audio_state);
 
@@ -658,11 +990,17 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             model.type = e_model::MODEL_LARGE;
         }
 
-        // for the big tensors, we have the option to store the data in 16-bit floats
+        // for the big tensors, we have the option to store the data in 16-bit floats or quantized
         // in order to save memory and also to speed up the computation
-        wctx.wtype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        wctx.wtype = whisper_ftype_to_ggml_type(model.hparams.ftype);
+        if (wctx.wtype == GGML_TYPE_COUNT) {
+            fprintf(stderr, "%s: invalid model data (bad ftype value %d)\n", __func__, model.hparams.ftype);
+            return false;
+        }
 
-        const size_t scale = model.hparams.f16 ? 1 : 2;
+        wctx.itype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
+
+        const size_t scale = wctx.itype == GGML_TYPE_F16 ? 1 : 2;
 
         fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
         fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
@@ -674,54 +1012,30 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         fprintf(stderr, "%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
         fprintf(stderr, "%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
         fprintf(stderr, "%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        fprintf(stderr, "%s: f16           = %d\n", __func__, hparams.f16);
+        fprintf(stderr, "%s: ftype         = %d (%s)\n", __func__, hparams.ftype, ggml_type_name(wctx.wtype));
         fprintf(stderr, "%s: type          = %d\n", __func__, model.type);
 
         // print memory requirements
         {
-            // this is the total memory required to run the inference
+            // this is the memory required by the model, shared by all states
             const size_t mem_required =
-                scale*MEM_REQ_MODEL.at       (model.type) +
-                scale*MEM_REQ_KV_CROSS.at    (model.type) +
-                scale*std::max(MEM_REQ_ENCODE.at(model.type),       MEM_REQ_DECODE.at(model.type)) +
-                scale*std::max(MEM_REQ_ENCODE_LAYER.at(model.type), MEM_REQ_DECODE_LAYER.at(model.type));
+                scale*MEM_REQ_MODEL.at(model.type);
+
+            // this is the memory required by one state with one decoder, without the compute buffers that are
+            // measured when the state is made
+            const size_t mem_required_state =
+                scale*MEM_REQ_KV_CROSS.at(model.type) +
+                2*whisper_graph_meta_size();
 
             // this is the memory required by one decoder
             const size_t mem_required_decoder =
                 scale*MEM_REQ_KV_SELF.at(model.type);
 
-            fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per decoder)\n", __func__,
-                    mem_required / 1024.0 / 1024.0, mem_required_decoder / 1024.0 / 1024.0);
+            fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per state, + %7.2f MB per decoder)\n", __func__,
+                    mem_required / 1024.0 / 1024.0, mem_required_state / 1024.0 / 1024.0, mem_required_decoder / 1024.0 / 1024.0);
         }
 
-        // initialize all memory buffers
-        // always have at least one decoder
-
         wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(model.type));
-
-        if (!kv_cache_init(model.hparams, scale*MEM_REQ_KV_SELF.at(model.type), wctx.decoders[0].kv_self, wctx.wtype, model.hparams.n_text_ctx)) {
-            fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
-            return false;
-        }
-
-        {
-            const size_t memory_size = ggml_nbytes(wctx.decoders[0].kv_self.k) + ggml_nbytes(wctx.decoders[0].kv_self.v);
-            fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size/1024.0/1024.0);
-        }
-
-        if (!kv_cache_init(model.hparams, scale*MEM_REQ_KV_CROSS.at(model.type), wctx.kv_cross, wctx.wtype, model.hparams.n_audio_ctx)) {
-            fprintf(stderr, "%s: kv_cache_init() failed for cross-attention cache\n", __func__);
-            return false;
-        }
-
-        {
-            const size_t memory_size = ggml_nbytes(wctx.kv_cross.k) + ggml_nbytes(wctx.kv_cross.v);
-            fprintf(stderr, "%s: kv cross size = %7.2f MB\n", __func__, memory_size/1024.0/1024.0);
-        }
-
-        wctx.buf_compute.resize      (scale*std::max(MEM_REQ_ENCODE.at(model.type),       MEM_REQ_DECODE.at(model.type)));
-        wctx.buf_compute_layer.resize(scale*std::max(MEM_REQ_ENCODE_LAYER.at(model.type), MEM_REQ_DECODE_LAYER.at(model.type)));
     }
 
     // load mel filters
@@ -803,22 +1117,13 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 vocab.id_to_token[i] = word;
             }
         }
-
-        wctx.logits.reserve(vocab.n_vocab*model.hparams.n_text_ctx);
-
-        wctx.logits_id.reserve(n_vocab);
-
-        // TAGS: WHISPER_DECODER_INIT
-        wctx.decoders[0].sequence.tokens.reserve(model.hparams.n_text_ctx);
-
-        wctx.decoders[0].probs.reserve   (vocab.n_vocab);
-        wctx.decoders[0].logits.reserve  (vocab.n_vocab);
-        wctx.decoders[0].logprobs.reserve(vocab.n_vocab);
     }
 
     size_t ctx_size = 0;
+    size_t ctx_mem  = 0; // bytes of the model buffer given to the context, all of it when 0
 
     const ggml_type wtype = wctx.wtype;
+    const ggml_type vtype = wctx.itype; // conv weights
 
     {
         const auto & hparams = model.hparams;
@@ -839,10 +1144,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         {
             ctx_size += n_audio_ctx*n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_pe;
 
-            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(wtype);         // e_conv_1_w
+            ctx_size += 3*n_mels*n_audio_state*ggml_type_sizef(vtype);        // e_conv_1_w
             ctx_size +=          n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_1_b
 
-            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(wtype);         // e_conv_2_w
+            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_sizef(vtype);        // e_conv_2_w
             ctx_size +=                 n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_2_b
 
             ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_w;
@@ -853,7 +1158,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         {
             ctx_size += n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F32); // d_pe;
 
-            ctx_size += n_vocab*n_text_state*ggml_type_size(wtype); // d_te;
+            ctx_size += n_vocab*n_text_state*ggml_type_sizef(wtype); // d_te;
 
             ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_w;
             ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_b;
@@ -864,24 +1169,24 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_0_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_0_w
             ctx_size += n_audio_layer*(              4*n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_1_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_1_w
             ctx_size += n_audio_layer*(                n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_q_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_q_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype)); // attn_k_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype)); // attn_k_w
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_v_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_v_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_ln_1_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_ln_1_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
         }
 
@@ -890,51 +1195,64 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_0_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_0_w
             ctx_size += n_text_layer*(             4*n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_1_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_1_w
             ctx_size += n_text_layer*(               n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
                                                                                                 //
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // cross_attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // cross_attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_1_b
         }
 
         ctx_size += (15 + 15*n_audio_layer + 24*n_text_layer)*256; // object overhead
 
         fprintf(stderr, "%s: model ctx     = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
+
+        if (model.mapping) {
+            // the context only holds the tensors, followed by the weights that cannot be used in place
+            ctx_mem = (15 + 15*n_audio_layer + 24*n_text_layer)*256;
+
+            wctx.model.buf->resize(ctx_mem + whisper_mmap_copy_size(*model.mapping, aligned));
+        } else if (ggml_blck_size(wtype) == 1) {
+            // the table is for FP16 weights (twice that in FP32), the quantized ones need a fraction of it
+            wctx.model.buf->resize((wtype == GGML_TYPE_F16 ? 1 : 2)*MEM_REQ_MODEL.at(model.type));
+        } else {
+            wctx.model.buf->resize(ctx_size);
+        }
     }
 
     // create the ggml context
     {
         struct ggml_init_params params;
-        params.mem_size   = wctx.model.buf->size();
+        params.mem_size   = ctx_mem ? ctx_mem : wctx.model.buf->size();
         params.mem_buffer = wctx.model.buf->data();
+        params.no_alloc   = model.mapping != nullptr;
 
         model.ctx = ggml_init(params);
         if (!model.ctx) {
@@ -968,10 +1286,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         {
             model.e_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx);
 
-            model.e_conv_1_w = ggml_new_tensor_3d(ctx, wtype,         3, n_mels, n_audio_state);
+            model.e_conv_1_w = ggml_new_tensor_3d(ctx, vtype,         3, n_mels, n_audio_state);
             model.e_conv_1_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
-            model.e_conv_2_w = ggml_new_tensor_3d(ctx, wtype,         3, n_audio_state, n_audio_state);
+            model.e_conv_2_w = ggml_new_tensor_3d(ctx, vtype,         3, n_audio_state, n_audio_state);
             model.e_conv_2_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
             model.e_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
@@ -1143,6 +1461,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         size_t total_size = 0;
 
+        // mapped file: the weights used in place and the ones copied after the context
+        size_t mapped_size = 0;
+        size_t copied_size = 0;
+
         model.n_loaded = 0;
 
         while (true) {
@@ -1170,6 +1492,18 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
             name.assign(&tmp[0], tmp.size());
 
+            if (aligned) {
+                int32_t n_pad;
+                read_safe(loader, n_pad);
+                if (n_pad < 0 || n_pad >= 32) {
+                    fprintf(stderr, "%s: tensor '%s' has bad padding in model file: %d\n", __func__, name.data(), n_pad);
+                    return false;
+                }
+
+                char pad[32];
+                loader->read(loader->context, pad, n_pad);
+            }
+
             if (model.tensors.find(name) == model.tensors.end()) {
                 fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -1187,23 +1521,64 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+            const ggml_type type = whisper_ftype_to_ggml_type(ftype);
 
-            if (nelements*bpe != ggml_nbytes(tensor)) {
+            if (type != tensor->type) {
+                fprintf(stderr, "%s: tensor '%s' has wrong type in model file: got %d, expected %s\n",
+                        __func__, name.data(), ftype, ggml_type_name(tensor->type));
+                return false;
+            }
+
+            const size_t bpe = ggml_type_size(type);
+
+            if ((nelements*bpe)/ggml_blck_size(type) != ggml_nbytes(tensor)) {
                 fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                        __func__, name.data(), ggml_nbytes(tensor), (nelements*bpe)/ggml_blck_size(type));
                 return false;
             }
 
-            loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+            if (model.mapping) {
+                auto & mapping = *model.mapping;
+
+                const size_t nbytes = ggml_nbytes(tensor);
+                if (mapping.pos + nbytes > mapping.size) {
+                    fprintf(stderr, "%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                uint8_t * src = (uint8_t *) mapping.addr + mapping.pos;
+
+                if (whisper_mmap_aligned(mapping.pos, type)) {
+                    tensor->data = src;
+                    mapped_size += nbytes;
+                } else {
+                    uint8_t * dst = model.buf->data() + ctx_mem + copied_size;
+                    dst += (16 - ((uintptr_t) dst) % 16) % 16;
+
+                    WHISPER_ASSERT(dst + nbytes <= model.buf->data() + model.buf->size());
+
+                    memcpy(dst, src, nbytes);
+                    tensor->data = dst;
+                    copied_size = (dst + nbytes) - (model.buf->data() + ctx_mem);
+                }
+
+                mapping.pos += nbytes;
+            } else {
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+            }
 
-            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
+            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name(type), ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
             model.n_loaded++;
         }
 
         fprintf(stderr, "%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
 
+        if (model.mapping) {
+            fprintf(stderr, "%s: mapped        = %7.2f MB in place, %7.2f MB copied\n", __func__,
+                    mapped_size/1024.0/1024.0, copied_size/1024.0/1024.0);
+        }
+
         if (model.n_loaded == 0) {
             fprintf(stderr, "%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
@@ -1212,84 +1587,109 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
-    wctx.rng = std::mt19937(0);
-
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
     return true;
 }
 
-// evaluate the encoder
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode(
-        whisper_context & wctx,
-              const int   mel_offset,
-              const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+// the thread pool of the state's graphs, started on first use and again when n_threads changes
+static struct ggml_threadpool * whisper_threadpool(whisper_state & wstate, int n_threads) {
+    if (wstate.threadpool && ggml_threadpool_n_threads(wstate.threadpool) != n_threads) {
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
 
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wctx.mel;
-    const auto & hparams = model.hparams;
+    if (wstate.threadpool == nullptr && n_threads > 1) {
+        wstate.threadpool = ggml_threadpool_new(n_threads, wstate.cpu_core_offset);
+    }
 
-    const int n_ctx   = wctx.exp_n_audio_ctx > 0 ? wctx.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    return wstate.threadpool;
+}
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+static void whisper_allocr_free(whisper_allocr & allocr) {
+    ggml_allocr_free(allocr.alloc);
+    ggml_allocr_free(allocr.measure);
+}
 
-    struct ggml_init_params params;
-    params.mem_size   = wctx.buf_compute.size();
-    params.mem_buffer = wctx.buf_compute.data();
+// grows the buffer to the largest size measured so far, the allocator is made again when the buffer moves
+static void whisper_allocr_fit(whisper_allocr & allocr) {
+    const size_t size = ggml_allocr_max_size(allocr.measure);
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    if (allocr.alloc != nullptr && size <= allocr.data.size()) {
+        return;
+    }
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
+    ggml_allocr_free(allocr.alloc);
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    allocr.data.resize(std::max(size, allocr.data.size()));
+    allocr.alloc = ggml_allocr_new(allocr.data.data(), allocr.data.size());
+}
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
+// sizes the compute buffers of the state with a dry run of the graphs: build gets the allocators for the tensors
+// of ctx0 and of the per-layer contexts, they only measure and nothing is computed
+template <typename F>
+static void whisper_allocr_reserve(whisper_state & wstate, F && build) {
+    for (auto * allocr : { &wstate.alloc, &wstate.alloc_layer }) {
+        if (allocr->measure == nullptr) {
+            allocr->measure = ggml_allocr_new_measure();
         }
     }
 
-    struct ggml_tensor * cur;
-
-    // convolution + gelu
-    {
-        cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
-        cur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    model.e_conv_1_b,
-                    cur),
-                cur);
+    build(wstate.alloc.measure, wstate.alloc_layer.measure);
 
-        cur = ggml_gelu(ctx0, cur);
+    whisper_allocr_fit(wstate.alloc);
+    whisper_allocr_fit(wstate.alloc_layer);
+}
 
-        cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
-        cur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    model.e_conv_2_b,
-                    cur),
-                cur);
+// places the tensors of the graph and computes it, a dry run only places them
+static void whisper_graph_compute(struct ggml_allocr * alloc, struct ggml_context * ctx, struct ggml_cgraph * gf) {
+    ggml_allocr_alloc_graph(alloc, gf);
 
-        cur = ggml_gelu(ctx0, cur);
+    if (!ggml_allocr_is_measure(alloc)) {
+        ggml_graph_compute(ctx, gf);
     }
+}
+
+// the graphs of the encoder, the tensors are placed by alloc for ctx0 and by alloc_layer for the per-layer contexts,
+// the graphs are computed unless the allocators measure
+static void whisper_encode_graphs(
+                         whisper_context & wctx,
+        const std::vector<whisper_state *> & wstates,
+                                 const int   mel_offset,
+                                 const int   n_threads,
+                        struct ggml_allocr * alloc,
+                        struct ggml_allocr * alloc_layer) {
+    const int n_batch = wstates.size();
+
+    // the buffers and workers of the first state are used for the whole batch
+    whisper_state & wstate = *wstates[0];
+
+    struct ggml_threadpool * threadpool = whisper_threadpool(wstate, n_threads);
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_mels = hparams.n_mels;
+
+    const bool measure = ggml_allocr_is_measure(alloc);
+
+    ggml_allocr_reset(alloc);
+
+    struct ggml_init_params params;
+    params.mem_size   = wstate.buf_compute.size();
+    params.mem_buffer = wstate.buf_compute.data();
+    params.no_alloc   = true;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    // the windows are the columns [b*n_ctx, (b + 1)*n_ctx) of the input
+    struct ggml_tensor * inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch*n_ctx);
+    ggml_allocr_alloc(alloc, inpL);
 
     // ===================================================================
     // NOTE: experimenting with partial evaluation of the encoder (ignore)
@@ -1309,14 +1709,66 @@ static bool whisper_encode(
     const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
     struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-
-    cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
     // ===================================================================
 
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+    struct ggml_tensor * cur;
 
-    struct ggml_tensor * inpL = cur;
+    // the front-end of each window, the result is copied into its columns of the input
+    struct ggml_cgraph gf0 = {};
+    gf0.n_threads = n_threads;
+    gf0.threadpool = threadpool;
+
+    for (int b = 0; b < n_batch; ++b) {
+        const auto & mel_inp = wstates[b]->mel;
+
+        struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        ggml_allocr_alloc(alloc, mel);
+
+        assert(mel->type == GGML_TYPE_F32);
+        if (!measure) {
+            float * dst = (float *) mel->data;
+            memset(dst, 0, ggml_nbytes(mel));
+
+            const int i0 = std::min(mel_offset, mel_inp.n_len);
+            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+            for (int j = 0; j < mel_inp.n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+                }
+            }
+        }
+
+        // convolution + gelu
+        {
+            cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        model.e_conv_1_b,
+                        cur),
+                    cur);
+
+            cur = ggml_gelu(ctx0, cur);
+
+            cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        model.e_conv_2_b,
+                        cur),
+                    cur);
+
+            cur = ggml_gelu(ctx0, cur);
+        }
+
+        cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+
+        // original:
+        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+        ggml_build_forward_expand(&gf0, ggml_cpy(ctx0, cur, ggml_view_1d(ctx0, inpL, n_state*n_ctx, b*n_ctx*n_state*sizeof(float))));
+    }
+
+    whisper_graph_compute(alloc, ctx0, &gf0);
 
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_encoder[il];
@@ -1324,10 +1776,16 @@ static bool whisper_encode(
         // create separate context for each layer to reduce memory usage
 
         struct ggml_init_params paramsL;
-        paramsL.mem_size   = wctx.buf_compute_layer.size();
-        paramsL.mem_buffer = wctx.buf_compute_layer.data();
+        paramsL.mem_size   = wstate.buf_compute_layer.size();
+        paramsL.mem_buffer = wstate.buf_compute_layer.data();
+        paramsL.no_alloc   = true;
+
+        ggml_allocr_reset(alloc_layer);
 
         struct ggml_context * ctxL = ggml_init(paramsL);
+        struct ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
+        gf.threadpool = threadpool;
 
         // norm
         {
@@ -1372,87 +1830,100 @@ static bool whisper_encode(
                         Vcur),
                     Vcur);
 
-            // ------
+            // the attention of each window, the result is stored in its columns
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, n_batch*n_ctx);
 
-#ifdef WHISPER_USE_FLASH_ATTN
-            struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Qcur,
-                            ggml_new_tensor_3d(ctxL, wctx.wtype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
+            for (int b = 0; b < n_batch; ++b) {
+                const size_t offs = b*n_ctx*n_state*sizeof(float);
 
-            struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Kcur,
-                            ggml_new_tensor_3d(ctxL, wctx.wtype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
+                struct ggml_tensor * Qcur_b = ggml_view_1d(ctxL, Qcur, n_state*n_ctx, offs);
+                struct ggml_tensor * Kcur_b = ggml_view_1d(ctxL, Kcur, n_state*n_ctx, offs);
+                struct ggml_tensor * Vcur_b = ggml_view_1d(ctxL, Vcur, n_state*n_ctx, offs);
 
-            struct ggml_tensor * V =
-                ggml_cpy(ctxL,
-                        ggml_permute(ctxL,
-                            ggml_reshape_3d(ctxL,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
-                            1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctxL, wctx.wtype, n_ctx, n_state/n_head, n_head)
-                        );
+                // ------
 
-            struct ggml_tensor * KQV = ggml_flash_attn(ctxL, Q, K, V, false);
+#ifdef WHISPER_USE_FLASH_ATTN
+                struct ggml_tensor * Q =
+                    ggml_permute(ctxL,
+                            ggml_cpy(ctxL,
+                                Qcur_b,
+                                ggml_new_tensor_3d(ctxL, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctxL,
+                            ggml_cpy(ctxL,
+                                Kcur_b,
+                                ggml_new_tensor_3d(ctxL, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * V =
+                    ggml_cpy(ctxL,
+                            ggml_permute(ctxL,
+                                ggml_reshape_3d(ctxL,
+                                    Vcur_b,
+                                    n_state/n_head, n_head, n_ctx),
+                                1, 2, 0, 3),
+                            ggml_new_tensor_3d(ctxL, wctx.itype, n_ctx, n_state/n_head, n_head)
+                            );
+
+                struct ggml_tensor * KQV = ggml_flash_attn(ctxL, Q, K, V, false);
 #else
-            struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
-
-            struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Kcur,
-                            ggml_new_tensor_3d(ctxL, wctx.wtype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
-
-            struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctxL,
-                        KQ,
-                        ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
-                        );
-
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_scaled);
-
-            //struct ggml_tensor * V_trans =
-            //    ggml_permute(ctxL,
-            //            ggml_cpy(ctxL,
-            //                Vcur,
-            //                ggml_new_tensor_3d(ctxL, wctx.wtype, n_state/n_head, n_head, n_ctx)),
-            //            1, 2, 0, 3);
-
-            //struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
-
-            struct ggml_tensor * V =
-                ggml_cpy(ctxL,
-                        ggml_permute(ctxL,
-                            ggml_reshape_3d(ctxL,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
-                            0, 2, 1, 3),
-                        ggml_new_tensor_3d(ctxL, wctx.wtype, n_state/n_head, n_ctx, n_head)
-                        );
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, ggml_transpose(ctxL, V), KQ_soft_max);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctxL,
+                            ggml_cpy(ctxL,
+                                Qcur_b,
+                                ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctxL,
+                            ggml_cpy(ctxL,
+                                Kcur_b,
+                                ggml_new_tensor_3d(ctxL, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+
+                struct ggml_tensor * KQ_scaled =
+                    ggml_scale(ctxL,
+                            KQ,
+                            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+                            );
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_scaled);
+
+                //struct ggml_tensor * V_trans =
+                //    ggml_permute(ctxL,
+                //            ggml_cpy(ctxL,
+                //                Vcur,
+                //                ggml_new_tensor_3d(ctxL, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                //            1, 2, 0, 3);
+
+                //struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+
+                struct ggml_tensor * V =
+                    ggml_cpy(ctxL,
+                            ggml_permute(ctxL,
+                                ggml_reshape_3d(ctxL,
+                                    Vcur_b,
+                                    n_state/n_head, n_head, n_ctx),
+                                0, 2, 1, 3),
+                            ggml_new_tensor_3d(ctxL, wctx.itype, n_state/n_head, n_ctx, n_head)
+                            );
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctxL, ggml_transpose(ctxL, V), KQ_soft_max);
 #endif
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
 
-            cur = ggml_cpy(ctxL,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, n_ctx));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctxL,
+                            KQV_merged,
+                            ggml_view_1d(ctxL, KQV_all, n_state*n_ctx, offs)));
+            }
+
+            cur = KQV_all;
         }
 
         // projection
@@ -1487,7 +1958,7 @@ static bool whisper_encode(
 
 #ifdef WHISPER_USE_FLASH_FF
             cur = ggml_flash_ff(ctxL,
-                    ggml_cpy(ctxL, cur, ggml_new_tensor_2d(ctxL, wctx.wtype, n_state, N)),
+                    ggml_cpy(ctxL, cur, ggml_new_tensor_2d(ctxL, wctx.itype, n_state, n_batch*n_ctx)),
                     layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
             // fully connected
@@ -1517,18 +1988,17 @@ static bool whisper_encode(
         struct ggml_tensor * inpO = ggml_add(ctxL, cur, inpFF);
 
         {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
             ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
+            whisper_graph_compute(alloc_layer, ctxL, &gf);
 
             //ggml_graph_print(&gf);
         }
 
         // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
         // input for next layer (inpO -> inpL)
-        memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
+        if (!measure) {
+            memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
+        }
         inpL->op = GGML_OP_NONE;
         inpL->src0 = nullptr;
         inpL->src1 = nullptr;
@@ -1556,9 +2026,10 @@ static bool whisper_encode(
     {
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
+        gf.threadpool = threadpool;
 
         ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
+        whisper_graph_compute(alloc, ctx0, &gf);
 
         //ggml_graph_print(&gf);
     }
@@ -1581,6 +2052,7 @@ static bool whisper_encode(
     {
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
+        gf.threadpool = threadpool;
 
         // TODO: hack to disconnect the encoded features from the previous graph
         cur->op = GGML_OP_NONE;
@@ -1606,16 +2078,24 @@ static bool whisper_encode(
                         Vcross),
                     Vcross);
 
-            //struct ggml_tensor * k = ggml_view_1d(ctx0, wctx.kv_cross.k, n_state*n_ctx, (ggml_element_size(wctx.kv_cross.k)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
-            //struct ggml_tensor * v = ggml_view_1d(ctx0, wctx.kv_cross.v, n_state*n_ctx, (ggml_element_size(wctx.kv_cross.v)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wctx.kv_cross.k, n_state*n_ctx, (ggml_element_size(wctx.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_1d(ctx0, wctx.kv_cross.v, n_state*n_ctx, (ggml_element_size(wctx.kv_cross.v)*n_state)*(il*n_ctx));
+            //struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
+            //struct ggml_tensor * v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
+
+            // each window goes to the cache of its state
+            for (int b = 0; b < n_batch; ++b) {
+                auto & kv_cross = wstates[b]->kv_cross;
+
+                const size_t offs = b*n_ctx*n_state*sizeof(float);
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx, (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
+                struct ggml_tensor * v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx, (ggml_element_size(kv_cross.v)*n_state)*(il*n_ctx));
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_1d(ctx0, Kcross, n_state*n_ctx, offs), k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_1d(ctx0, Vcross, n_state*n_ctx, offs), v));
+            }
         }
 
-        ggml_graph_compute(ctx0, &gf);
+        whisper_graph_compute(alloc, ctx0, &gf);
         //ggml_graph_print(&gf);
     }
 
@@ -1624,65 +2104,158 @@ static bool whisper_encode(
     //printf("%s: used_mem = %f MB\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0);
 
     ggml_free(ctx0);
+}
+
+// evaluate the encoder for the mel spectrograms of several states
+//
+// the windows are stacked along the time axis, so every weight matrix is read once for the whole batch; only the
+// convolutions and the self-attention are done per window. The encoded features of each window are stored in the
+// cross-attention KV cache of its state
+//
+//   - model:      the model
+//   - wstates:    the states, they must have the same audio context
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrograms (i.e. audio offset)
+//
+static bool whisper_encode_batch(
+                         whisper_context & wctx,
+        const std::vector<whisper_state *> & wstates,
+                                 const int   mel_offset,
+                                 const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int n_batch = wstates.size();
 
-    wctx.t_encode_us += ggml_time_us() - t_start_us;
-    wctx.n_encode++;
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_ctx = wstates[0]->exp_n_audio_ctx > 0 ? wstates[0]->exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    for (int b = 0; b < n_batch; ++b) {
+        const auto & wstate_b = *wstates[b];
+
+        const int n_ctx_b = wstate_b.exp_n_audio_ctx > 0 ? wstate_b.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+        if (n_ctx_b != n_ctx) {
+            fprintf(stderr, "%s: state %d has another audio context than state 0\n", __func__, b);
+            return false;
+        }
+
+        assert(wstate_b.mel.n_mel == hparams.n_mels);
+    }
+
+    // the compute buffers of the first state are sized for the batch and the audio context by a dry run
+    whisper_allocr_reserve(*wstates[0], [&](struct ggml_allocr * alloc, struct ggml_allocr * alloc_layer) {
+        whisper_encode_graphs(wctx, wstates, mel_offset, n_threads, alloc, alloc_layer);
+    });
+
+    whisper_encode_graphs(wctx, wstates, mel_offset, n_threads, wstates[0]->alloc.alloc, wstates[0]->alloc_layer.alloc);
+
+    // every state of the batch waited for all of it
+    for (int b = 0; b < n_batch; ++b) {
+        wstates[b]->t_encode_us += ggml_time_us() - t_start_us;
+        wstates[b]->n_encode++;
+    }
 
     return true;
 }
 
-// evaluate the decoder
+// evaluate the encoder
 //
-// given text prompt + audio features -> predicts the probabilities for the next token
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
 //
 //   - model:      the model
 //   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
 //
-static bool whisper_decode(
+static bool whisper_encode(
         whisper_context & wctx,
-        whisper_decoder & decoder,
-    const whisper_token * tokens,
-              const int   n_tokens,
-              const int   n_past,
+          whisper_state & wstate,
+              const int   mel_offset,
               const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+    return whisper_encode_batch(wctx, { &wstate }, mel_offset, n_threads);
+}
+
+// tokens evaluated by whisper_decode_batch(), they follow the first n_past tokens in the KV cache of the decoder
+struct whisper_batch_seq {
+    whisper_decoder * decoder;
+
+    const whisper_token * tokens;
+
+    int n_tokens;
+    int n_past;
+};
+
+// the rows of the sequences of whisper_decode_batch() in the batch and in the KV cache
+struct whisper_batch_layout {
+    // the tokens of sequence s are the rows [row0[s], row0[s] + n_tokens) of the batch
+    std::vector<int> row0;
+
+    // the tokens [0, n_past + n_tokens) of each sequence in runs of consecutive rows of the cache:
+    // { first token, number of tokens }, a single run is used in place, several are gathered for the attention
+    std::vector<std::vector<std::pair<int, int>>> kv_runs;
+
+    int N = 0;
+};
+
+// the graphs of the decoder, the tensors are placed by alloc for ctx0 and by alloc_layer for the per-layer contexts,
+// the graphs are computed unless the allocators measure
+static void whisper_decode_graphs(
+                       whisper_context & wctx,
+                         whisper_state & wstate,
+    const std::vector<whisper_batch_seq> & seqs,
+            const whisper_batch_layout & layout,
+                             const int   n_threads,
+                    struct ggml_allocr * alloc,
+                    struct ggml_allocr * alloc_layer) {
+    struct ggml_threadpool * threadpool = whisper_threadpool(wstate, n_threads);
 
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = decoder.kv_self;
+    auto & kv_pool = wstate.kv_self;
 
-    WHISPER_ASSERT(!!kv_self.ctx);
-
-    auto & logits_out = wctx.logits;
+    auto & logits_out = wstate.logits;
 
     const int n_vocab = hparams.n_vocab;
 
-    const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
-    const int M = wctx.exp_n_audio_ctx > 0 ? wctx.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_seq = seqs.size();
+    const int M     = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    const auto & row0    = layout.row0;
+    const auto & kv_runs = layout.kv_runs;
+
+    const int N = layout.N;
 
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+    const bool measure = ggml_allocr_is_measure(alloc);
+
+    ggml_allocr_reset(alloc);
+
+    const size_t kv_row_size = ggml_element_size(kv_pool.cache.k)*n_state;
 
     struct ggml_init_params params;
-    params.mem_size   = wctx.buf_compute.size();
-    params.mem_buffer = wctx.buf_compute.data();
+    params.mem_size   = wstate.buf_compute.size();
+    params.mem_buffer = wstate.buf_compute.data();
+    params.no_alloc   = true;
 
     struct ggml_context * ctx0 = ggml_init(params);
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
-
+    struct ggml_tensor * embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
+    ggml_allocr_alloc(alloc, embd);
+    ggml_allocr_alloc(alloc, position);
+
+    if (!measure) {
+        for (int s = 0; s < n_seq; ++s) {
+            for (int i = 0; i < seqs[s].n_tokens; ++i) {
+                ((int32_t *) embd->data)    [row0[s] + i] = seqs[s].tokens[i];
+                ((int32_t *) position->data)[row0[s] + i] = seqs[s].n_past + i;
+            }
+        }
     }
 
     // token encoding + position encoding
@@ -1691,18 +2264,24 @@ static bool whisper_decode(
                 ggml_get_rows(ctx0, model.d_te, embd),
                 ggml_get_rows(ctx0, model.d_pe, position));
 
+    // computed by the graph of the first layer, the output of every layer is copied into it
     struct ggml_tensor * inpL = cur;
+    ggml_allocr_alloc(alloc, inpL);
 
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_decoder[il];
 
         struct ggml_init_params paramsL;
-        paramsL.mem_size   = wctx.buf_compute_layer.size();
-        paramsL.mem_buffer = wctx.buf_compute_layer.data();
+        paramsL.mem_size   = wstate.buf_compute_layer.size();
+        paramsL.mem_buffer = wstate.buf_compute_layer.data();
+        paramsL.no_alloc   = true;
+
+        ggml_allocr_reset(alloc_layer);
 
         struct ggml_context * ctxL = ggml_init(paramsL);
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
+        gf.threadpool = threadpool;
 
         // norm
         {
@@ -1747,58 +2326,91 @@ static bool whisper_decode(
                         Vcur),
                     Vcur);
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * k = ggml_view_1d(ctxL, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctxL, kv_self.v, N*n_state, (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + n_past));
+            // the result of the self-attention of each sequence is stored in its rows
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N);
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctxL, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctxL, Vcur, v));
-            }
+            for (int s = 0; s < n_seq; ++s) {
+                const auto & kv_self = seqs[s].decoder->kv_self;
 
-            // ------
+                const int n_past = seqs[s].n_past;
+                const int n_cur  = seqs[s].n_tokens;
+                const int n_kv   = n_past + n_cur;
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                        0, 2, 1, 3);
+                const size_t offs_cur = row0[s]*n_state*sizeof(float);
 
-            struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_reshape_3d(ctxL,
-                            ggml_view_1d(ctxL, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
+                // store key and value to memory
+                for (const auto & run : kv_runs[s]) {
+                    const int i0 = std::max(run.first, n_past);
+                    const int i1 = run.first + run.second;
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+                    if (i0 >= i1) {
+                        continue;
+                    }
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctxL,
-            //            KQ,
-            //            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                    const size_t offs = kv_row_size*(il*kv_pool.n_rows + kv_table_row(kv_self, i0));
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctxL, KQ, n_past);
+                    struct ggml_tensor * k = ggml_view_1d(ctxL, kv_pool.cache.k, (i1 - i0)*n_state, offs);
+                    struct ggml_tensor * v = ggml_view_1d(ctxL, kv_pool.cache.v, (i1 - i0)*n_state, offs);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_masked);
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctxL, ggml_view_1d(ctxL, Kcur, (i1 - i0)*n_state, offs_cur + (i0 - n_past)*n_state*sizeof(float)), k));
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctxL, ggml_view_1d(ctxL, Vcur, (i1 - i0)*n_state, offs_cur + (i0 - n_past)*n_state*sizeof(float)), v));
+                }
 
-            struct ggml_tensor * V_trans =
-                ggml_permute(ctxL,
-                        ggml_reshape_3d(ctxL,
-                            ggml_view_1d(ctxL, kv_self.v, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.v)*n_state),
-                            n_state/n_head, n_head, n_past + N),
-                        1, 2, 0, 3);
+                // keys and values of the tokens [0, n_kv)
+                struct ggml_tensor * Kall = nullptr;
+                struct ggml_tensor * Vall = nullptr;
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+                if (kv_runs[s].size() == 1) {
+                    const size_t offs = kv_row_size*(il*kv_pool.n_rows + kv_table_row(kv_self, 0));
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+                    Kall = ggml_view_1d(ctxL, kv_pool.cache.k, n_kv*n_state, offs);
+                    Vall = ggml_view_1d(ctxL, kv_pool.cache.v, n_kv*n_state, offs);
+                } else {
+                    Kall = ggml_new_tensor_1d(ctxL, kv_pool.cache.k->type, n_kv*n_state);
+                    Vall = ggml_new_tensor_1d(ctxL, kv_pool.cache.v->type, n_kv*n_state);
+
+                    for (const auto & run : kv_runs[s]) {
+                        const size_t offs = kv_row_size*(il*kv_pool.n_rows + kv_table_row(kv_self, run.first));
+
+                        ggml_build_forward_expand(&gf, ggml_cpy(ctxL,
+                                    ggml_view_1d(ctxL, kv_pool.cache.k, run.second*n_state, offs),
+                                    ggml_view_1d(ctxL, Kall, run.second*n_state, kv_row_size*run.first)));
+                        ggml_build_forward_expand(&gf, ggml_cpy(ctxL,
+                                    ggml_view_1d(ctxL, kv_pool.cache.v, run.second*n_state, offs),
+                                    ggml_view_1d(ctxL, Vall, run.second*n_state, kv_row_size*run.first)));
+                    }
+                }
 
-            cur = ggml_cpy(ctxL,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N));
+                // ------
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctxL,
+                            ggml_reshape_3d(ctxL,
+                                ggml_view_1d(ctxL, Qcur, n_cur*n_state, offs_cur),
+                                n_state/n_head, n_head, n_cur),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctxL,
+                            ggml_reshape_3d(ctxL, Kall, n_state/n_head, n_head, n_kv),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * V =
+                    ggml_permute(ctxL,
+                            ggml_reshape_3d(ctxL, Vall, n_state/n_head, n_head, n_kv),
+                            0, 2, 1, 3);
+
+                // the tokens attend to the n_past tokens before them and to themselves
+                struct ggml_tensor * KQV = ggml_flash_attn_kv(ctxL, Q, K, V, true);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctxL,
+                            KQV_merged,
+                            ggml_view_1d(ctxL, KQV_all, n_cur*n_state, offs_cur)));
+            }
+
+            cur = KQV_all;
         }
 
         {
@@ -1843,42 +2455,26 @@ static bool whisper_decode(
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
                 ggml_reshape_3d(ctxL,
-                        ggml_view_1d(ctxL, wctx.kv_cross.k, M*n_state, il*M*ggml_element_size(wctx.kv_cross.k)*n_state),
+                        ggml_view_1d(ctxL, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
                         n_state/n_head, n_head, M);
 
             struct ggml_tensor * Vcross =
                 ggml_reshape_3d(ctxL,
-                        ggml_view_1d(ctxL, wctx.kv_cross.v, M*n_state, il*M*ggml_element_size(wctx.kv_cross.v)*n_state),
+                        ggml_view_1d(ctxL, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
                         n_state/n_head, n_head, M);
 
             // ------
 
             struct ggml_tensor * Q =
                 ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                        ggml_reshape_3d(ctxL, Qcur, n_state/n_head, n_head, N),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K = ggml_permute(ctxL, Kcross, 0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
-
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctxL,
-            //            KQ,
-            //            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+            struct ggml_tensor * V = ggml_permute(ctxL, Vcross, 0, 2, 1, 3);
 
             // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctxL, KQ_scaled, n_past);
-
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ);
-
-            struct ggml_tensor * V_trans = ggml_permute(ctxL, Vcross, 1, 2, 0, 3);
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_flash_attn_kv(ctxL, Q, K, V, false);
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
 
@@ -1945,14 +2541,16 @@ static bool whisper_decode(
 
         {
             ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
+            whisper_graph_compute(alloc_layer, ctxL, &gf);
 
             //ggml_graph_print(&gf);
         }
 
         // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
         // input for next layer (inpO -> inpL)
-        memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
+        if (!measure) {
+            memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
+        }
         inpL->op = GGML_OP_NONE;
         inpL->src0 = nullptr;
         inpL->src1 = nullptr;
@@ -1983,28 +2581,125 @@ static bool whisper_decode(
     {
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
+        gf.threadpool = threadpool;
+
+        ggml_build_forward_expand(&gf, logits);
+        whisper_graph_compute(alloc, ctx0, &gf);
+    }
+
+    if (!measure) {
+        logits_out.resize(N*n_vocab);
+        memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    }
+
+    if (N > 1) {
+        //const float mem_per_token = ggml_used_mem(ctx0)/1024.0/1024.0/N;
+        //printf("%s: used_mem = %f MB / %f per token\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0, mem_per_token);
+        //printf("%s: max mem = %f MB\n", __func__, mem_per_token*model.hparams.n_text_ctx);
+    }
+
+    ggml_free(ctx0);
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> predicts the probabilities for the next token
+//
+// the tokens of several decoders are evaluated together: the weights are read once for all of them and only the
+// self-attention is computed per sequence, against the KV cache of its decoder. The logits are stored in wstate.logits,
+// one row per token, in the order of the sequences
+//
+//   - model:      the model
+//   - wstate:     the state, the decoders of the sequences are in it
+//   - n_threads:  number of threads to use
+//   - seqs:       the tokens of each decoder, at most one sequence per decoder
+//
+static bool whisper_decode_batch(
+                       whisper_context & wctx,
+                         whisper_state & wstate,
+    const std::vector<whisper_batch_seq> & seqs,
+                             const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & hparams = wctx.model.hparams;
+
+    auto & kv_pool = wstate.kv_self;
+
+    WHISPER_ASSERT(!!kv_pool.cache.ctx);
+
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
+
+    const int n_seq = seqs.size();
+
+    whisper_batch_layout layout;
+    layout.row0.resize(n_seq);
+    layout.kv_runs.resize(n_seq);
+
+    for (int s = 0; s < n_seq; ++s) {
+        const auto & seq = seqs[s];
+
+        auto & kv_self = seq.decoder->kv_self;
+
+        const int n_kv = seq.n_past + seq.n_tokens;
+
+        //WHISPER_PRINT_DEBUG("%s: seq %d: n_past = %d, N = %d, n_ctx = %d\n", __func__, s, seq.n_past, seq.n_tokens, n_ctx);
+
+        if (n_kv > n_ctx) {
+            fprintf(stderr, "%s: too many tokens for the text context (%d > %d)\n", __func__, n_kv, n_ctx);
+            return false;
+        }
 
-        ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
-    }
+        if (!kv_table_prepare(kv_pool, kv_self, seq.n_past, seq.n_tokens, n_layer, n_state)) {
+            fprintf(stderr, "%s: the self-attention KV cache is full\n", __func__);
+            return false;
+        }
 
-    logits_out.resize(N*n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+        for (int i = 0; i < n_kv; ++i) {
+            auto & runs = layout.kv_runs[s];
+            if (!runs.empty() && kv_table_row(kv_self, i) == kv_table_row(kv_self, runs.back().first) + runs.back().second) {
+                ++runs.back().second;
+            } else {
+                runs.push_back({ i, 1 });
+            }
+        }
 
-    if (N > 1) {
-        //const float mem_per_token = ggml_used_mem(ctx0)/1024.0/1024.0/N;
-        //printf("%s: used_mem = %f MB / %f per token\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0, mem_per_token);
-        //printf("%s: max mem = %f MB\n", __func__, mem_per_token*model.hparams.n_text_ctx);
+        layout.row0[s] = layout.N;
+        layout.N += seq.n_tokens;
     }
 
-    ggml_free(ctx0);
+    // the compute buffers are sized for the batch and the lengths of the sequences by a dry run
+    whisper_allocr_reserve(wstate, [&](struct ggml_allocr * alloc, struct ggml_allocr * alloc_layer) {
+        whisper_decode_graphs(wctx, wstate, seqs, layout, n_threads, alloc, alloc_layer);
+    });
+
+    whisper_decode_graphs(wctx, wstate, seqs, layout, n_threads, wstate.alloc.alloc, wstate.alloc_layer.alloc);
 
-    wctx.t_decode_us += ggml_time_us() - t_start_us;
-    wctx.n_decode++;
+    wstate.t_decode_us += ggml_time_us() - t_start_us;
+    wstate.n_decode++;
 
     return true;
 }
 
+
+// evaluate the decoder for the tokens of a single decoder
+//
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode(
+        whisper_context & wctx,
+          whisper_state & wstate,
+        whisper_decoder & decoder,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads) {
+    return whisper_decode_batch(wctx, wstate, { { &decoder, tokens, n_tokens, n_past } }, n_threads);
+}
+
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
 static std::string to_timestamp(int64_t t, bool comma = false) {
@@ -2104,7 +2799,7 @@ static void fft(const std::vector<float> & in, std::vector<float> & out) {
 
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
 static bool log_mel_spectrogram(
-        whisper_context & wctx,
+          whisper_state & wstate,
             const float * samples,
               const int   n_samples,
               const int   /*sample_rate*/,
@@ -2224,7 +2919,7 @@ static bool log_mel_spectrogram(
         mel.data[i] = (mel.data[i] + 4.0)/4.0;
     }
 
-    wctx.t_mel_us += ggml_time_us() - t_start_us;
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
 
     return true;
 }
@@ -2298,7 +2993,68 @@ static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, cons
 // interface implementation
 //
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
+struct whisper_state * whisper_init_state(struct whisper_context * ctx) {
+    whisper_state * state = new whisper_state;
+
+    const auto & model = ctx->model;
+    const auto & vocab = ctx->vocab;
+
+    const size_t scale = ctx->itype == GGML_TYPE_F16 ? 1 : 2;
+
+    // room for one decoder, whisper_full() makes more when it needs them
+    if (!kv_pool_init(model.hparams, scale*MEM_REQ_KV_SELF.at(model.type), state->kv_self, ctx->itype,
+                (model.hparams.n_text_ctx + WHISPER_KV_BLOCK - 1)/WHISPER_KV_BLOCK)) {
+        fprintf(stderr, "%s: kv_pool_init() failed for self-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_self.cache.k) + ggml_nbytes(state->kv_self.cache.v);
+        fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size/1024.0/1024.0);
+    }
+
+    if (!kv_cache_init(model.hparams, scale*MEM_REQ_KV_CROSS.at(model.type), state->kv_cross, ctx->itype, model.hparams.n_audio_ctx)) {
+        fprintf(stderr, "%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        fprintf(stderr, "%s: kv cross size = %7.2f MB\n", __func__, memory_size/1024.0/1024.0);
+    }
+
+    state->buf_compute.resize      (whisper_graph_meta_size());
+    state->buf_compute_layer.resize(whisper_graph_meta_size());
+
+    // sized for the encoder of one window, the buffers grow when a later graph needs more
+    whisper_allocr_reserve(*state, [&](struct ggml_allocr * alloc, struct ggml_allocr * alloc_layer) {
+        whisper_encode_graphs(*ctx, { state }, 0, 1, alloc, alloc_layer);
+    });
+
+    {
+        const size_t memory_size = state->alloc.data.size() + state->alloc_layer.data.size();
+        fprintf(stderr, "%s: compute size  = %7.2f MB\n", __func__, memory_size/1024.0/1024.0);
+    }
+
+    state->logits.reserve(vocab.n_vocab*model.hparams.n_text_ctx);
+
+    state->logits_id.reserve(vocab.n_vocab);
+
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(model.hparams.n_text_ctx);
+
+    state->decoders[0].probs.reserve   (vocab.n_vocab);
+    state->decoders[0].logits.reserve  (vocab.n_vocab);
+    state->decoders[0].logprobs.reserve(vocab.n_vocab);
+
+    state->rng = std::mt19937(0);
+
+    return state;
+}
+
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
     whisper_model_loader loader = {};
 
     fprintf(stderr, "%s: loading model from '%s'\n", __func__, path_model);
@@ -2326,10 +3082,10 @@ struct whisper_context * whisper_init_from_file(const char * path_model) {
         fin->close();
     };
 
-    return whisper_init(&loader);
+    return whisper_init_no_state(&loader);
 }
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
     struct buf_context {
         uint8_t* buffer;
         size_t size;
@@ -2362,10 +3118,64 @@ struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_s
 
     loader.close = [](void * /*ctx*/) { };
 
-    return whisper_init(&loader);
+    return whisper_init_no_state(&loader);
 }
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+struct whisper_context * whisper_init_from_file_mmap_no_state(const char * path_model, int flags) {
+    ggml_time_init();
+
+    const int64_t t_start_us = ggml_time_us();
+
+    fprintf(stderr, "%s: mapping model from '%s'\n", __func__, path_model);
+
+    whisper_mmap * mapping = whisper_mmap_open(path_model, flags);
+    if (mapping == nullptr) {
+        fprintf(stderr, "%s: failed to map '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = mapping;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_mmap * mapping = reinterpret_cast<whisper_mmap *>(ctx);
+
+        const size_t size_to_copy = std::min(read_size, mapping->size - mapping->pos);
+
+        memcpy(output, (const uint8_t *) mapping->addr + mapping->pos, size_to_copy);
+        mapping->pos += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_mmap * mapping = reinterpret_cast<whisper_mmap *>(ctx);
+
+        return mapping->pos >= mapping->size;
+    };
+
+    // the mapping is kept until whisper_free()
+    loader.close = [](void * /*ctx*/) { };
+
+    whisper_context * ctx = new whisper_context;
+
+    ctx->model.mapping = mapping;
+
+    if (!whisper_model_load(&loader, *ctx)) {
+        fprintf(stderr, "%s: failed to load model\n", __func__);
+        whisper_mmap_close(mapping);
+        delete ctx;
+        return nullptr;
+    }
+
+    // with WHISPER_MMAP_POPULATE the file is read by the mapping
+    ctx->t_load_us = ggml_time_us() - t_start_us;
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
     ggml_time_init();
 
     whisper_context * ctx = new whisper_context;
@@ -2382,6 +3192,52 @@ struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
     return ctx;
 }
 
+// the context owns the state of the calls without a state argument
+static struct whisper_context * whisper_with_state(struct whisper_context * ctx) {
+    if (ctx == nullptr) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (ctx->state == nullptr) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    return whisper_with_state(whisper_init_from_file_no_state(path_model));
+}
+
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    return whisper_with_state(whisper_init_from_buffer_no_state(buffer, buffer_size));
+}
+
+struct whisper_context * whisper_init_from_file_mmap(const char * path_model, int flags) {
+    return whisper_with_state(whisper_init_from_file_mmap_no_state(path_model, flags));
+}
+
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    return whisper_with_state(whisper_init_no_state(loader));
+}
+
+void whisper_free_state(struct whisper_state * state) {
+    if (state) {
+        if (state->kv_cross.ctx) {
+            ggml_free(state->kv_cross.ctx);
+        }
+        if (state->kv_self.cache.ctx) {
+            ggml_free(state->kv_self.cache.ctx);
+        }
+        ggml_threadpool_free(state->threadpool);
+        whisper_allocr_free(state->alloc);
+        whisper_allocr_free(state->alloc_layer);
+        delete state;
+    }
+}
+
 void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         if (ctx->model.ctx) {
@@ -2390,20 +3246,14 @@ void whisper_free(struct whisper_context * ctx) {
         if (ctx->model.buf) {
             delete ctx->model.buf;
         }
-        if (ctx->kv_cross.ctx) {
-            ggml_free(ctx->kv_cross.ctx);
-        }
-        for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
-            if (ctx->decoders[i].kv_self.ctx) {
-                ggml_free(ctx->decoders[i].kv_self.ctx);
-            }
-        }
+        whisper_mmap_close(ctx->model.mapping);
+        whisper_free_state(ctx->state);
         delete ctx;
     }
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*ctx, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, ctx->mel)) {
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
         fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -2411,9 +3261,13 @@ int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int
     return 0;
 }
 
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
 // same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
-int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*ctx, samples, n_samples, WHISPER_SAMPLE_RATE, 2*WHISPER_N_FFT, 2*WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, ctx->mel)) {
+int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2*WHISPER_N_FFT, 2*WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, state->mel)) {
         fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -2421,8 +3275,13 @@ int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float *
     return 0;
 }
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
+int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * /*ctx*/,
+        struct whisper_state * state,
         const float * data,
         int n_len,
         int n_mel) {
@@ -2431,17 +3290,42 @@ int whisper_set_mel(
         return -1;
     }
 
-    ctx->mel.n_len = n_len;
-    ctx->mel.n_mel = n_mel;
+    state->mel.n_len = n_len;
+    state->mel.n_mel = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
 
-    ctx->mel.data.resize(n_len*n_mel);
-    memcpy(ctx->mel.data.data(), data, n_len*n_mel*sizeof(float));
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode(*ctx, *state, offset, n_threads)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return -1;
+    }
 
     return 0;
 }
 
 int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode(*ctx, offset, n_threads)) {
+    return whisper_encode_with_state(ctx, ctx->state, offset, n_threads);
+}
+
+int whisper_encode_batch(struct whisper_context * ctx, struct whisper_state ** states, int n_states, int offset, int n_threads) {
+    if (n_states < 1) {
+        return 0;
+    }
+
+    if (!whisper_encode_batch(*ctx, std::vector<whisper_state *>(states, states + n_states), offset, n_threads)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return -1;
     }
@@ -2449,11 +3333,11 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     return 0;
 }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    // TODO: add selected_decoder_id to context
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    // TODO: add selected_decoder_id to state
     const int selected_decoder_id = 0;
 
-    if (!whisper_decode(*ctx, ctx->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+    if (!whisper_decode(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
         fprintf(stderr, "%s: failed to eval\n", __func__);
         return 1;
     }
@@ -2461,6 +3345,22 @@ int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, i
     return 0;
 }
 
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
+
+void whisper_set_cpu_affinity_with_state(struct whisper_state * state, int cpu_core_offset) {
+    state->cpu_core_offset = cpu_core_offset;
+
+    // the workers are started again, pinned, by the next graph
+    ggml_threadpool_free(state->threadpool);
+    state->threadpool = nullptr;
+}
+
+void whisper_set_cpu_affinity(struct whisper_context * ctx, int cpu_core_offset) {
+    whisper_set_cpu_affinity_with_state(ctx->state, cpu_core_offset);
+}
+
 int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
     const auto res = tokenize(ctx->vocab, text);
 
@@ -2511,8 +3411,9 @@ const char * whisper_lang_str(int id) {
     return nullptr;
 }
 
-int whisper_lang_auto_detect(
+int whisper_lang_auto_detect_with_state(
         struct whisper_context * ctx,
+        struct whisper_state * state,
         int offset_ms,
         int n_threads,
         float * lang_probs) {
@@ -2523,30 +3424,30 @@ int whisper_lang_auto_detect(
         return -1;
     }
 
-    if (seek >= ctx->mel.n_len) {
-        fprintf(stderr, "%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, ctx->mel.n_len*10);
+    if (seek >= state->mel.n_len) {
+        fprintf(stderr, "%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len*10);
         return -2;
     }
 
     // run the encoder
-    if (whisper_encode(ctx, seek, n_threads) != 0) {
+    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
         fprintf(stderr, "%s: failed to encode\n", __func__);
         return -6;
     }
 
     const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
 
-    if (whisper_decode(ctx, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
         fprintf(stderr, "%s: failed to decode\n", __func__);
         return -7;
     }
 
-    auto & logits_id = ctx->logits_id;
+    auto & logits_id = state->logits_id;
     logits_id.clear();
 
     for (const auto & kv : g_lang) {
         const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(ctx->logits[token_lang], kv.second.first);
+        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
     }
 
     // sort descending
@@ -2585,8 +3486,20 @@ int whisper_lang_auto_detect(
     return logits_id[0].second;
 }
 
+int whisper_lang_auto_detect(
+        struct whisper_context * ctx,
+        int offset_ms,
+        int n_threads,
+        float * lang_probs) {
+    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
+}
+
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len;
+}
+
 int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->mel.n_len;
+    return ctx->state->mel.n_len;
 }
 
 int whisper_n_vocab(struct whisper_context * ctx) {
@@ -2606,7 +3519,11 @@ int whisper_is_multilingual(struct whisper_context * ctx) {
 }
 
 float * whisper_get_logits(struct whisper_context * ctx) {
-    return ctx->logits.data();
+    return ctx->state->logits.data();
+}
+
+float * whisper_get_logits_from_state(struct whisper_state * state) {
+    return state->logits.data();
 }
 
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
@@ -2652,24 +3569,34 @@ whisper_token whisper_token_transcribe(void) {
 void whisper_print_timings(struct whisper_context * ctx) {
     const int64_t t_end_us = ggml_time_us();
 
-    const int32_t n_sample = std::max(1, ctx->n_sample);
-    const int32_t n_encode = std::max(1, ctx->n_encode);
-    const int32_t n_decode = std::max(1, ctx->n_decode);
-
     fprintf(stderr, "\n");
-    fprintf(stderr, "%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->n_fail_p, ctx->n_fail_h);
-    fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us/1000.0f);
-    fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, ctx->t_mel_us/1000.0f);
-    fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*ctx->t_sample_us, n_sample, 1e-3f*ctx->t_sample_us/n_sample);
-    fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*ctx->t_encode_us, n_encode, 1e-3f*ctx->t_encode_us/n_encode);
-    fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*ctx->t_decode_us, n_decode, 1e-3f*ctx->t_decode_us/n_decode);
+
+    if (ctx->state != nullptr) {
+        const auto * state = ctx->state;
+
+        const int32_t n_sample = std::max(1, state->n_sample);
+        const int32_t n_encode = std::max(1, state->n_encode);
+        const int32_t n_decode = std::max(1, state->n_decode);
+
+        fprintf(stderr, "%s:     fallbacks = %3d p / %3d h\n", __func__, state->n_fail_p, state->n_fail_h);
+        fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us/1000.0f);
+        fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, state->t_mel_us/1000.0f);
+        fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*state->t_sample_us, n_sample, 1e-3f*state->t_sample_us/n_sample);
+        fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*state->t_encode_us, n_encode, 1e-3f*state->t_encode_us/n_encode);
+        fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f*state->t_decode_us, n_decode, 1e-3f*state->t_decode_us/n_decode);
+    } else {
+        fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us/1000.0f);
+    }
+
     fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
 void whisper_reset_timings(struct whisper_context * ctx) {
-    ctx->t_sample_us = 0;
-    ctx->t_encode_us = 0;
-    ctx->t_decode_us = 0;
+    if (ctx->state != nullptr) {
+        ctx->state->t_sample_us = 0;
+        ctx->state->t_encode_us = 0;
+        ctx->state->t_decode_us = 0;
+    }
 }
 
 const char * whisper_print_system_info(void) {
@@ -2777,14 +3704,15 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context & ctx,
+          struct whisper_state & state,
                            int   i_segment,
                          float   thold_pt,
                          float   thold_ptsum);
 
 // wrap the last segment to max_len characters
 // returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, int max_len) {
-    auto segment = ctx.result_all.back();
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len) {
+    auto segment = state.result_all.back();
 
     int res = 1;
     int acc = 0;
@@ -2803,24 +3731,24 @@ static int whisper_wrap_segment(struct whisper_context & ctx, int max_len) {
 
         if (acc + cur > max_len && i > 0) {
             // split here
-            ctx.result_all.back().text = std::move(text);
-            ctx.result_all.back().t1 = token.t0;
-            ctx.result_all.back().tokens.resize(i);
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
 
-            ctx.result_all.push_back({});
-            ctx.result_all.back().t0 = token.t0;
-            ctx.result_all.back().t1 = segment.t1;
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
 
             // add tokens [i, end] to the new segment
-            ctx.result_all.back().tokens.insert(
-                    ctx.result_all.back().tokens.end(),
+            state.result_all.back().tokens.insert(
+                    state.result_all.back().tokens.end(),
                     segment.tokens.begin() + i,
                     segment.tokens.end());
 
             acc = 0;
             text = "";
 
-            segment = ctx.result_all.back();
+            segment = state.result_all.back();
             i = -1;
 
             res++;
@@ -2830,7 +3758,7 @@ static int whisper_wrap_segment(struct whisper_context & ctx, int max_len) {
         }
     }
 
-    ctx.result_all.back().text = std::move(text);
+    state.result_all.back().text = std::move(text);
 
     return res;
 }
@@ -2840,9 +3768,11 @@ static int whisper_wrap_segment(struct whisper_context & ctx, int max_len) {
 // - computes logprobs and probs
 static void whisper_process_logits(
         const struct whisper_context & ctx,
+          const struct whisper_state & state,
     const struct whisper_full_params   params,
               struct whisper_decoder & decoder,
-                               float   temperature) {
+                               float   temperature,
+                                 int   i_logits) {
     const auto & vocab      = ctx.vocab;
     const auto & tokens_cur = decoder.sequence.tokens;
 
@@ -2851,14 +3781,16 @@ static void whisper_process_logits(
 
     WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
 
-    // extract the logits for the last token
-    // we will be mutating and therefore we don't want to use the ctx.logits buffer directly
+    // extract the logits for the last token of the decoder, row i_logits of state.logits
+    // we will be mutating and therefore we don't want to use the state.logits buffer directly
     auto & probs    = decoder.probs;
     auto & logits   = decoder.logits;
     auto & logprobs = decoder.logprobs;
     {
+        WHISPER_ASSERT((i_logits + 1)*n_logits <= (int) state.logits.size());
+
         logits.resize(n_logits);
-        memcpy(logits.data(), ctx.logits.data() + (ctx.logits.size() - n_logits), n_logits*sizeof(float));
+        memcpy(logits.data(), state.logits.data() + i_logits*n_logits, n_logits*sizeof(float));
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
@@ -3018,6 +3950,7 @@ static void whisper_process_logits(
 
 static whisper_token_data whisper_sample_token(
             whisper_context & ctx,
+              whisper_state & state,
       const whisper_decoder & decoder,
                        bool   best) {
     whisper_token_data result = {
@@ -3062,7 +3995,7 @@ static whisper_token_data whisper_sample_token(
     } else {
         std::discrete_distribution<> dist(probs.begin(), probs.end());
 
-        result.id   = dist(ctx.rng);
+        result.id   = dist(state.rng);
         result.p    = probs[result.id];
         result.plog = logprobs[result.id];
     }
@@ -3072,13 +4005,14 @@ static whisper_token_data whisper_sample_token(
         result.pt  = result.p;
     }
 
-    ctx.n_sample++;
+    state.n_sample++;
 
     return result;
 }
 
 static std::vector<whisper_token_data> whisper_sample_token_topk(
             whisper_context & ctx,
+              whisper_state & state,
       const whisper_decoder & decoder,
                         int   k) {
     const auto & vocab = ctx.vocab;
@@ -3089,7 +4023,7 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
 
     const int n_logits = vocab.n_vocab;
 
-    auto & logits_id = ctx.logits_id;
+    auto & logits_id = state.logits_id;
 
     logits_id.clear();
     for (int i = 0; i < n_logits; ++i) {
@@ -3142,7 +4076,7 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
         }
     }
 
-    ctx.n_sample++;
+    state.n_sample++;
 
     return result;
 }
@@ -3196,24 +4130,25 @@ static void whisper_sequence_score(
     }
 }
 
-int whisper_full(
+int whisper_full_with_state(
         struct whisper_context * ctx,
+        struct whisper_state * state,
         struct whisper_full_params params,
         const float * samples,
         int n_samples) {
     // clear old results
-    auto & result_all = ctx->result_all;
+    auto & result_all = state->result_all;
 
     result_all.clear();
 
     // compute log mel spectrogram
     if (params.speed_up) {
-        if (whisper_pcm_to_mel_phase_vocoder(ctx, samples, n_samples, params.n_threads) != 0) {
+        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
             fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
             return -1;
         }
     } else {
-        if (whisper_pcm_to_mel(ctx, samples, n_samples, params.n_threads) != 0) {
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
             fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
             return -2;
         }
@@ -3223,7 +4158,7 @@ int whisper_full(
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect(ctx, 0, params.n_threads, probs.data());
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
         if (lang_id < 0) {
             fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
             return -3;
@@ -3235,14 +4170,14 @@ int whisper_full(
     }
 
     if (params.token_timestamps) {
-        ctx->t_beg    = 0;
-        ctx->t_last   = 0;
-        ctx->tid_last = 0;
-        ctx->energy = get_signal_energy(samples, n_samples, 32);
+        state->t_beg    = 0;
+        state->t_last   = 0;
+        state->tid_last = 0;
+        state->energy = get_signal_energy(samples, n_samples, 32);
     }
 
     const int seek_start = params.offset_ms/10;
-    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len(ctx) : params.duration_ms/10);
+    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
 
     // if length of spectrogram is less than 1s (100 samples), then return
     // basically don't process anything that is less than 1s
@@ -3278,20 +4213,17 @@ int whisper_full(
 
     n_decoders = std::max(1, n_decoders);
 
+    if (!kv_pool_reserve(*ctx, *state, n_decoders)) {
+        fprintf(stderr, "%s: kv_pool_reserve() failed for self-attention, %d decoders\n", __func__, n_decoders);
+        return -4;
+    }
+
     // TAGS: WHISPER_DECODER_INIT
     for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = ctx->decoders[j];
-
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = ctx->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self)) {
-                fprintf(stderr, "%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
-            }
-
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
+        auto & decoder = state->decoders[j];
 
-            decoder.sequence.tokens.reserve(ctx->decoders[0].sequence.tokens.capacity());
+        if (decoder.probs.empty()) {
+            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
 
             decoder.probs.resize   (ctx->vocab.n_vocab);
             decoder.logits.resize  (ctx->vocab.n_vocab);
@@ -3300,7 +4232,7 @@ int whisper_full(
     }
 
     // the accumulated text context so far
-    auto & prompt_past = ctx->prompt_past;
+    auto & prompt_past = state->prompt_past;
     if (params.no_context) {
         prompt_past.clear();
     }
@@ -3319,7 +4251,7 @@ int whisper_full(
         fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
         return -5;
     }
-    ctx->exp_n_audio_ctx = params.audio_ctx;
+    state->exp_n_audio_ctx = params.audio_ctx;
 
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
@@ -3341,13 +4273,11 @@ int whisper_full(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
-    // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
+    // the last tokens of the decoders, evaluated together
+    std::vector<whisper_batch_seq> batch;
 
-    std::vector<kv_buf> kv_bufs;
+    // beam-search helpers
+    std::vector<whisper_kv_table> kv_bufs;
 
     struct beam_candidate {
         int decoder_idx;
@@ -3376,14 +4306,14 @@ int whisper_full(
         }
 
         if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, params.encoder_begin_callback_user_data) == false) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
                 fprintf(stderr, "%s: encoder_begin_callback returned false - aborting\n", __func__);
                 break;
             }
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode(*ctx, seek, params.n_threads)) {
+        if (!whisper_encode(*ctx, *state, seek, params.n_threads)) {
             fprintf(stderr, "%s: failed to encode\n", __func__);
             return -6;
         }
@@ -3424,9 +4354,9 @@ int whisper_full(
 
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = ctx->decoders[j];
+                auto & decoder = state->decoders[j];
 
-                decoder.kv_self.n = 0;
+                kv_table_release(state->kv_self, decoder.kv_self);
 
                 decoder.sequence.tokens.clear();
                 decoder.sequence.result_len       = 0;
@@ -3466,7 +4396,7 @@ int whisper_full(
                 //}
                 //WHISPER_PRINT_DEBUG("\n\n");
 
-                if (!whisper_decode(*ctx, ctx->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
+                if (!whisper_decode(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
                     fprintf(stderr, "%s: failed to decode\n", __func__);
                     return -7;
                 }
@@ -3474,24 +4404,22 @@ int whisper_full(
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    whisper_process_logits(*ctx, params, ctx->decoders[0], t_cur);
+                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur, prompt.size() - 1);
 
-                    ctx->decoders[0].kv_self.n += prompt.size();
+                    state->decoders[0].kv_self.n += prompt.size();
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = ctx->decoders[j];
-
-                        memcpy(decoder.kv_self.k->data, ctx->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, ctx->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+                        auto & decoder = state->decoders[j];
 
-                        decoder.kv_self.n += prompt.size();
+                        // the decoders share the blocks of the prompt
+                        kv_table_copy(state->kv_self, decoder.kv_self, state->decoders[0].kv_self);
 
-                        memcpy(decoder.probs.data(),    ctx->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(),   ctx->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), ctx->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                        memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                        memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
                     }
 
-                    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
@@ -3502,17 +4430,14 @@ int whisper_full(
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
                     kv_bufs.resize(n_decoders_cur);
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = ctx->decoders[j];
+                        auto & decoder = state->decoders[j];
 
                         if (decoder.completed || decoder.failed) {
                             continue;
                         }
 
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
-
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
+                        // keep the blocks of the decoder for its candidates
+                        kv_table_copy(state->kv_self, kv_bufs[j], decoder.kv_self);
                     }
 
                     beam_candidates.clear();
@@ -3520,7 +4445,7 @@ int whisper_full(
 
                 // generate new sequence candidates for each decoder
                 for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = ctx->decoders[j];
+                    auto & decoder = state->decoders[j];
 
                     if (decoder.completed || decoder.failed) {
                         continue;
@@ -3530,16 +4455,16 @@ int whisper_full(
                         case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                             {
                                 if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
                                 } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
                                 }
 
                                 decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
                             } break;
                         case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                             {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
 
                                 for (const auto & token : tokens_new) {
                                     beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
@@ -3564,15 +4489,16 @@ int whisper_full(
                     int cur_c = 0;
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = ctx->decoders[j];
+                        auto & decoder = state->decoders[j];
 
                         if (decoder.completed || decoder.failed) {
                             continue;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        // the duplicates can use up the candidates, the last ones are taken again then
+                        auto & cur = beam_candidates[std::min(cur_c++, (int) beam_candidates.size() - 1)];
 
-                        while (beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
+                        while (cur_c < (int) beam_candidates.size() && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
                             ++cur_c;
                         }
 
@@ -3580,12 +4506,16 @@ int whisper_full(
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+                        kv_table_copy(state->kv_self, decoder.kv_self, kv_bufs[cur.decoder_idx]);
 
                         WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
                                 __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
+
+                    // the blocks that no beam continues are free again
+                    for (auto & kv_buf : kv_bufs) {
+                        kv_table_release(state->kv_self, kv_buf);
+                    }
                 }
 
                 // update the decoder state
@@ -3593,7 +4523,7 @@ int whisper_full(
                 // - check if the sequence is failed
                 // - update sliding window based on timestamp tokens
                 for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = ctx->decoders[j];
+                    auto & decoder = state->decoders[j];
 
                     if (decoder.completed || decoder.failed) {
                         continue;
@@ -3675,7 +4605,7 @@ int whisper_full(
                     bool completed_all = true;
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = ctx->decoders[j];
+                        auto & decoder = state->decoders[j];
 
                         if (decoder.completed || decoder.failed) {
                             continue;
@@ -3689,11 +4619,14 @@ int whisper_full(
                     }
                 }
 
-                ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
                 // obtain logits for the next token
+                // the last tokens of all running decoders are evaluated in one batch
+                batch.clear();
+
                 for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = ctx->decoders[j];
+                    auto & decoder = state->decoders[j];
 
                     if (decoder.failed || decoder.completed) {
                         continue;
@@ -3704,20 +4637,26 @@ int whisper_full(
 
                     //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
 
-                    if (!whisper_decode(*ctx, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
-                        fprintf(stderr, "%s: failed to decode\n", __func__);
-                        return -8;
-                    }
+                    batch.push_back({ &decoder, decoder.tokens_tmp.data(), (int) decoder.tokens_tmp.size(), decoder.kv_self.n });
+                }
 
-                    {
-                        const int64_t t_start_sample_us = ggml_time_us();
+                if (!whisper_decode_batch(*ctx, *state, batch, params.n_threads)) {
+                    fprintf(stderr, "%s: failed to decode\n", __func__);
+                    return -8;
+                }
+
+                {
+                    const int64_t t_start_sample_us = ggml_time_us();
 
-                        whisper_process_logits(*ctx, params, decoder, t_cur);
+                    for (int b = 0; b < (int) batch.size(); ++b) {
+                        auto & decoder = *batch[b].decoder;
 
-                        ++decoder.kv_self.n;
+                        whisper_process_logits(*ctx, *state, params, decoder, t_cur, b);
 
-                        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+                        ++decoder.kv_self.n;
                     }
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
@@ -3726,7 +4665,7 @@ int whisper_full(
                 double best_score = -INFINITY;
 
                 for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = ctx->decoders[j];
+                    auto & decoder = state->decoders[j];
 
                     if (decoder.failed) {
                         continue;
@@ -3743,7 +4682,7 @@ int whisper_full(
                                 __func__, j, decoder.sequence.entropy, params.entropy_thold);
 
                         decoder.failed = true;
-                        ctx->n_fail_h++;
+                        state->n_fail_h++;
 
                         continue;
                     }
@@ -3761,15 +4700,15 @@ int whisper_full(
             {
                 bool success = true;
 
-                const auto & decoder = ctx->decoders[best_decoder_id];
+                const auto & decoder = state->decoders[best_decoder_id];
 
                 if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
                     success = false;
-                    ctx->n_fail_p++;
+                    state->n_fail_p++;
                 }
 
                 if (success) {
-                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
+                    //for (auto & token : state->decoders[best_decoder_id].sequence.tokens) {
                     //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
                     //}
 
@@ -3782,7 +4721,7 @@ int whisper_full(
 
         // output results through a user-provided callback
         {
-            const auto & best_decoder = ctx->decoders[best_decoder_id];
+            const auto & best_decoder = state->decoders[best_decoder_id];
 
             const auto seek_delta = best_decoder.seek_delta;
             const auto result_len = best_decoder.sequence.result_len;
@@ -3845,14 +4784,14 @@ int whisper_full(
 
                             if (params.token_timestamps) {
                                 whisper_exp_compute_token_level_timestamps(
-                                        *ctx, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
                                 if (params.max_len > 0) {
-                                    n_new = whisper_wrap_segment(*ctx, params.max_len);
+                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len);
                                 }
                             }
                             if (params.new_segment_callback) {
-                                params.new_segment_callback(ctx, n_new, params.new_segment_callback_user_data);
+                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                             }
                         }
                         text = "";
@@ -3889,14 +4828,14 @@ int whisper_full(
 
                     if (params.token_timestamps) {
                         whisper_exp_compute_token_level_timestamps(
-                                *ctx, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
                         if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, params.max_len);
+                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len);
                         }
                     }
                     if (params.new_segment_callback) {
-                        params.new_segment_callback(ctx, n_new, params.new_segment_callback_user_data);
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                     }
                 }
             }
@@ -3911,6 +4850,14 @@ int whisper_full(
     return 0;
 }
 
+int whisper_full(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -3923,35 +4870,17 @@ int whisper_full_parallel(
 
     int ret = 0;
 
-    // prepare separate contexts for each thread
-    std::vector<struct whisper_context> ctxs(n_processors - 1);
+    // prepare separate states for each thread, they all use the weights of ctx
+    std::vector<struct whisper_state *> states(n_processors - 1);
 
     for (int i = 0; i < n_processors - 1; ++i) {
-        auto & ctx_p = ctxs[i];
-
-        ctx_p = *ctx;
-
-        ctx_p.logits.reserve(ctx_p.vocab.n_vocab*ctx_p.model.hparams.n_text_ctx);
-
-        ctx_p.logits_id.reserve(ctx_p.vocab.n_vocab);
-
-        if (!kv_cache_reinit(ctx_p.kv_cross)) {
-            fprintf(stderr, "%s: kv_cache_reinit() failed for cross-attention, processor %d\n", __func__, i);
-            return false;
-        }
-
-        // TAGS: WHISPER_DECODER_INIT
-        for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
-            if (ctx_p.decoders[j].kv_self.ctx && !kv_cache_reinit(ctx_p.decoders[j].kv_self)) {
-                fprintf(stderr, "%s: kv_cache_reinit() failed for self-attention, decoder %d, processor %d\n", __func__, j, i);
-                return false;
+        states[i] = whisper_init_state(ctx);
+        if (states[i] == nullptr) {
+            fprintf(stderr, "%s: whisper_init_state() failed, processor %d\n", __func__, i);
+            for (int j = 0; j < i; ++j) {
+                whisper_free_state(states[j]);
             }
-
-            ctx_p.decoders[j].sequence.tokens.reserve(ctx_p.model.hparams.n_text_ctx);
-
-            ctx_p.decoders[j].probs.reserve   (ctx_p.vocab.n_vocab);
-            ctx_p.decoders[j].logits.reserve  (ctx_p.vocab.n_vocab);
-            ctx_p.decoders[j].logprobs.reserve(ctx_p.vocab.n_vocab);
+            return -1;
         }
     }
 
@@ -3975,7 +4904,7 @@ int whisper_full_parallel(
         params_cur.new_segment_callback = nullptr;
         params_cur.new_segment_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full, &ctxs[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
     }
 
     {
@@ -3990,9 +4919,9 @@ int whisper_full_parallel(
 
     const int64_t offset_t = (int64_t) params.offset_ms/10.0;
 
-    // combine results into ctx->result_all
+    // combine results into ctx->state->result_all
     for (int i = 0; i < n_processors - 1; ++i) {
-        auto & results_i = ctxs[i].result_all;
+        auto & results_i = states[i]->result_all;
 
         for (auto & result : results_i) {
             // correct the segment timestamp taking into account the offset
@@ -4000,35 +4929,31 @@ int whisper_full_parallel(
             result.t1 += 100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t;
 
             // make sure that segments are not overlapping
-            if (!ctx->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->result_all.back().t1);
+            if (!ctx->state->result_all.empty()) {
+                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
             }
 
-            ctx->result_all.push_back(std::move(result));
+            ctx->state->result_all.push_back(std::move(result));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, 1, params.new_segment_callback_user_data);
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
             }
         }
 
-        ctx->t_mel_us    += ctxs[i].t_mel_us;
-        ctx->t_sample_us += ctxs[i].t_sample_us;
-        ctx->t_encode_us += ctxs[i].t_encode_us;
-        ctx->t_decode_us += ctxs[i].t_decode_us;
-
-        kv_cache_free(ctx->kv_cross);
+        ctx->state->t_mel_us    += states[i]->t_mel_us;
+        ctx->state->t_sample_us += states[i]->t_sample_us;
+        ctx->state->t_encode_us += states[i]->t_encode_us;
+        ctx->state->t_decode_us += states[i]->t_decode_us;
 
-        for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
-            kv_cache_free(ctx->decoders[j].kv_self);
-        }
+        whisper_free_state(states[i]);
     }
 
     // average the timings
-    ctx->t_mel_us    /= n_processors;
-    ctx->t_sample_us /= n_processors;
-    ctx->t_encode_us /= n_processors;
-    ctx->t_decode_us /= n_processors;
+    ctx->state->t_mel_us    /= n_processors;
+    ctx->state->t_sample_us /= n_processors;
+    ctx->state->t_encode_us /= n_processors;
+    ctx->state->t_decode_us /= n_processors;
 
     // print information about the audio boundaries
     fprintf(stderr, "\n");
@@ -4041,40 +4966,76 @@ int whisper_full_parallel(
     return ret;
 }
 
+int whisper_full_n_segments_from_state(struct whisper_state * state) {
+    return state->result_all.size();
+}
+
 int whisper_full_n_segments(struct whisper_context * ctx) {
-    return ctx->result_all.size();
+    return ctx->state->result_all.size();
+}
+
+int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t0;
 }
 
 int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].t0;
+    return ctx->state->result_all[i_segment].t0;
+}
+
+int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t1;
 }
 
 int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].t1;
+    return ctx->state->result_all[i_segment].t1;
+}
+
+const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].text.c_str();
 }
 
 const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].text.c_str();
+    return ctx->state->result_all[i_segment].text.c_str();
+}
+
+int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].tokens.size();
 }
 
 int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].tokens.size();
+    return ctx->state->result_all[i_segment].tokens.size();
+}
+
+const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
 }
 
 const char * whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->result_all[i_segment].tokens[i_token].id].c_str();
+    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+}
+
+whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].id;
 }
 
 whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token].id;
+    return ctx->state->result_all[i_segment].tokens[i_token].id;
+}
+
+struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token];
 }
 
 struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token];
+    return ctx->state->result_all[i_segment].tokens[i_token];
+}
+
+float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].p;
 }
 
 float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token].p;
+    return ctx->state->result_all[i_segment].tokens[i_token].p;
 }
 
 // =================================================================================================
@@ -4150,25 +5111,27 @@ WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
 
     for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
 
-    for (int j = 0; j < (int) sizes.size(); j++) {
-        int n_fp16 = 0;
-        int n_fp32 = 0;
+    // the quantized weights need valid scales
+    std::vector<float> row(N_max);
+    for (size_t i = 0; i < row.size(); i++) row[i] = 0.01f*(i % 97) - 0.5f;
 
-        // GFLOPS/s
-        double s_fp16 = 0.0;
-        double s_fp32 = 0.0;
+    const ggml_type wtypes[] = { GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, GGML_TYPE_F16, GGML_TYPE_F32, };
 
+    for (int j = 0; j < (int) sizes.size(); j++) {
         const size_t N = sizes[j];
 
-        for (int k = 0; k < 2; ++k) {
-            const ggml_type wtype = k == 0 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        std::string line;
+
+        for (const ggml_type wtype : wtypes) {
+            int n = 0;
 
-            double & s = k == 0 ? s_fp16 : s_fp32;
-            int    & n = k == 0 ? n_fp16   : n_fp32;
+            // GFLOPS/s
+            double s = 0.0;
 
             struct ggml_init_params gparams = {
                 /*.mem_size   =*/ buf.size(),
                 /*.mem_buffer =*/ buf.data(),
+                /*.no_alloc   =*/ false,
             };
 
             struct ggml_context * ctx0 = ggml_init(gparams);
@@ -4176,6 +5139,17 @@ WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
             struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
             struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
 
+            if (ggml_blck_size(wtype) > 1) {
+                for (size_t i = 0; i < N; i++) {
+                    char * dst = (char *) a->data + i*a->nb[1];
+                    if (wtype == GGML_TYPE_Q4_0) {
+                        ggml_quantize_q4_0(row.data(), dst, N, N, nullptr);
+                    } else {
+                        ggml_quantize_q8_0(row.data(), dst, N, N, nullptr);
+                    }
+                }
+            }
+
             struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
 
             struct ggml_cgraph gf = ggml_build_forward(c);
@@ -4205,10 +5179,13 @@ WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
             ggml_free(ctx0);
 
             s = ((2.0*N*N*N*n)/tsum)*1e-9;
+
+            char tmp[64];
+            snprintf(tmp, sizeof(tmp), "%s%4s %8.1f GFLOPS (%3d runs)", line.empty() ? "" : " / ", ggml_type_name(wtype), s, n);
+            line += tmp;
         }
 
-        fprintf(stderr, "ggml_mul_mat: %5zu x %5zu: F16 %8.1f GFLOPS (%3d runs) / F32 %8.1f GFLOPS (%3d runs)\n",
-            N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        fprintf(stderr, "ggml_mul_mat: %5zu x %5zu: %s\n", N, N, line.c_str());
     }
 
     return 0;
@@ -4286,13 +5263,14 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
 
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context & ctx,
+          struct whisper_state & state,
                            int   i_segment,
                          float   thold_pt,
                          float   thold_ptsum) {
-    auto & segment = ctx.result_all[i_segment];
+    auto & segment = state.result_all[i_segment];
     auto & tokens  = segment.tokens;
 
-    const int n_samples = ctx.energy.size();
+    const int n_samples = state.energy.size();
 
     if (n_samples == 0) {
         fprintf(stderr, "%s: no signal data available\n", __func__);
@@ -4315,9 +5293,9 @@ static void whisper_exp_compute_token_level_timestamps(
         return;
     }
 
-    auto & t_beg    = ctx.t_beg;
-    auto & t_last   = ctx.t_last;
-    auto & tid_last = ctx.tid_last;
+    auto & t_beg    = state.t_beg;
+    auto & t_last   = state.t_last;
+    auto & tid_last = state.tid_last;
 
     for (int j = 0; j < n; ++j) {
         auto & token = tokens[j];
@@ -4440,15 +5418,15 @@ static void whisper_exp_compute_token_level_timestamps(
             float sum = 0.0f;
 
             for (int k = ss0; k < ss1; k++) {
-                sum += ctx.energy[k];
+                sum += state.energy[k];
             }
 
             const float thold = 0.5*sum/ns;
 
             {
                 int k = s0;
-                if (ctx.energy[k] > thold && j > 0) {
-                    while (k > 0 && ctx.energy[k] > thold) {
+                if (state.energy[k] > thold && j > 0) {
+                    while (k > 0 && state.energy[k] > thold) {
                         k--;
                     }
                     tokens[j].t0 = sample_to_timestamp(k);
@@ -4458,7 +5436,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s0 = k;
                     }
                 } else {
-                    while (ctx.energy[k] < thold && k < s1) {
+                    while (state.energy[k] < thold && k < s1) {
                         k++;
                     }
                     s0 = k;
@@ -4468,8 +5446,8 @@ static void whisper_exp_compute_token_level_timestamps(
 
             {
                 int k = s1;
-                if (ctx.energy[k] > thold) {
-                    while (k < n_samples - 1 && ctx.energy[k] > thold) {
+                if (state.energy[k] > thold) {
+                    while (k < n_samples - 1 && state.energy[k] > thold) {
                         k++;
                     }
                     tokens[j].t1 = sample_to_timestamp(k);
@@ -4479,7 +5457,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s1 = k;
                     }
                 } else {
-                    while (ctx.energy[k] < thold && k > s0) {
+                    while (state.energy[k] < thold && k > s0) {
                         k--;
                     }
                     s1 = k;
@@ -35,6 +35,12 @@ extern "C" {
     // The following interface is thread-safe as long as the sample whisper_context is not used by multiple threads
     // concurrently.
     //
+    // The model weights are in the whisper_context, everything that changes while audio is processed is in a
+    // whisper_state. The functions without a state argument use the state that the context owns. To process several
+    // streams concurrently with one copy of the weights, create a state per stream with whisper_init_state() and use
+    // the *_with_state() and *_from_state() functions: different states of the same context can be used by different
+    // threads at the same time.
+    //
     // Basic usage:
     //
     //     #include "whisper.h"
@@ -66,6 +72,7 @@ extern "C" {
     //
 
     struct whisper_context;
+    struct whisper_state;
 
     typedef int whisper_token;
 
@@ -95,14 +102,40 @@ extern "C" {
     } whisper_model_loader;
 
     // Various functions for loading a ggml whisper model.
-    // Allocate (almost) all memory needed for the model.
+    // Allocate (almost) all memory needed for the model and for one state.
     // Return NULL on failure
     WHISPER_API struct whisper_context * whisper_init_from_file(const char * path_model);
     WHISPER_API struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init(struct whisper_model_loader * loader);
 
-    // Frees all memory allocated by the model.
+    // Same as above, but the context has no state of its own: only the *_with_state() functions can be used with it.
+    // Return NULL on failure
+    WHISPER_API struct whisper_context * whisper_init_from_file_no_state(const char * path_model);
+    WHISPER_API struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size);
+    WHISPER_API struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader);
+
+    // Allocate the memory of a state for the model of the context: the KV caches, the compute buffers and the results.
+    // The state must be freed with whisper_free_state() before the context is freed.
+    // Return NULL on failure
+    WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
+
+    enum whisper_mmap_flags {
+        WHISPER_MMAP_POPULATE = 1, // read the whole file when it is mapped (MAP_POPULATE, linux)
+        WHISPER_MMAP_WILLNEED = 2, // start reading the whole file in the background (madvise MADV_WILLNEED)
+    };
+
+    // Load the model by mapping the file into memory instead of reading it into a private buffer.
+    // The weights whose data is aligned in the file are used in place: the processes that map the same file share
+    // one copy of them in the page cache, and a start only reads the pages that are not cached yet.
+    // The file must not change while it is mapped, it is unmapped by whisper_free().
+    // flags is a combination of whisper_mmap_flags, 0 reads the pages on first use.
+    // Return NULL on failure or where mapping files is not supported
+    WHISPER_API struct whisper_context * whisper_init_from_file_mmap(const char * path_model, int flags);
+    WHISPER_API struct whisper_context * whisper_init_from_file_mmap_no_state(const char * path_model, int flags);
+
+    // Frees all memory allocated by the model and by the state of the context.
     WHISPER_API void whisper_free(struct whisper_context * ctx);
+    WHISPER_API void whisper_free_state(struct whisper_state * state);
 
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the provided whisper context.
@@ -113,6 +146,13 @@ extern "C" {
                                int   n_samples,
                                int   n_threads);
 
+    WHISPER_API int whisper_pcm_to_mel_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
     // This can be used to set a custom log mel spectrogram inside the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -123,6 +163,13 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    WHISPER_API int whisper_set_mel_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * data,
+                               int   n_len,
+                               int   n_mel);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -132,6 +179,25 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    WHISPER_API int whisper_encode_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   offset,
+                               int   n_threads);
+
+    // Run the Whisper encoder on the log mel spectrograms of several states at once, e.g. the windows of concurrent
+    // requests. The windows are evaluated as one batch: the weights are read once for all of them and the result
+    // of each window is stored in its own state, which then decodes as after whisper_encode_with_state().
+    // The states must use the same audio context, the compute buffers and threads of states[0] are used for the
+    // whole batch.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context *  ctx,
+             struct whisper_state ** states,
+                               int    n_states,
+                               int    offset,
+                               int    n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -145,6 +211,21 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    WHISPER_API int whisper_decode_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+               const whisper_token * tokens,
+                               int   n_tokens,
+                               int   n_past,
+                               int   n_threads);
+
+    // The encoder and decoder graphs run on worker threads that are started by the first whisper_encode() or
+    // whisper_decode() and kept until whisper_free(). Pin worker i to core cpu_core_offset + i, -1 (the default)
+    // leaves them to the OS scheduler. Linux only, ignored elsewhere.
+    // Every state has its own workers, they are kept until whisper_free_state().
+    WHISPER_API void whisper_set_cpu_affinity(struct whisper_context * ctx, int cpu_core_offset);
+    WHISPER_API void whisper_set_cpu_affinity_with_state(struct whisper_state * state, int cpu_core_offset);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -180,7 +261,15 @@ extern "C" {
                                int   n_threads,
                              float * lang_probs);
 
-    WHISPER_API int whisper_n_len          (struct whisper_context * ctx); // mel length
+    WHISPER_API int whisper_lang_auto_detect_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   offset_ms,
+                               int   n_threads,
+                             float * lang_probs);
+
+    WHISPER_API int whisper_n_len           (struct whisper_context * ctx); // mel length
+    WHISPER_API int whisper_n_len_from_state(struct whisper_state * state); // mel length
     WHISPER_API int whisper_n_vocab        (struct whisper_context * ctx);
     WHISPER_API int whisper_n_text_ctx     (struct whisper_context * ctx);
     WHISPER_API int whisper_n_audio_ctx    (struct whisper_context * ctx);
@@ -190,7 +279,8 @@ extern "C" {
     // The logits for the last token are stored in the last row
     // Rows: n_tokens
     // Cols: n_vocab
-    WHISPER_API float * whisper_get_logits(struct whisper_context * ctx);
+    WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
+    WHISPER_API float * whisper_get_logits_from_state(struct whisper_state * state);
 
     // Token Id -> String. Uses the vocabulary in the provided context
     WHISPER_API const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token);
@@ -226,12 +316,13 @@ extern "C" {
     // Text segment callback
     // Called on every newly generated text segment
     // Use the whisper_full_...() functions to obtain the text segments
-    typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, int n_new, void * user_data);
+    // Use the whisper_full_..._from_state() functions with the state of the callback
+    typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data);
 
     // Encoder begin callback
     // If not NULL, called before the encoder starts
     // If it returns false, the computation is aborted
-    typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, void * user_data);
+    typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, struct whisper_state * state, void * user_data);
 
     // Parameters for the whisper_full() function
     // If you chnage the order or add new parameters, make sure to update the default values in whisper.cpp:
@@ -315,7 +406,17 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
-    // Split the input audio in chunks and process each chunk separately using whisper_full()
+    // Same as whisper_full(), but the results are stored in the provided state.
+    // Different states of the same context can run whisper_full_with_state() in parallel threads.
+    WHISPER_API int whisper_full_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
+    // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
+    // Every chunk gets its own state, the results are combined in the state of the context.
     // It seems this approach can offer some speedup in some cases.
     // However, the transcription accuracy can be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
@@ -327,28 +428,39 @@ extern "C" {
 
     // Number of generated text segments.
     // A segment can be a few words, a sentence, or even a paragraph.
-    WHISPER_API int whisper_full_n_segments(struct whisper_context * ctx);
+    WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
+    WHISPER_API int whisper_full_n_segments_from_state(struct whisper_state * state);
 
     // Get the start and end time of the specified segment.
-    WHISPER_API int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment);
-    WHISPER_API int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t0           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
+
+    WHISPER_API int64_t whisper_full_get_segment_t1           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment);
 
     // Get the text of the specified segment.
-    WHISPER_API const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment);
+    WHISPER_API const char * whisper_full_get_segment_text           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment);
 
     // Get number of tokens in the specified segment.
-    WHISPER_API int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_n_tokens           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment);
 
     // Get the token text of the specified token in the specified segment.
-    WHISPER_API const char * whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token);
-    WHISPER_API whisper_token whisper_full_get_token_id (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API const char * whisper_full_get_token_text           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token);
+
+    WHISPER_API whisper_token whisper_full_get_token_id           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token);
 
     // Get token data for the specified token in the specified segment.
     // This contains probabilities, timestamps, etc.
-    WHISPER_API whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token_data whisper_full_get_token_data           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token);
 
     // Get the probability of the specified token in the specified segment.
-    WHISPER_API float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API float whisper_full_get_token_p           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token);
 
     ////////////////////////////////////////////////////////////////////////////
 
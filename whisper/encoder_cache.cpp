@@ -0,0 +1,124 @@
+#include "encoder_cache.hpp"
+
+#include <cstring>
+#include <iterator>
+
+// 64 bit multiply-xorshift over 8 bytes at a time, a 30 s window is ~1 MB so a byte wise hash would show up next to
+// the decoder
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t hash)
+{
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * multiplier;
+    }
+    return hash;
+}
+
+whisper::EncoderCache::EncoderCache(size_t max_bytes) : max_bytes_(max_bytes)
+{
+}
+
+bool whisper::EncoderCache::Key::operator==(const Key &other) const
+{
+    // bitwise like the hash
+    return hash == other.hash && n_mels == other.n_mels && model_id == other.model_id &&
+           samples.size() == other.samples.size() &&
+           std::memcmp(samples.data(), other.samples.data(), samples.size() * sizeof(float)) == 0;
+}
+
+whisper::EncoderCache::Key whisper::EncoderCache::key(const std::vector<std::vector<float>> &window,
+                                                      const std::string &model_id)
+{
+    Key key;
+    key.model_id = model_id;
+    key.n_mels = window.size();
+
+    uint64_t hash = hash_bytes(model_id.data(), model_id.size(), 0xCBF29CE484222325ull);
+    const uint64_t shape[2] = {window.size(), window.empty() ? 0 : window[0].size()};
+    hash = hash_bytes(shape, sizeof(shape), hash);
+    key.samples.reserve(window.size() * shape[1]);
+    for (const auto &row : window)
+    {
+        hash = hash_bytes(row.data(), row.size() * sizeof(float), hash);
+        key.samples.insert(key.samples.end(), row.begin(), row.end());
+    }
+    key.hash = hash;
+    return key;
+}
+
+std::shared_ptr<const ctranslate2::StorageView> whisper::EncoderCache::get(const Key &key)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = index_.find(key.hash);
+    if (it == index_.end() || !(it->second->key == key))
+    {
+        stats_.misses++;
+        return nullptr;
+    }
+
+    stats_.hits++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->encoded;
+}
+
+void whisper::EncoderCache::put(Key key, std::shared_ptr<const ctranslate2::StorageView> encoded)
+{
+    const size_t bytes = static_cast<size_t>(encoded->size_in_bytes()) + key.size_in_bytes();
+    if (bytes > max_bytes_)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = index_.find(key.hash);
+    if (it != index_.end())
+    {
+        if (it->second->key == key)
+        {
+            // encoded twice by concurrent requests, keep the first
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return;
+        }
+        // another window with the same hash
+        erase(it->second);
+    }
+
+    while (!entries_.empty() && stats_.bytes + bytes > max_bytes_)
+    {
+        stats_.evictions++;
+        erase(std::prev(entries_.end()));
+    }
+
+    const uint64_t hash = key.hash;
+    entries_.push_front(Entry{std::move(key), std::move(encoded), bytes});
+    index_[hash] = entries_.begin();
+    stats_.bytes += bytes;
+    stats_.entries = entries_.size();
+}
+
+void whisper::EncoderCache::erase(std::list<Entry>::iterator entry)
+{
+    stats_.bytes -= entry->bytes;
+    index_.erase(entry->key.hash);
+    entries_.erase(entry);
+    stats_.entries = entries_.size();
+}
+
+whisper::EncoderCache::Stats whisper::EncoderCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    Stats stats = stats_;
+    stats.entries = entries_.size();
+    return stats;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ctranslate2/storage_view.h"
+
+namespace whisper
+{
+    // LRU cache of encoder outputs, keyed by the mel window and the model that encoded it. Streams
+    // resubmit the same windows and batch jobs decode the same file again with another prompt, language or
+    // temperature; with the cache only the decoder runs again. Entries are evicted oldest first once their bytes
+    // exceed the budget, the copy of the window kept with every entry counts towards it. Thread safe, one cache can
+    // be shared by every WhisperFast of the application.
+    class EncoderCache
+    {
+    public:
+        struct Stats
+        {
+            size_t hits = 0;
+            size_t misses = 0;
+            size_t evictions = 0;
+            size_t entries = 0;
+            size_t bytes = 0;
+        };
+
+        EncoderCache(size_t max_bytes);
+
+        // a n_mels x frames window and the model id, which covers the weights and compute type. The hash finds the
+        // entry, the model id and the samples are compared on a hit so a collision is a miss, not another window.
+        struct Key
+        {
+            uint64_t hash = 0;
+            std::string model_id;
+            size_t n_mels = 0;
+            // the rows one after the other
+            std::vector<float> samples;
+
+            bool operator==(const Key& other) const;
+            size_t size_in_bytes() const { return model_id.size() + samples.size() * sizeof(float); }
+        };
+
+        static Key key(const std::vector<std::vector<float>>& window, const std::string& model_id);
+
+        // nullptr on a miss
+        std::shared_ptr<const ctranslate2::StorageView> get(const Key& key);
+        void put(Key key, std::shared_ptr<const ctranslate2::StorageView> encoded);
+
+        Stats stats() const;
+
+    private:
+        struct Entry
+        {
+            Key key;
+            std::shared_ptr<const ctranslate2::StorageView> encoded;
+            size_t bytes;
+        };
+
+        size_t max_bytes_;
+        Stats stats_;
+        // most recently used first
+        std::list<Entry> entries_;
+        // by Key::hash, an entry whose hash collides with a new one is replaced by it
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+        mutable std::mutex mtx_;
+
+        // with mtx_ held
+        void erase(std::list<Entry>::iterator entry);
+    };
+}
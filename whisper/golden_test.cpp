@@ -0,0 +1,364 @@
+// Golden output test: compares every stage of the C++ front-end with the python reference implementations in
+// feature_extractor/pytest and audio_systems/pytests. The fixtures are written by the generate_fixtures.py scripts
+// next to them. Each stage gets its own tolerance so optimised kernels can be checked stage by stage.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "audio_decoder.hpp"
+#include "feature_extractor.hpp"
+
+#ifndef WHISPER_FEATURE_FIXTURES
+#define WHISPER_FEATURE_FIXTURES "feature_extractor/pytest/fixtures"
+#endif
+
+#ifndef WHISPER_AUDIO_FIXTURES
+#define WHISPER_AUDIO_FIXTURES "audio_systems/pytests/fixtures"
+#endif
+
+#ifndef WHISPER_TEST_AUDIO
+#define WHISPER_TEST_AUDIO "audio_systems/assets/Recording.wav"
+#endif
+
+struct tolerance
+{
+    double atol;
+    double rtol;
+};
+
+struct golden_params
+{
+    std::string feature_fixtures = WHISPER_FEATURE_FIXTURES;
+    std::string audio_fixtures = WHISPER_AUDIO_FIXTURES;
+    std::string audio = WHISPER_TEST_AUDIO;
+    std::string stage;
+
+    // an element passes when |actual - expected| <= atol + rtol * |expected|, same as numpy.allclose
+    std::map<std::string, tolerance> tolerances = {
+        {"decoder", {1e-3, 0.0}},    {"mel_filters", {1e-6, 1e-4}}, {"magnitudes", {1e-3, 1e-3}},
+        {"mel_spec", {1e-5, 1e-4}}, {"log_spec", {1e-4, 1e-4}},     {"extract", {1e-4, 1e-4}},
+    };
+};
+
+struct npy_array
+{
+    std::vector<size_t> shape;
+    std::vector<float> data;
+};
+
+// minimal .npy reader for little endian float32/float64 arrays in C order
+static bool load_npy(const std::string &path, npy_array &array)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        fprintf(stderr, "%s: could not open '%s'\n", __func__, path.c_str());
+        return false;
+    }
+
+    char magic[6];
+    uint8_t version[2];
+    file.read(magic, 6);
+    file.read(reinterpret_cast<char *>(version), 2);
+    if (!file || std::memcmp(magic, "\x93NUMPY", 6) != 0)
+    {
+        fprintf(stderr, "%s: '%s' is not a npy file\n", __func__, path.c_str());
+        return false;
+    }
+
+    uint32_t header_len = 0;
+    if (version[0] == 1)
+    {
+        uint8_t len[2];
+        file.read(reinterpret_cast<char *>(len), 2);
+        header_len = len[0] | (len[1] << 8);
+    }
+    else
+    {
+        uint8_t len[4];
+        file.read(reinterpret_cast<char *>(len), 4);
+        header_len = len[0] | (len[1] << 8) | (len[2] << 16) | (static_cast<uint32_t>(len[3]) << 24);
+    }
+
+    std::string header(header_len, '\0');
+    file.read(&header[0], header_len);
+
+    if (header.find("'fortran_order': False") == std::string::npos)
+    {
+        fprintf(stderr, "%s: '%s' must be stored in C order\n", __func__, path.c_str());
+        return false;
+    }
+
+    size_t item_size = 0;
+    if (header.find("'descr': '<f4'") != std::string::npos)
+    {
+        item_size = 4;
+    }
+    else if (header.find("'descr': '<f8'") != std::string::npos)
+    {
+        item_size = 8;
+    }
+    else
+    {
+        fprintf(stderr, "%s: '%s' must hold float32 or float64\n", __func__, path.c_str());
+        return false;
+    }
+
+    array.shape.clear();
+    const size_t shape_begin = header.find('(', header.find("'shape'"));
+    const size_t shape_end = header.find(')', shape_begin);
+    std::string shape = header.substr(shape_begin + 1, shape_end - shape_begin - 1);
+    size_t count = 1;
+    for (size_t pos = 0; pos < shape.size();)
+    {
+        size_t next = shape.find(',', pos);
+        if (next == std::string::npos)
+        {
+            next = shape.size();
+        }
+        std::string dim = shape.substr(pos, next - pos);
+        if (dim.find_first_of("0123456789") != std::string::npos)
+        {
+            array.shape.push_back(std::stoul(dim));
+            count *= array.shape.back();
+        }
+        pos = next + 1;
+    }
+
+    array.data.resize(count);
+    if (item_size == 4)
+    {
+        file.read(reinterpret_cast<char *>(array.data.data()), count * sizeof(float));
+    }
+    else
+    {
+        std::vector<double> data(count);
+        file.read(reinterpret_cast<char *>(data.data()), count * sizeof(double));
+        for (size_t i = 0; i < count; i++)
+        {
+            array.data[i] = static_cast<float>(data[i]);
+        }
+    }
+
+    if (!file)
+    {
+        fprintf(stderr, "%s: '%s' is truncated\n", __func__, path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static npy_array to_npy(const std::vector<std::vector<float>> &matrix)
+{
+    npy_array array;
+    array.shape = {matrix.size(), matrix.empty() ? 0 : matrix[0].size()};
+    for (const auto &row : matrix)
+    {
+        array.data.insert(array.data.end(), row.begin(), row.end());
+    }
+    return array;
+}
+
+static std::vector<std::vector<float>> to_matrix(const npy_array &array)
+{
+    const size_t rows = array.shape[0];
+    const size_t cols = array.shape.size() > 1 ? array.shape[1] : 1;
+    std::vector<std::vector<float>> matrix(rows, std::vector<float>(cols));
+    for (size_t i = 0; i < rows; i++)
+    {
+        std::copy(array.data.begin() + i * cols, array.data.begin() + (i + 1) * cols, matrix[i].begin());
+    }
+    return matrix;
+}
+
+static std::string shape_str(const std::vector<size_t> &shape)
+{
+    std::string str = "(";
+    for (size_t i = 0; i < shape.size(); i++)
+    {
+        str += (i > 0 ? ", " : "") + std::to_string(shape[i]);
+    }
+    return str + ")";
+}
+
+// prints the max abs/relative error of one stage, returns whether it is within tolerance
+static bool compare(const std::string &stage, const npy_array &actual, const npy_array &expected, const tolerance &tol)
+{
+    if (actual.shape != expected.shape)
+    {
+        printf("%-12s FAIL  shape %s, expected %s\n", stage.c_str(), shape_str(actual.shape).c_str(),
+               shape_str(expected.shape).c_str());
+        return false;
+    }
+
+    double max_abs = 0.0;
+    double max_rel = 0.0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < expected.data.size(); i++)
+    {
+        const double err = std::fabs(static_cast<double>(actual.data[i]) - expected.data[i]);
+        const double ref = std::fabs(static_cast<double>(expected.data[i]));
+        if (!(err <= tol.atol + tol.rtol * ref))
+        {
+            mismatches++;
+        }
+        max_abs = std::max(max_abs, err);
+        if (ref > 0.0)
+        {
+            max_rel = std::max(max_rel, err / ref);
+        }
+    }
+
+    const bool passed = mismatches == 0;
+    printf("%-12s %s  max_abs %.3e  max_rel %.3e  mismatches %zu/%zu  (atol %.1e, rtol %.1e)\n", stage.c_str(),
+           passed ? "PASS" : "FAIL", max_abs, max_rel, mismatches, expected.data.size(), tol.atol, tol.rtol);
+    return passed;
+}
+
+static void print_usage(char **argv, const golden_params &params)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  --feature-fixtures DIR [%s]\n", params.feature_fixtures.c_str());
+    fprintf(stderr, "  --audio-fixtures DIR   [%s]\n", params.audio_fixtures.c_str());
+    fprintf(stderr, "  --audio FNAME          [%s]\n", params.audio.c_str());
+    fprintf(stderr, "  --stage NAME           only run one stage\n");
+    fprintf(stderr, "  --tol STAGE=ATOL[:RTOL] override the tolerance of a stage, stages:\n");
+    for (const auto &tol : params.tolerances)
+    {
+        fprintf(stderr, "                           %-12s atol %.1e, rtol %.1e\n", tol.first.c_str(), tol.second.atol,
+                tol.second.rtol);
+    }
+    fprintf(stderr, "\n");
+}
+
+static bool parse_params(int argc, char **argv, golden_params &params)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            print_usage(argv, params);
+            exit(0);
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "--feature-fixtures") { params.feature_fixtures = argv[++i]; }
+        else if (arg == "--audio-fixtures") { params.audio_fixtures = argv[++i]; }
+        else if (arg == "--audio") { params.audio = argv[++i]; }
+        else if (arg == "--stage") { params.stage = argv[++i]; }
+        else if (arg == "--tol")
+        {
+            std::string value = argv[++i];
+            const size_t eq = value.find('=');
+            const size_t colon = value.find(':');
+            if (eq == std::string::npos || params.tolerances.count(value.substr(0, eq)) == 0)
+            {
+                fprintf(stderr, "error: invalid tolerance '%s'\n", value.c_str());
+                return false;
+            }
+            auto &tol = params.tolerances[value.substr(0, eq)];
+            tol.atol = std::stod(value.substr(eq + 1, colon == std::string::npos ? std::string::npos : colon - eq - 1));
+            if (colon != std::string::npos)
+            {
+                tol.rtol = std::stod(value.substr(colon + 1));
+            }
+        }
+        else
+        {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv, params);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    golden_params params;
+    if (!parse_params(argc, argv, params))
+    {
+        return 1;
+    }
+
+    std::map<std::string, npy_array> fixtures;
+    for (const char *name : {"waveform", "mel_filters", "magnitudes", "mel_spec", "log_spec"})
+    {
+        if (!load_npy(params.feature_fixtures + "/" + name + ".npy", fixtures[name]))
+        {
+            return 1;
+        }
+    }
+    if (!load_npy(params.audio_fixtures + "/recording_16k.npy", fixtures["recording_16k"]))
+    {
+        return 1;
+    }
+
+    featureExtractor::FeatureExtractor feature;
+    const std::vector<float> &waveform = fixtures["waveform"].data;
+
+    // every stage runs on the reference output of the previous one, so errors do not carry over between stages
+    const std::vector<std::pair<std::string, std::function<npy_array()>>> stages = {
+        {"decoder",
+         [&]() {
+             const char *path = params.audio.c_str();
+             npy_array audio;
+             audio.data = audioSystem::AudioDecoder::DecodeAudio(path);
+             audio.shape = {audio.data.size()};
+             return audio;
+         }},
+        {"mel_filters", [&]() { return to_npy(feature.mel_filters()); }},
+        {"magnitudes",
+         [&]() {
+             auto window = feature.generate_window(400);
+             auto frames = feature.from_wave(waveform);
+             return to_npy(feature.stft_magnitudes(feature.stft(frames, window, 400)));
+         }},
+        {"mel_spec",
+         [&]() { return to_npy(feature.apply_mel_filters(to_matrix(fixtures["magnitudes"]), feature.mel_filters())); }},
+        {"log_spec",
+         [&]() {
+             auto log_spec = feature.apply_logarithm(to_matrix(fixtures["mel_spec"]));
+             feature.normalize(log_spec);
+             return to_npy(log_spec);
+         }},
+        {"extract", [&]() { return to_npy(feature.extract(waveform, false)); }},
+    };
+
+    const std::map<std::string, std::string> expected = {
+        {"decoder", "recording_16k"}, {"mel_filters", "mel_filters"}, {"magnitudes", "magnitudes"},
+        {"mel_spec", "mel_spec"},     {"log_spec", "log_spec"},       {"extract", "log_spec"},
+    };
+
+    int failures = 0;
+    for (const auto &stage : stages)
+    {
+        if (!params.stage.empty() && params.stage != stage.first)
+        {
+            continue;
+        }
+        if (!compare(stage.first, stage.second(), fixtures[expected.at(stage.first)], params.tolerances[stage.first]))
+        {
+            failures++;
+        }
+    }
+
+    printf("%s\n", failures == 0 ? "all stages match the reference" : "some stages differ from the reference");
+    return failures == 0 ? 0 : 1;
+}
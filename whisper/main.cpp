@@ -1,6 +1,6 @@
 #include <iostream>
 
-#include "Instrumentor.hpp"
+#include "instrumentor.hpp"
 #include "ctranslate2/models/whisper.h"
 #include "audio_decoder.hpp"
 #include "whisper_fast.hpp"
@@ -8,9 +8,9 @@
 #include "audio_async.hpp"
 
 
-int test_stream()
+int test_stream(const whisper::WhisperFastConfig& config)
 {
-	whisper::WhisperStream wis;
+	whisper::WhisperStream wis(config);
     wis.init();
     std::string str;
 
@@ -30,7 +30,7 @@ int test_stream()
 }
 
 
-int test_fast()
+int test_fast(const whisper::WhisperFastConfig& config)
 {
     audioSystem::AudioAsync audio;
     std::vector<float> pcmf32;
@@ -42,8 +42,7 @@ int test_fast()
     }
     audio.resume();
 
-    std::string model_path = "C:/dev/Resources/Models/whisper-tiny.en-ct2";
-    whisper::WhisperFast whisper_fast(model_path);
+    whisper::WhisperFast whisper_fast(config);
 
     std::this_thread::sleep_for(std::chrono::milliseconds(5000));
     std::cout << "now\n";
@@ -55,16 +54,14 @@ int test_fast()
     return 0;
 }
 
-int test_file()
+int test_file(const whisper::WhisperFastConfig& config, const char* path)
 {
     audioSystem::AudioAsync audio;
-    const char* path = "C:/Users/novel/Documents/Sound Recordings/Recording.wav";
     std::vector<float> pcmf32 = audioSystem::AudioDecoder::DecodeAudio(path);
 
     std::cout << "audio loaded\n";
 
-    std::string model_path = "C:/dev/Resources/Models/whisper-tiny.en-ct2";
-    whisper::WhisperFast whisper_fast(model_path);
+    whisper::WhisperFast whisper_fast(config);
 
     std::cout << "model loaded\n";
 
@@ -73,7 +70,15 @@ int test_file()
     return 0;
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    return test_stream();
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s MODEL_DIR\n", argv[0]);
+        return 1;
+    }
+
+    whisper::WhisperFastConfig config;
+    config.model_path = argv[1];
+    return test_stream(config);
 }
@@ -0,0 +1,128 @@
+#include "model_registry.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+// resident set size from /proc, 0 where it is not available
+static size_t resident_bytes()
+{
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+    {
+        return 0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    const int fields = fscanf(statm, "%lu %lu", &size, &resident);
+    fclose(statm);
+    return fields == 2 ? resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+whisper::ModelRegistry::ModelRegistry(const WhisperFastConfig &config) : current_(WhisperModelHandle::load(config))
+{
+}
+
+whisper::ModelRegistry::ModelRegistry(std::shared_ptr<WhisperModelHandle> model) : current_(std::move(model))
+{
+}
+
+std::shared_ptr<whisper::WhisperModelHandle> whisper::ModelRegistry::current() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return current_;
+}
+
+whisper::WhisperSession whisper::ModelRegistry::session() const
+{
+    return WhisperSession(current());
+}
+
+whisper::WhisperSession whisper::ModelRegistry::session(const WhisperFastConfig &options) const
+{
+    return WhisperSession(current(), options);
+}
+
+std::future<whisper::ModelSwapReport> whisper::ModelRegistry::swap(const WhisperFastConfig &config,
+                                                                   std::chrono::milliseconds drain_timeout)
+{
+    return std::async(std::launch::async, [this, config, drain_timeout]() { return swap_model(config, drain_timeout); });
+}
+
+whisper::ModelSwapReport whisper::ModelRegistry::swap_model(WhisperFastConfig config,
+                                                            std::chrono::milliseconds drain_timeout)
+{
+    std::lock_guard<std::mutex> swap_lock(swap_mtx_);
+    ModelSwapReport report;
+
+    // the models of earlier timed out drains whose sessions are gone by now
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+                                  [](const std::shared_ptr<WhisperModelHandle> &model) { return model->sessions() == 0; }),
+                   retired_.end());
+
+    // the pool and cache carry over, the cache keys of the new model differ from the old ones
+    {
+        auto serving = current();
+        if (!config.thread_pool)
+        {
+            config.thread_pool = serving->config().thread_pool;
+        }
+        if (!config.encoder_cache)
+        {
+            config.encoder_cache = serving->config().encoder_cache;
+        }
+    }
+
+    report.rss_before_bytes = resident_bytes();
+    const auto start = std::chrono::steady_clock::now();
+    auto next = WhisperModelHandle::load(config);
+    const auto loaded = std::chrono::steady_clock::now();
+    report.load_ms = elapsed_ms(start, loaded);
+    report.rss_overlap_bytes = resident_bytes();
+
+    std::shared_ptr<WhisperModelHandle> previous;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        previous = current_;
+        current_ = std::move(next);
+    }
+    // the sessions that started before the switch, other holders of the handle (a tool keeping it around, a task
+    // reading its thread pool) do not keep the drain waiting
+    report.in_flight = previous->sessions();
+
+    // the swap keeps the old model until it is drained, so the last session never frees it from a pool worker
+    report.drained = previous->wait_sessions(drain_timeout);
+    if (!report.drained)
+    {
+        retired_.push_back(previous);
+    }
+    previous.reset();
+    const auto drained = std::chrono::steady_clock::now();
+    report.drain_ms = elapsed_ms(loaded, drained);
+    report.total_ms = elapsed_ms(start, drained);
+    report.rss_after_bytes = resident_bytes();
+
+    if (!report.drained)
+    {
+        fprintf(stderr, "%s: %zu of %zu sessions still on the old model after %lld ms, it is kept until they finish\n",
+                __func__, retired_.back()->sessions(), report.in_flight, static_cast<long long>(drain_timeout.count()));
+    }
+    fprintf(stderr,
+            "%s: load %.0f ms, drain %.0f ms of %zu sessions, rss %zu MB before, %zu MB with both models, %zu MB after\n",
+            __func__, report.load_ms, report.drain_ms, report.in_flight, report.rss_before_bytes >> 20,
+            report.rss_overlap_bytes >> 20, report.rss_after_bytes >> 20);
+    return report;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "whisper_fast.hpp"
+
+namespace whisper
+{
+    // what a swap cost, the memory figures are the resident set of the process (linux only, 0 elsewhere)
+    struct ModelSwapReport
+    {
+        // loading the new model while the old one kept serving
+        double load_ms = 0.0;
+        // from the switch until the last session of the old model let go of it, or until the drain timed out
+        double drain_ms = 0.0;
+        double total_ms = 0.0;
+        // sessions still on the old model at the switch
+        size_t in_flight = 0;
+        // false when sessions were still on the old model after the drain timeout
+        bool drained = true;
+        size_t rss_before_bytes = 0;
+        // both models resident, between the end of the load and the end of the drain
+        size_t rss_overlap_bytes = 0;
+        size_t rss_after_bytes = 0;
+    };
+
+    // The model new sessions are created on, replaced without stopping the service: swap loads the new model in the
+    // background while the current one keeps serving, switches new sessions to it, then waits for the sessions
+    // still on the old one to finish before reporting, at most drain_timeout. The old model is freed by the swap once
+    // drained, a model whose drain timed out is kept by the registry and freed by the first later swap that finds
+    // its sessions gone, or released with the registry.
+    class ModelRegistry
+    {
+    public:
+        ModelRegistry(const WhisperFastConfig& config);
+        ModelRegistry(std::shared_ptr<WhisperModelHandle> model);
+
+        ModelRegistry(const ModelRegistry&) = delete;
+        ModelRegistry& operator=(const ModelRegistry&) = delete;
+
+        std::shared_ptr<WhisperModelHandle> current() const;
+        WhisperSession session() const;
+        // with the decoding options of options, see WhisperSession
+        WhisperSession session(const WhisperFastConfig& options) const;
+
+        // loads config on a thread of its own, the future is ready once the old model is drained and holds the
+        // exception of a failed load, the current model is then kept. A config without thread_pool or
+        // encoder_cache reuses the ones of the current model. Swaps run one after the other; the registry has to
+        // outlive the future, whose destructor waits for the swap like any std::async one.
+        std::future<ModelSwapReport> swap(const WhisperFastConfig& config,
+            std::chrono::milliseconds drain_timeout = std::chrono::seconds(60));
+
+    private:
+        ModelSwapReport swap_model(WhisperFastConfig config, std::chrono::milliseconds drain_timeout);
+
+        std::shared_ptr<WhisperModelHandle> current_;
+        // old models whose drain timed out, touched under swap_mtx_ only
+        std::vector<std::shared_ptr<WhisperModelHandle>> retired_;
+        mutable std::mutex mtx_;
+        std::mutex swap_mtx_;
+    };
+}
@@ -0,0 +1,193 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// the pool and queue index of the worker running on this thread, tasks submitted from a worker go to its own queue
+static thread_local const whisper::ThreadPool *s_current_pool = nullptr;
+static thread_local size_t s_current_index = 0;
+
+static void pin_to_core(int cpu_core)
+{
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu_core, &cpu_set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+    {
+        fprintf(stderr, "%s: could not pin a worker to core %d\n", __func__, cpu_core);
+    }
+#else
+    (void)cpu_core;
+#endif
+}
+
+whisper::ThreadPool::ThreadPool(size_t num_threads, int cpu_core_offset)
+{
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        const int cpu_core = cpu_core_offset >= 0 ? cpu_core_offset + static_cast<int>(i) : -1;
+        threads_.emplace_back(&ThreadPool::worker_loop, this, i, cpu_core);
+    }
+}
+
+whisper::ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mtx_);
+        stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto &thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+void whisper::ThreadPool::push(std::function<void()> task)
+{
+    if (threads_.empty())
+    {
+        task();
+        return;
+    }
+
+    // counted before it is queued: a worker can take it as soon as it is in the queue and its decrement must not
+    // come first. A worker woken in between finds nothing yet and looks again.
+    {
+        std::lock_guard<std::mutex> lock(sleep_mtx_);
+        pending_++;
+    }
+    const size_t index = s_current_pool == this ? s_current_index : next_queue_++ % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mtx);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    sleep_cv_.notify_one();
+}
+
+// newest task of the own queue first while it is still in cache, otherwise the oldest task of another queue
+bool whisper::ThreadPool::try_pop(size_t index, std::function<void()> &task)
+{
+    bool found = false;
+    {
+        Queue &own = *queues_[index];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    for (size_t i = 1; i < queues_.size() && !found; i++)
+    {
+        Queue &victim = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    // under the lock the sleepers check it with, so a worker never goes by a count that is about to change
+    if (found)
+    {
+        std::lock_guard<std::mutex> lock(sleep_mtx_);
+        pending_--;
+    }
+    return found;
+}
+
+void whisper::ThreadPool::worker_loop(size_t index, int cpu_core)
+{
+    if (cpu_core >= 0)
+    {
+        pin_to_core(cpu_core);
+    }
+    s_current_pool = this;
+    s_current_index = index;
+
+    std::function<void()> task;
+    while (true)
+    {
+        if (try_pop(index, task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mtx_);
+        sleep_cv_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+        if (stop_ && pending_ == 0)
+        {
+            return;
+        }
+    }
+}
+
+void whisper::ThreadPool::parallel_for(size_t count, const std::function<void(size_t begin, size_t end)> &fn)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (threads_.empty() || count == 1)
+    {
+        fn(0, count);
+        return;
+    }
+
+    // a few ranges per thread so a slow or preempted worker is balanced by the others
+    struct Ranges
+    {
+        size_t count;
+        size_t num_ranges;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+    auto ranges = std::make_shared<Ranges>();
+    ranges->count = count;
+    ranges->num_ranges = std::min(count, 4 * (threads_.size() + 1));
+
+    // the helpers may start after the caller has finished every range, they only touch the shared state then
+    auto run = [ranges, &fn]() {
+        size_t range;
+        while ((range = ranges->next++) < ranges->num_ranges)
+        {
+            const size_t begin = range * ranges->count / ranges->num_ranges;
+            const size_t end = (range + 1) * ranges->count / ranges->num_ranges;
+            fn(begin, end);
+            if (++ranges->done == ranges->num_ranges)
+            {
+                std::lock_guard<std::mutex> lock(ranges->mtx);
+                ranges->cv.notify_all();
+            }
+        }
+    };
+
+    const size_t helpers = std::min(threads_.size(), ranges->num_ranges - 1);
+    for (size_t i = 0; i < helpers; i++)
+    {
+        push(run);
+    }
+    run();
+
+    std::unique_lock<std::mutex> lock(ranges->mtx);
+    ranges->cv.wait(lock, [&ranges]() { return ranges->done == ranges->num_ranges; });
+}
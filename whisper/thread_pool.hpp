@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace whisper
+{
+    // Work stealing pool for everything around the model: feature extraction, vad and post-processing. Every worker
+    // has its own queue, tasks submitted from a worker go to its own queue and idle workers steal from the others.
+    // One pool is meant to be shared by all the streams of a process so the front-end work of 32 streams does not
+    // start 32 sets of threads next to the ctranslate2 ones.
+    class ThreadPool
+    {
+    public:
+        // cpu_core_offset >= 0 pins worker i to core cpu_core_offset + i (linux only)
+        ThreadPool(size_t num_threads, int cpu_core_offset = -1);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        size_t size() const { return threads_.size(); }
+
+        template <typename F>
+        auto submit(F&& fn) -> std::future<decltype(fn())>
+        {
+            using result_type = decltype(fn());
+            auto task = std::make_shared<std::packaged_task<result_type()>>(std::forward<F>(fn));
+            std::future<result_type> future = task->get_future();
+            push([task]() { (*task)(); });
+            return future;
+        }
+
+        // runs fn over [0, count) in contiguous ranges, the calling thread works on the ranges too, so it is safe
+        // to call from inside a task of the same pool
+        void parallel_for(size_t count, const std::function<void(size_t begin, size_t end)>& fn);
+
+    private:
+        struct Queue
+        {
+            std::mutex mtx;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        void push(std::function<void()> task);
+        bool try_pop(size_t index, std::function<void()>& task);
+        void worker_loop(size_t index, int cpu_core);
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread> threads_;
+        std::atomic<size_t> next_queue_{0};
+        // queued and not yet taken, workers sleep while it is 0; guarded by sleep_mtx_ like stop_
+        size_t pending_ = 0;
+        std::mutex sleep_mtx_;
+        std::condition_variable sleep_cv_;
+        bool stop_ = false;
+    };
+}
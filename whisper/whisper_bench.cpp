@@ -0,0 +1,430 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "audio_decoder.hpp"
+#include "benchmark_runner.hpp"
+#include "feature_extractor.hpp"
+#include "model_registry.hpp"
+#include "tokenizer.hpp"
+#include "whisper_fast.hpp"
+
+#ifndef WHISPER_BENCH_AUDIO
+#define WHISPER_BENCH_AUDIO "audio_systems/assets/Recording.wav"
+#endif
+
+#ifndef WHISPER_GIT_COMMIT
+#define WHISPER_GIT_COMMIT "unknown"
+#endif
+
+struct bench_params
+{
+    std::string model;
+    std::string compute_type = "default";
+    std::string audio = WHISPER_BENCH_AUDIO;
+    std::string output = "whisper_bench.json";
+    std::string filter;
+    int iterations = 5;
+    int hop_ms = 1000;
+    int window_ms = 5000;
+};
+
+static void print_usage(char **argv, const bench_params &params)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s -m MODEL_DIR [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m DIR,   --model DIR    ctranslate2 whisper model directory, model benchmarks are skipped without it\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME   [%s] audio for the model benchmarks\n", params.audio.c_str());
+    fprintf(stderr, "  -c TYPE,  --compute-type TYPE [%s] ctranslate2 compute type of the model\n",
+            params.compute_type.c_str());
+    fprintf(stderr, "  -o FNAME, --output FNAME [%s] json results\n", params.output.c_str());
+    fprintf(stderr, "  -n N,     --iterations N [%d] timed iterations per benchmark\n", params.iterations);
+    fprintf(stderr, "  --filter NAME            only run the benchmarks whose name contains NAME\n");
+    fprintf(stderr, "  --hop-ms N               [%d] chunk size of the replayed stream\n", params.hop_ms);
+    fprintf(stderr, "  --window-ms N            [%d] audio transcribed per chunk of the replayed stream\n", params.window_ms);
+    fprintf(stderr, "\n");
+}
+
+static bool parse_params(int argc, char **argv, bench_params &params)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            print_usage(argv, params);
+            exit(0);
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") { params.model = argv[++i]; }
+        else if (arg == "-f" || arg == "--file") { params.audio = argv[++i]; }
+        else if (arg == "-c" || arg == "--compute-type") { params.compute_type = argv[++i]; }
+        else if (arg == "-o" || arg == "--output") { params.output = argv[++i]; }
+        else if (arg == "-n" || arg == "--iterations") { params.iterations = std::stoi(argv[++i]); }
+        else if (arg == "--filter") { params.filter = argv[++i]; }
+        else if (arg == "--hop-ms") { params.hop_ms = std::stoi(argv[++i]); }
+        else if (arg == "--window-ms") { params.window_ms = std::stoi(argv[++i]); }
+        else
+        {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv, params);
+            return false;
+        }
+    }
+    return true;
+}
+
+// speech-like test signal: a few harmonics with a slow pitch drift plus some noise
+static std::vector<float> make_signal(float seconds, int sample_rate = 16000)
+{
+    std::mt19937 rng(42);
+    std::normal_distribution<float> noise(0.0f, 0.01f);
+
+    std::vector<float> signal(static_cast<size_t>(seconds * sample_rate));
+    for (size_t i = 0; i < signal.size(); i++)
+    {
+        const float t = static_cast<float>(i) / sample_rate;
+        const float f0 = 140.0f + 30.0f * std::sin(2.0f * 3.14159265f * 0.5f * t);
+        float value = 0.0f;
+        for (int h = 1; h <= 4; h++)
+        {
+            value += 0.1f / h * std::sin(2.0f * 3.14159265f * f0 * h * t);
+        }
+        signal[i] = value + noise(rng);
+    }
+    return signal;
+}
+
+static std::string seconds_param(float seconds)
+{
+    return "seconds=" + std::to_string(static_cast<int>(seconds));
+}
+
+// word level edit distance of hypothesis to reference over the reference length
+static double word_error_rate(const std::string &reference, const std::string &hypothesis)
+{
+    auto split = [](const std::string &text) {
+        std::istringstream stream(text);
+        std::vector<std::string> words;
+        for (std::string word; stream >> word;)
+        {
+            words.push_back(word);
+        }
+        return words;
+    };
+    const auto ref = split(reference);
+    const auto hyp = split(hypothesis);
+    if (ref.empty())
+    {
+        return hyp.empty() ? 0.0 : 1.0;
+    }
+
+    std::vector<size_t> previous(hyp.size() + 1);
+    std::vector<size_t> current(hyp.size() + 1);
+    for (size_t j = 0; j <= hyp.size(); j++)
+    {
+        previous[j] = j;
+    }
+    for (size_t i = 1; i <= ref.size(); i++)
+    {
+        current[0] = i;
+        for (size_t j = 1; j <= hyp.size(); j++)
+        {
+            const size_t substitution = previous[j - 1] + (ref[i - 1] == hyp[j - 1] ? 0 : 1);
+            current[j] = std::min({substitution, previous[j] + 1, current[j - 1] + 1});
+        }
+        std::swap(previous, current);
+    }
+    return static_cast<double>(previous[hyp.size()]) / ref.size();
+}
+
+static void bench_front_end(BenchmarkRunner &runner, const bench_params &params)
+{
+    featureExtractor::FeatureExtractor feature;
+
+    for (float seconds : {1.0f, 30.0f, 600.0f})
+    {
+        if (!runner.IsEnabled("feature_extract"))
+        {
+            break;
+        }
+        auto signal = make_signal(seconds);
+        // ten minutes takes long enough that a couple of runs are representative
+        const int iterations = seconds > 60.0f ? std::min(params.iterations, 2) : params.iterations;
+        runner.Run("feature_extract", seconds_param(seconds), iterations,
+                   [&]() { auto features = feature.extract(signal, false); });
+    }
+
+    auto signal = make_signal(30.0f);
+    auto window = feature.generate_window(400);
+    auto frames = feature.from_wave(signal);
+
+    if (runner.IsEnabled("fft"))
+    {
+        std::vector<float> frame(frames[frames.size() / 2]);
+        for (size_t i = 0; i < frame.size(); i++)
+        {
+            frame[i] *= window[i];
+        }
+        runner.Run("fft", "n=400,batch=100", params.iterations, [&]() {
+            for (int i = 0; i < 100; i++)
+            {
+                auto bins = feature.fft(frame);
+            }
+        });
+    }
+
+    if (runner.IsEnabled("stft"))
+    {
+        runner.Run("stft", seconds_param(30.0f), params.iterations,
+                   [&]() { auto stft = feature.stft(frames, window, 400); });
+    }
+
+    auto magnitudes = feature.stft_magnitudes(feature.stft(frames, window, 400));
+    if (runner.IsEnabled("mel"))
+    {
+        runner.Run("mel", seconds_param(30.0f) + ",n_mels=80", params.iterations,
+                   [&]() { auto mel = feature.apply_mel_filters(magnitudes, feature.mel_filters()); });
+    }
+
+    auto mel_spec = feature.apply_mel_filters(magnitudes, feature.mel_filters());
+    if (runner.IsEnabled("log_mel"))
+    {
+        runner.Run("log_mel", seconds_param(30.0f), params.iterations, [&]() {
+            auto log_spec = feature.apply_logarithm(mel_spec);
+            feature.normalize(log_spec);
+        });
+    }
+
+    if (runner.IsEnabled("resample"))
+    {
+        auto input = make_signal(10.0f, 44100);
+        std::vector<float> output(16001);
+        runner.Run("resample", "in_rate=44100,out_rate=16000,seconds=10", params.iterations, [&]() {
+            // one second per call, the way a capture callback would feed it
+            audioSystem::AudioResampler resampler(44100, 16000, 1);
+            for (size_t offset = 0; offset + 44100 <= input.size(); offset += 44100)
+            {
+                resampler.Resample(input.data() + offset, 44100, output.data(), static_cast<int>(output.size()));
+            }
+        });
+    }
+}
+
+static void bench_model(BenchmarkRunner &runner, const bench_params &params)
+{
+    whisper::WhisperFastConfig config;
+    config.model_path = params.model;
+    config.compute_type = params.compute_type;
+    whisper::WhisperFast whisper_fast(config);
+
+    if (runner.IsEnabled("tokenizer"))
+    {
+        const std::string text = "And so my fellow Americans, ask not what your country can do for you, "
+                                 "ask what you can do for your country.";
+        runner.Run("tokenizer_encode", "chars=" + std::to_string(text.size()) + ",batch=100", params.iterations,
+                   [&]() {
+                       for (int i = 0; i < 100; i++)
+                       {
+                           auto tokens = whisper_fast.model().tokenizer.encode(text);
+                       }
+                   });
+
+        std::vector<size_t> tokens(64);
+        for (size_t i = 0; i < tokens.size(); i++)
+        {
+            tokens[i] = 1000 + i * 37;
+        }
+        runner.Run("tokenizer_decode", "tokens=64,batch=100", params.iterations, [&]() {
+            for (int i = 0; i < 100; i++)
+            {
+                auto text = whisper_fast.model().tokenizer.decode(tokens);
+            }
+        });
+    }
+
+    if (runner.IsEnabled("ctranslate2_storage"))
+    {
+        std::vector<std::vector<float>> segment(80, std::vector<float>(whisper_fast.model().feature.nb_max_frames, 0.5f));
+        runner.Run("ctranslate2_storage", "n_mels=80,frames=" + std::to_string(whisper_fast.model().feature.nb_max_frames),
+                   params.iterations, [&]() { auto storage = whisper_fast.get_ctranslate2_storage(segment); });
+    }
+
+    if (runner.IsEnabled("session_create"))
+    {
+        // a request on the loaded model, the options are all it copies
+        runner.Run("session_create", "batch=1000", params.iterations, [&]() {
+            for (int i = 0; i < 1000; i++)
+            {
+                whisper::WhisperSession session(whisper_fast.model_handle());
+            }
+        });
+    }
+
+    const char *audio_path = params.audio.c_str();
+    std::vector<float> pcmf32 = audioSystem::AudioDecoder::DecodeAudio(audio_path);
+    if (pcmf32.empty())
+    {
+        fprintf(stderr, "%s: could not decode '%s', skipping the generate benchmarks\n", __func__, audio_path);
+        return;
+    }
+    const float audio_seconds = pcmf32.size() / 16000.0f;
+
+    if (runner.IsEnabled("generate"))
+    {
+        runner.Run("generate", "file=Recording.wav," + seconds_param(audio_seconds), params.iterations,
+                   [&]() { auto text = whisper_fast.generate(pcmf32); });
+
+        // share of the windows the greedy fast path was enough for, and time spent decoding them again
+        const auto metrics = whisper_fast.metrics();
+        runner.AddContext("windows", std::to_string(metrics.windows));
+        runner.AddContext("no_speech_windows", std::to_string(metrics.no_speech_windows));
+        runner.AddContext("greedy_accepted", std::to_string(metrics.greedy_accepted));
+        runner.AddContext("beam_fallbacks", std::to_string(metrics.beam_fallbacks));
+        runner.AddContext("temperature_fallbacks", std::to_string(metrics.temperature_fallbacks));
+        runner.AddContext("fallback_ms", std::to_string(metrics.fallback_ms));
+    }
+
+    if (runner.IsEnabled("word_timestamps"))
+    {
+        // alignment is one extra decoder pass, align_share is its part of the decode time
+        whisper::WhisperFastConfig words_config = config;
+        words_config.word_timestamps = true;
+        whisper::WhisperSession aligned(whisper_fast.model_handle(), words_config);
+        runner.Run("word_timestamps", "file=Recording.wav," + seconds_param(audio_seconds), params.iterations,
+                   [&]() { auto segments = aligned.transcribe(pcmf32); });
+
+        const auto metrics = aligned.metrics();
+        runner.AddContext("align_share", std::to_string(metrics.decode_ms > 0.0 ? metrics.align_ms / metrics.decode_ms : 0.0));
+    }
+
+    if (runner.IsEnabled("short_input"))
+    {
+        // the start of the file padded to 30 s and to the smallest bucket holding it, the word error rate of the
+        // bucketed text against the 30 s one is written next to the timings
+        whisper::WhisperFastConfig bucket_config = config;
+        bucket_config.short_input_buckets = true;
+        whisper::WhisperSession bucketed(whisper_fast.model_handle(), bucket_config);
+
+        for (int bucket : bucket_config.bucket_seconds)
+        {
+            if (bucket >= 30)
+            {
+                continue;
+            }
+            const size_t samples = std::min(pcmf32.size(), static_cast<size_t>(bucket - 1) * 16000);
+            std::vector<float> input(pcmf32.begin(), pcmf32.begin() + samples);
+            const std::string params_base = "bucket=" + std::to_string(bucket) + "," + seconds_param(samples / 16000.0f);
+
+            std::string reference;
+            std::string text;
+            runner.Run("short_input_30s", params_base, params.iterations, [&]() { reference = whisper_fast.generate(input); });
+            runner.Run("short_input_bucketed", params_base, params.iterations, [&]() { text = bucketed.generate(input); });
+            runner.AddContext("wer_bucket_" + std::to_string(bucket), std::to_string(word_error_rate(reference, text)));
+        }
+    }
+
+    if (runner.IsEnabled("stream_replay"))
+    {
+        // replay the file in real time sized chunks the way WhisperStream consumes the microphone, and time how
+        // long each chunk takes from arrival until its text is available
+        const size_t hop = params.hop_ms * 16;
+        const size_t window = params.window_ms * 16;
+        std::vector<double> latencies_ms;
+
+        for (size_t received = hop; received <= pcmf32.size(); received += hop)
+        {
+            const size_t start = received > window ? received - window : 0;
+            std::vector<float> chunk(pcmf32.begin() + start, pcmf32.begin() + received);
+
+            auto t_start = std::chrono::steady_clock::now();
+            auto text = whisper_fast.generate(chunk);
+            auto t_end = std::chrono::steady_clock::now();
+            latencies_ms.push_back(std::chrono::duration<double, std::milli>(t_end - t_start).count());
+        }
+
+        runner.AddSamples("stream_replay",
+                          "hop_ms=" + std::to_string(params.hop_ms) + ",window_ms=" + std::to_string(params.window_ms),
+                          std::move(latencies_ms));
+    }
+}
+
+// reload the model while a request runs on it, the report of the swap goes to the context. Runs after bench_model
+// so no other session holds the model being replaced and the drain only waits for the request.
+static void bench_model_swap(BenchmarkRunner &runner, const bench_params &params)
+{
+    std::vector<float> pcmf32 = audioSystem::AudioDecoder::DecodeAudio(params.audio.c_str());
+    if (pcmf32.empty())
+    {
+        return;
+    }
+
+    whisper::WhisperFastConfig config;
+    config.model_path = params.model;
+    config.compute_type = params.compute_type;
+    whisper::ModelRegistry registry(config);
+
+    auto session = std::make_shared<whisper::WhisperSession>(registry.current());
+    auto in_flight = std::async(std::launch::async, [session, &pcmf32]() { return session->generate(pcmf32); });
+    session.reset();
+    const auto report = registry.swap(config).get();
+    in_flight.get();
+
+    runner.AddContext("swap_load_ms", std::to_string(report.load_ms));
+    runner.AddContext("swap_drain_ms", std::to_string(report.drain_ms));
+    runner.AddContext("swap_drained", report.drained ? "true" : "false");
+    runner.AddContext("swap_in_flight", std::to_string(report.in_flight));
+    // signed, the resident set can shrink during the load when pages are evicted
+    const int64_t overlap_bytes =
+        static_cast<int64_t>(report.rss_overlap_bytes) - static_cast<int64_t>(report.rss_before_bytes);
+    runner.AddContext("swap_overlap_bytes", std::to_string(overlap_bytes));
+}
+
+int main(int argc, char **argv)
+{
+    bench_params params;
+    if (!parse_params(argc, argv, params))
+    {
+        return 1;
+    }
+
+    BenchmarkRunner runner("whisper_bench");
+    runner.SetFilter(params.filter);
+    runner.AddContext("commit", WHISPER_GIT_COMMIT);
+    runner.AddContext("model", params.model);
+    runner.AddContext("compute_type", params.compute_type);
+
+    bench_front_end(runner, params);
+
+    if (!params.model.empty())
+    {
+        bench_model(runner, params);
+        if (runner.IsEnabled("model_swap"))
+        {
+            bench_model_swap(runner, params);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "%s: no model given, skipping the model benchmarks\n", __func__);
+    }
+
+    runner.WriteJson(params.output);
+    std::cout << "results written to " << params.output << "\n";
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "audio_decoder.hpp"
+#include "whisper_fast.hpp"
+
+struct cli_params
+{
+    whisper::WhisperFastConfig config;
+    std::string audio;
+};
+
+// printed as soon as the window is decoded, long files show progress right away
+static void print_segment(const whisper::WhisperSegment &segment)
+{
+    if (segment.no_speech)
+    {
+        return;
+    }
+    if (segment.words.empty())
+    {
+        printf("[%7.2f --> %7.2f] %s\n", segment.start, segment.end, segment.text.c_str());
+    }
+    for (const auto &word : segment.words)
+    {
+        printf("[%7.2f --> %7.2f] %-20s p=%.2f\n", word.start, word.end, word.word.c_str(), word.probability);
+    }
+    fflush(stdout);
+}
+
+static void print_usage(char **argv, const cli_params &params)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "usage: %s -m MODEL_DIR [options] FILE\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "transcribes FILE, any format ffmpeg can read\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m DIR,   --model DIR    ctranslate2 whisper model directory\n");
+    fprintf(stderr, "  -f FNAME, --file FNAME   audio to transcribe, same as the positional FILE\n");
+    fprintf(stderr, "  -d NAME,  --device NAME  [%s] cpu, cuda or auto\n", params.config.device.c_str());
+    fprintf(stderr, "  -c TYPE,  --compute-type TYPE [%s] default, int8, int8_float32, float32, ...\n",
+            params.config.compute_type.c_str());
+    fprintf(stderr, "  -r N,     --replicas N   [%zu] copies of the model\n", params.config.num_replicas);
+    fprintf(stderr, "  -t N,     --threads N    [%zu] threads per generate call, 0 lets ctranslate2 decide\n",
+            params.config.intra_threads);
+    fprintf(stderr, "  -p N,     --pool N       [%zu] thread pool workers for the front-end and post-processing\n",
+            params.config.inter_threads);
+    fprintf(stderr, "  --pin N                  pin the pool to cores N.. and ctranslate2 to the cores after them\n");
+    fprintf(stderr, "  -l LANG,  --language LANG language of the audio, detected on multilingual models when not given\n");
+    fprintf(stderr, "  --translate              translate to english instead of transcribing\n");
+    fprintf(stderr, "  --words                  print every word with its start and end time\n");
+    fprintf(stderr, "  -b N,     --beam-size N  [%zu] beam size, 1 is greedy\n", params.config.options.beam_size);
+    fprintf(stderr, "  --max-length N           [%zu] max tokens per window\n", params.config.options.max_length);
+    fprintf(stderr, "  --autotune               time the compute types and thread counts at startup, keep the fastest\n");
+    fprintf(stderr, "  --buckets                pad short inputs to 5/10/15 s instead of 30 s\n");
+    fprintf(stderr, "\n");
+}
+
+static bool parse_params(int argc, char **argv, cli_params &params)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help")
+        {
+            print_usage(argv, params);
+            exit(0);
+        }
+        if (arg[0] != '-')
+        {
+            params.audio = arg;
+            continue;
+        }
+        if (arg == "--autotune")
+        {
+            params.config.autotune = true;
+            continue;
+        }
+        if (arg == "--buckets")
+        {
+            params.config.short_input_buckets = true;
+            continue;
+        }
+        if (arg == "--translate")
+        {
+            params.config.task = "translate";
+            continue;
+        }
+        if (arg == "--words")
+        {
+            params.config.word_timestamps = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            return false;
+        }
+
+        if (arg == "-m" || arg == "--model") { params.config.model_path = argv[++i]; }
+        else if (arg == "-f" || arg == "--file") { params.audio = argv[++i]; }
+        else if (arg == "-d" || arg == "--device") { params.config.device = argv[++i]; }
+        else if (arg == "-c" || arg == "--compute-type") { params.config.compute_type = argv[++i]; }
+        else if (arg == "-r" || arg == "--replicas") { params.config.num_replicas = std::stoul(argv[++i]); }
+        else if (arg == "-l" || arg == "--language") { params.config.language = argv[++i]; }
+        else if (arg == "-b" || arg == "--beam-size") { params.config.options.beam_size = std::stoul(argv[++i]); }
+        else if (arg == "--max-length") { params.config.options.max_length = std::stoul(argv[++i]); }
+        else if (arg == "-t" || arg == "--threads") { params.config.intra_threads = std::stoul(argv[++i]); }
+        else if (arg == "-p" || arg == "--pool") { params.config.inter_threads = std::stoul(argv[++i]); }
+        else if (arg == "--pin") { params.config.cpu_core_offset = std::stoi(argv[++i]); }
+        else
+        {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argv, params);
+            return false;
+        }
+    }
+
+    if (params.config.model_path.empty() || params.audio.empty())
+    {
+        fprintf(stderr, "error: a model and an audio file are required\n");
+        print_usage(argv, params);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    cli_params params;
+    if (!parse_params(argc, argv, params))
+    {
+        return 1;
+    }
+
+    std::vector<float> pcmf32 = audioSystem::AudioDecoder::DecodeAudio(params.audio.c_str());
+    if (pcmf32.empty())
+    {
+        fprintf(stderr, "%s: could not decode '%s'\n", __func__, params.audio.c_str());
+        return 1;
+    }
+
+    try
+    {
+        whisper::WhisperFast whisper_fast(params.config);
+        whisper_fast.transcribe(pcmf32, print_segment);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s: %s\n", __func__, e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -1,75 +1,646 @@
 #include "whisper_fast.hpp"
-#include "Instrumentor.hpp"
+#include "ctranslate2/models/model.h"
 #include "ctranslate2/storage_view.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include <fstream>
+#include <random>
 #include <sstream>
+#include <thread>
 #include <vector>
+#include <zlib.h>
 
-whisper::WhisperFast::WhisperFast(std::string model) : whisper_model(model, ctranslate2::Device::CPU), tokenizer(model)
+static ctranslate2::ReplicaPoolConfig replica_pool_config(const whisper::WhisperFastConfig &config)
 {
-    feature = featureExtractor::FeatureExtractor();
-    prompts_ = feature.get_prompt(tokenizer);
+    ctranslate2::ReplicaPoolConfig pool_config;
+    pool_config.num_threads_per_replica = config.intra_threads;
+    if (config.cpu_core_offset >= 0)
+    {
+        pool_config.cpu_core_offset = config.cpu_core_offset + static_cast<int>(config.inter_threads);
+    }
+    return pool_config;
+}
+
+// the replica pool is neither copyable nor movable, it is built in place from the returned prvalue
+static ctranslate2::models::Whisper load_model(const whisper::WhisperFastConfig &config)
+{
+    ctranslate2::models::ModelLoader loader(config.model_path);
+    loader.device = ctranslate2::str_to_device(config.device);
+    loader.compute_type = ctranslate2::str_to_compute_type(config.compute_type);
+    loader.num_replicas_per_device = config.num_replicas;
+    return ctranslate2::models::Whisper(loader, replica_pool_config(config));
+}
+
+ctranslate2::models::WhisperOptions whisper::WhisperFastConfig::default_options()
+{
+    ctranslate2::models::WhisperOptions options;
+    options.beam_size = 5;
+    options.patience = 1;
+    options.length_penalty = 1;
+    options.max_length = 448;
+    options.return_scores = true;
+    options.return_no_speech_prob = true;
+    options.suppress_tokens = std::vector<int>{-1};
+    options.suppress_blank = true;
+    options.max_initial_timestamp_index = 50;
+    return options;
+}
+
+whisper::WhisperModelHandle::WhisperModelHandle(const WhisperFastConfig &config)
+    : config_(config.autotune ? autotune(config) : config), thread_pool_(config_.thread_pool),
+      tokenizer(config_.model_path), whisper_model(load_model(config_))
+{
+    if (!thread_pool_)
+    {
+        thread_pool_ = std::make_shared<ThreadPool>(config_.inter_threads, config_.cpu_core_offset);
+        config_.thread_pool = thread_pool_;
+    }
+    if (!config_.encoder_cache && config_.encoder_cache_bytes > 0)
+    {
+        config_.encoder_cache = std::make_shared<EncoderCache>(config_.encoder_cache_bytes);
+    }
+    // a model reloaded from the same directory can have new weights, every load gets keys of its own
+    static std::atomic<size_t> loads{0};
+    model_id_ = config_.model_path + "|" + config_.device + "|" + config_.compute_type + "|" + std::to_string(loads++);
+
+    feature.set_parallel_for([pool = thread_pool_](size_t count, const std::function<void(size_t, size_t)> &fn) {
+        pool->parallel_for(count, fn);
+    });
+}
 
-    // init model options
-    options_.beam_size = 5;
-    options_.patience = 1;
-    options_.length_penalty = 1;
-    options_.max_length = 448;
-    options_.return_scores = true;
-    options_.return_no_speech_prob = true;
-    options_.suppress_tokens = std::vector<int>{-1};
-    options_.suppress_blank = true;
-    options_.max_initial_timestamp_index = 50;
+std::shared_ptr<whisper::WhisperModelHandle> whisper::WhisperModelHandle::load(const WhisperFastConfig &config)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto model = std::make_shared<WhisperModelHandle>(config);
+    const double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%s: loaded %s (%s, %s) in %.0f ms\n", __func__, model->config_.model_path.c_str(),
+            model->config_.device.c_str(), model->config_.compute_type.c_str(), load_ms);
+    return model;
 }
 
-int whisper::WhisperFast::transcribe()
+void whisper::WhisperModelHandle::session_started()
 {
-    return 0;
+    std::lock_guard<std::mutex> lock(sessions_mtx_);
+    sessions_++;
 }
 
-std::string whisper::WhisperFast::generate(std::vector<float> pcmf32)
+void whisper::WhisperModelHandle::session_finished()
 {
-    auto features = feature.extract(pcmf32, true);
-    Timer timer_other("other");
-    auto content_frames = features[0].size() - feature.nb_max_frames;
-    auto seek = 0;
-    std::string text = "";
-    while (seek < content_frames)
+    std::lock_guard<std::mutex> lock(sessions_mtx_);
+    if (--sessions_ == 0)
     {
+        sessions_cv_.notify_all();
+    }
+}
+
+size_t whisper::WhisperModelHandle::sessions() const
+{
+    std::lock_guard<std::mutex> lock(sessions_mtx_);
+    return sessions_;
+}
 
-        std::vector<std::vector<float>> segment(features.size(),
-                                                std::vector<float>(feature.nb_max_frames));
-        int end = seek + feature.nb_max_frames;
-        for (int i = 0; i < features.size(); i++)
+bool whisper::WhisperModelHandle::wait_sessions(std::chrono::milliseconds timeout) const
+{
+    std::unique_lock<std::mutex> lock(sessions_mtx_);
+    return sessions_cv_.wait_for(lock, timeout, [this]() { return sessions_ == 0; });
+}
+
+whisper::WhisperFastConfig whisper::WhisperModelHandle::autotune(const WhisperFastConfig &config)
+{
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t max_threads = config.intra_threads > 0 ? config.intra_threads : hardware_threads;
+    std::vector<size_t> thread_counts = {max_threads};
+    if (max_threads >= 4)
+    {
+        thread_counts.push_back(max_threads / 2);
+    }
+
+    // 5 s of noise padded to a full window, greedy and short so a candidate takes a second or two
+    std::mt19937 rng(0);
+    std::normal_distribution<float> noise(0.0f, 0.05f);
+    std::vector<float> signal(5 * 16000);
+    for (auto &sample : signal)
+    {
+        sample = noise(rng);
+    }
+    featureExtractor::FeatureExtractor feature;
+    auto features = feature.extract(signal, true);
+    std::vector<float> window;
+    window.reserve(features.size() * feature.nb_max_frames);
+    for (const auto &row : features)
+    {
+        window.insert(window.end(), row.begin(), row.begin() + feature.nb_max_frames);
+    }
+    ctranslate2::StorageView storage({1, static_cast<ctranslate2::dim_t>(features.size()),
+                                      static_cast<ctranslate2::dim_t>(feature.nb_max_frames)},
+                                     std::move(window), ctranslate2::Device::CPU);
+
+    featureExtractor::Tokenizer tokenizer(config.model_path);
+    auto prompts = feature.get_prompt(tokenizer);
+    auto options = config.options;
+    options.beam_size = 1;
+    options.max_length = 32;
+
+    WhisperFastConfig best = config;
+    best.autotune = false;
+    double best_ms = -1.0;
+
+    for (const auto &compute_type : config.autotune_compute_types)
+    {
+        for (size_t threads : thread_counts)
         {
-            for (int j = seek; j < end; j++)
+            WhisperFastConfig candidate = best;
+            candidate.compute_type = compute_type;
+            candidate.intra_threads = threads;
+            candidate.num_replicas = 1;
+
+            std::vector<double> samples_ms;
+            try
             {
-                segment[i][j - seek] = features[i][j];
+                auto model = load_model(candidate);
+                for (int i = 0; i < 4; i++)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    model.generate(storage, prompts, options)[0].get();
+                    auto end = std::chrono::steady_clock::now();
+                    // the first run warms up the caches and the allocator
+                    if (i > 0)
+                    {
+                        samples_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+                    }
+                }
+            }
+            catch (const std::exception &e)
+            {
+                fprintf(stderr, "%s: compute type %s not usable: %s\n", __func__, compute_type.c_str(), e.what());
+                break;
+            }
+
+            std::sort(samples_ms.begin(), samples_ms.end());
+            const double median_ms = samples_ms[samples_ms.size() / 2];
+            fprintf(stderr, "%s: compute_type %-14s intra_threads %3zu: %8.1f ms\n", __func__, compute_type.c_str(),
+                    threads, median_ms);
+
+            if (best_ms < 0.0 || median_ms < best_ms)
+            {
+                best_ms = median_ms;
+                best.compute_type = compute_type;
+                best.intra_threads = threads;
             }
         }
-        timer_other.Stop();
-        Timer timer_storage("storage");
-        auto features = get_ctranslate2_storage(segment);
-        timer_storage.Stop();
-        Timer timer_whis_generate("whis generate");
-        auto result = whisper_model.generate(features, prompts_, options_);
-        timer_whis_generate.Stop();
-        Timer timer("inference");
-        auto res = result[0].get();
-        timer.Stop();
-        auto tokens = res.sequences_ids[0];
-        text = tokenizer.decode(tokens);
-        std::cout << text << "\n";
-        seek = content_frames;
-    }
-
-	// TODO: return text here
+    }
+
+    fprintf(stderr, "%s: using compute_type %s with %zu intra_threads\n", __func__, best.compute_type.c_str(),
+            best.intra_threads);
+    return best;
+}
+
+whisper::WhisperSession::WhisperSession(std::shared_ptr<WhisperModelHandle> model)
+    : model_(std::move(model)), config_(model_->config())
+{
+    model_->session_started();
+}
+
+whisper::WhisperSession::WhisperSession(std::shared_ptr<WhisperModelHandle> model, const WhisperFastConfig &options)
+    : model_(std::move(model)), config_(options)
+{
+    // the model fields describe the loaded model whatever options says, only the decoding fields are the session's
+    const WhisperFastConfig &loaded = model_->config();
+    config_.model_path = loaded.model_path;
+    config_.device = loaded.device;
+    config_.compute_type = loaded.compute_type;
+    config_.num_replicas = loaded.num_replicas;
+    config_.intra_threads = loaded.intra_threads;
+    config_.inter_threads = loaded.inter_threads;
+    config_.cpu_core_offset = loaded.cpu_core_offset;
+    config_.thread_pool = loaded.thread_pool;
+    config_.encoder_cache_bytes = loaded.encoder_cache_bytes;
+    config_.encoder_cache = loaded.encoder_cache;
+    config_.autotune = false;
+    model_->session_started();
+}
+
+whisper::WhisperSession::~WhisperSession()
+{
+    model_->session_finished();
+}
+
+whisper::WhisperFast::WhisperFast(const WhisperFastConfig &config) : WhisperSession(WhisperModelHandle::load(config))
+{
+}
+
+whisper::WhisperFast::WhisperFast(std::string model) : WhisperFast(WhisperFastConfig{model})
+{
+}
+
+// how well zlib compresses the text, repetition loops of the decoder compress far better than speech
+static float compression_ratio(const std::string &text)
+{
+    if (text.empty())
+    {
+        return 0.0f;
+    }
+
+    uLongf compressed_size = compressBound(text.size());
+    std::vector<Bytef> compressed(compressed_size);
+    if (compress(compressed.data(), &compressed_size, reinterpret_cast<const Bytef *>(text.data()), text.size()) != Z_OK)
+    {
+        return 0.0f;
+    }
+    return static_cast<float>(text.size()) / compressed_size;
+}
+
+whisper::WhisperSession::WindowResult whisper::WhisperSession::decode_window(const ctranslate2::StorageView &features,
+                                                                     const std::vector<std::vector<size_t>> &prompts)
+{
+    // the attempts in order: greedy, beam search, then sampling at every temperature above 0
+    std::vector<std::pair<float, size_t>> attempts;
+    if (config_.greedy_first && config_.options.beam_size > 1)
+    {
+        attempts.emplace_back(0.0f, 1);
+    }
+    for (float temperature : config_.temperatures)
+    {
+        attempts.emplace_back(temperature, temperature > 0.0f ? 1 : config_.options.beam_size);
+    }
+    if (attempts.empty())
+    {
+        attempts.emplace_back(0.0f, config_.options.beam_size);
+    }
+
+    WindowResult best;
+    bool has_best = false;
+    double first_ms = 0.0;
+    double total_ms = 0.0;
+    size_t beam_fallbacks = 0;
+    size_t temperature_fallbacks = 0;
+
+    for (size_t i = 0; i < attempts.size(); i++)
+    {
+        const float temperature = attempts[i].first;
+        auto options = config_.options;
+        options.beam_size = attempts[i].second;
+        options.return_scores = true;
+        options.return_no_speech_prob = true;
+        if (temperature > 0.0f)
+        {
+            options.num_hypotheses = config_.best_of;
+            options.sampling_topk = 0;
+            options.sampling_temperature = temperature;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto result = model_->whisper_model.generate(features, prompts, options)[0].get();
+        total_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0)
+        {
+            first_ms = total_ms;
+        }
+        else if (temperature > 0.0f)
+        {
+            temperature_fallbacks++;
+        }
+        else
+        {
+            beam_fallbacks++;
+        }
+
+        WindowResult attempt;
+        attempt.tokens = result.sequences_ids[0];
+        attempt.text = model_->tokenizer.decode(attempt.tokens);
+        attempt.temperature = temperature;
+        attempt.no_speech_prob = result.no_speech_prob;
+        // ctranslate2 returns the cumulated log probability divided by the length penalty
+        const float length = static_cast<float>(attempt.tokens.size());
+        const float cumulated_logprob = result.scores.empty() ? 0.0f : result.scores[0] * std::pow(length, options.length_penalty);
+        attempt.avg_logprob = cumulated_logprob / (length + 1.0f);
+        attempt.compression_ratio = compression_ratio(attempt.text);
+
+        const bool silence = attempt.no_speech_prob > config_.no_speech_threshold;
+        const bool needs_fallback = attempt.compression_ratio > config_.compression_ratio_threshold ||
+                                    attempt.avg_logprob < config_.log_prob_threshold;
+
+        if (silence || !needs_fallback)
+        {
+            best = std::move(attempt);
+            break;
+        }
+        // every attempt failed the thresholds: keep the most likely one
+        if (!has_best || attempt.avg_logprob > best.avg_logprob)
+        {
+            best = std::move(attempt);
+            has_best = true;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(metrics_mtx_);
+    metrics_.windows++;
+    const bool greedy_accepted = attempts[0].second == 1 && beam_fallbacks + temperature_fallbacks == 0;
+    metrics_.greedy_accepted += greedy_accepted ? 1 : 0;
+    metrics_.beam_fallbacks += beam_fallbacks;
+    metrics_.temperature_fallbacks += temperature_fallbacks;
+    metrics_.decode_ms += total_ms;
+    metrics_.fallback_ms += total_ms - first_ms;
+    return best;
+}
+
+// probability of the no speech token after the first decoding step, the prompt is the same as for the real decode
+float whisper::WhisperSession::no_speech_probability(const ctranslate2::StorageView &encoded,
+                                                  const std::vector<std::vector<size_t>> &prompts)
+{
+    auto options = config_.options;
+    options.beam_size = 1;
+    options.num_hypotheses = 1;
+    options.max_length = 1;
+    options.return_scores = false;
+    options.return_no_speech_prob = true;
+    return model_->whisper_model.generate(encoded, prompts, options)[0].get().no_speech_prob;
+}
+
+std::vector<std::pair<std::string, float>> whisper::WhisperSession::detect_language(const ctranslate2::StorageView &encoded)
+{
+    if (!model_->whisper_model.is_multilingual())
+    {
+        return {};
+    }
+
+    // ctranslate2 returns the language tokens, <|en|>, sorted by probability
+    auto tokens = model_->whisper_model.detect_language(encoded)[0].get();
+    std::vector<std::pair<std::string, float>> languages;
+    languages.reserve(tokens.size());
+    for (auto &token : tokens)
+    {
+        languages.emplace_back(token.first.substr(2, token.first.size() - 4), token.second);
+    }
+    return languages;
+}
+
+whisper::WhisperFastMetrics whisper::WhisperSession::metrics() const
+{
+    std::lock_guard<std::mutex> lock(metrics_mtx_);
+    return metrics_;
+}
+
+// frames encoded for the next window, a full window unless the rest of the input fits a smaller bucket
+size_t whisper::WhisperSession::window_frames(size_t remaining_frames) const
+{
+    const size_t max_frames = model_->feature.nb_max_frames;
+    if (!config_.short_input_buckets || remaining_frames >= max_frames)
+    {
+        return max_frames;
+    }
+
+    const size_t frames_per_second = static_cast<size_t>(std::lround(1.0f / model_->feature.time_per_frame));
+    size_t frames = max_frames;
+    for (int seconds : config_.bucket_seconds)
+    {
+        const size_t bucket_frames = seconds * frames_per_second;
+        if (bucket_frames >= remaining_frames && bucket_frames < frames)
+        {
+            frames = bucket_frames;
+        }
+    }
+    return frames;
+}
+
+std::vector<whisper::WhisperSegment> whisper::WhisperSession::transcribe(const std::vector<float> &pcmf32,
+                                                                     const SegmentCallback &on_segment)
+{
+    // extract pads the input with a full window of silence, so every window below is complete
+    auto features = model_->feature.extract(pcmf32, true);
+    const size_t content_frames = features[0].size() - model_->feature.nb_max_frames;
+
+    std::vector<WhisperSegment> segments;
+    // detected on the first window and kept for the rest of the input
+    std::string language = config_.language;
+    size_t frames = 0;
+    for (size_t seek = 0; seek < content_frames; seek += frames)
+    {
+        frames = window_frames(content_frames - seek);
+        std::vector<std::vector<float>> window(features.size());
+        for (size_t i = 0; i < features.size(); i++)
+        {
+            window[i].assign(features[i].begin() + seek, features[i].begin() + seek + frames);
+        }
+
+        auto encoded = encode(window);
+
+        if (language.empty() && model_->whisper_model.is_multilingual())
+        {
+            language = detect_language(*encoded).front().first;
+        }
+
+        const size_t num_frames = std::min(frames, content_frames - seek);
+        WhisperSegment segment = decode(*encoded, language, num_frames);
+
+        segment.start = seek * model_->feature.time_per_frame;
+        segment.end = (seek + num_frames) * model_->feature.time_per_frame;
+        for (auto &word : segment.words)
+        {
+            word.start += segment.start;
+            word.end += segment.start;
+        }
+
+        if (on_segment)
+        {
+            on_segment(segment);
+        }
+        segments.push_back(std::move(segment));
+    }
+
+    return segments;
+}
+
+std::shared_ptr<const ctranslate2::StorageView> whisper::WhisperSession::encode(std::vector<std::vector<float>> &window)
+{
+    EncoderCache *cache = model_->encoder_cache();
+    EncoderCache::Key key;
+    if (cache)
+    {
+        key = EncoderCache::key(window, model_->model_id());
+        if (auto encoded = cache->get(key))
+        {
+            return encoded;
+        }
+    }
+
+    auto encoded =
+        std::make_shared<const ctranslate2::StorageView>(model_->whisper_model.encode(get_ctranslate2_storage(window), false).get());
+    if (cache)
+    {
+        cache->put(std::move(key), encoded);
+    }
+    return encoded;
+}
+
+whisper::WhisperSegment whisper::WhisperSession::decode(const ctranslate2::StorageView &encoded, const std::string &language,
+                                                     size_t num_frames)
+{
+    WhisperSegment segment;
+    if (model_->whisper_model.is_multilingual())
+    {
+        segment.language = !language.empty() ? language : config_.language;
+        if (segment.language.empty())
+        {
+            segment.language = detect_language(encoded).front().first;
+        }
+    }
+    const auto prompts = model_->feature.get_prompt(model_->tokenizer, segment.language,
+                                                    model_->whisper_model.is_multilingual() ? config_.task : "");
+
+    if (config_.skip_no_speech)
+    {
+        segment.no_speech_prob = no_speech_probability(encoded, prompts);
+        if (segment.no_speech_prob > config_.no_speech_threshold)
+        {
+            segment.no_speech = true;
+
+            std::lock_guard<std::mutex> lock(metrics_mtx_);
+            metrics_.no_speech_windows++;
+            return segment;
+        }
+    }
+
+    auto result = decode_window(encoded, prompts);
+    segment.text = std::move(result.text);
+    segment.tokens = std::move(result.tokens);
+    segment.no_speech_prob = result.no_speech_prob;
+    segment.avg_logprob = result.avg_logprob;
+    segment.compression_ratio = result.compression_ratio;
+    segment.temperature = result.temperature;
+
+    if (config_.word_timestamps && !segment.tokens.empty())
+    {
+        // the encoder halves the frames
+        const size_t frames = num_frames > 0 ? num_frames : static_cast<size_t>(encoded.dim(1)) * 2;
+        segment.words = align_words(encoded, prompts[0], segment.tokens, frames);
+    }
+    return segment;
+}
+
+// true unless text ends in the middle of a multi byte utf-8 character
+static bool complete_utf8(const std::string &text)
+{
+    size_t continuation = 0;
+    for (size_t i = text.size(); i > 0; i--)
+    {
+        const unsigned char byte = text[i - 1];
+        if ((byte & 0xC0) != 0x80)
+        {
+            const size_t length = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+            return continuation + 1 >= length;
+        }
+        continuation++;
+    }
+    return true;
+}
+
+// same as find_alignment in faster-whisper: ctranslate2 aligns the text tokens to the encoder frames with dtw over
+// the cross attention of the alignment heads, the frame where the aligned token index moves on is the start of a
+// token. Tokens are grouped into words at spaces and punctuation.
+std::vector<whisper::WhisperWord> whisper::WhisperSession::align_words(const ctranslate2::StorageView &encoded,
+                                                                   const std::vector<size_t> &prompt,
+                                                                   const std::vector<size_t> &tokens, size_t num_frames)
+{
+    const size_t eot = static_cast<size_t>(model_->tokenizer.token_to_id("<|endoftext|>"));
+    std::vector<size_t> text_tokens;
+    for (size_t token : tokens)
+    {
+        if (token < eot)
+        {
+            text_tokens.push_back(token);
+        }
+    }
+    if (text_tokens.empty())
+    {
+        return {};
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto alignment = model_->whisper_model.align(encoded, prompt, {text_tokens}, {num_frames})[0].get();
+
+    // time of the first frame of every token, the eot token included
+    const float seconds_per_frame = model_->feature.time_per_frame * 2.0f;
+    std::vector<float> token_times;
+    for (size_t i = 0; i < alignment.alignments.size(); i++)
+    {
+        if (i == 0 || alignment.alignments[i].first != alignment.alignments[i - 1].first)
+        {
+            token_times.push_back(alignment.alignments[i].second * seconds_per_frame);
+        }
+    }
+
+    std::vector<WhisperWord> words;
+    std::vector<size_t> boundaries = {0};
+    std::string pending;
+    size_t pending_tokens = 0;
+    for (size_t i = 0; i < text_tokens.size(); i++)
+    {
+        // tokens that only hold part of a utf-8 character are grouped with the next ones
+        pending += model_->tokenizer.decode({text_tokens[i]});
+        pending_tokens++;
+        if (!complete_utf8(pending) && i + 1 < text_tokens.size())
+        {
+            continue;
+        }
+
+        const bool with_space = pending[0] == ' ';
+        const bool punctuation = pending.size() == 1 && std::ispunct(static_cast<unsigned char>(pending[0]));
+        if (words.empty() || with_space || punctuation)
+        {
+            words.push_back(WhisperWord{pending});
+            boundaries.push_back(boundaries.back() + pending_tokens);
+        }
+        else
+        {
+            words.back().word += pending;
+            boundaries.back() += pending_tokens;
+        }
+        pending.clear();
+        pending_tokens = 0;
+    }
+
+    for (size_t w = 0; w < words.size() && !token_times.empty(); w++)
+    {
+        const size_t first = boundaries[w];
+        const size_t last = boundaries[w + 1];
+        words[w].start = token_times[std::min(first, token_times.size() - 1)];
+        words[w].end = token_times[std::min(last, token_times.size() - 1)];
+
+        float probability = 0.0f;
+        const size_t probs_end = std::min(last, alignment.text_token_probs.size());
+        for (size_t t = first; t < probs_end; t++)
+        {
+            probability += alignment.text_token_probs[t];
+        }
+        words[w].probability = probs_end > first ? probability / (probs_end - first) : 0.0f;
+    }
+
+    const double align_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::lock_guard<std::mutex> lock(metrics_mtx_);
+    metrics_.align_ms += align_ms;
+    return words;
+}
+
+std::string whisper::WhisperSession::generate(std::vector<float> pcmf32)
+{
+    std::string text;
+    for (const auto &segment : transcribe(pcmf32))
+    {
+        if (!segment.no_speech)
+        {
+            text += segment.text;
+        }
+    }
     return text;
 }
 
-ctranslate2::StorageView whisper::WhisperFast::get_ctranslate2_storage(std::vector<std::vector<float>> &segment)
+ctranslate2::StorageView whisper::WhisperSession::get_ctranslate2_storage(std::vector<std::vector<float>> &segment)
 {
     auto device = ctranslate2::Device::CPU;
     auto dtype = ctranslate2::DataType::FLOAT32;
@@ -93,7 +664,7 @@ ctranslate2::StorageView whisper::WhisperFast::get_ctranslate2_storage(std::vect
     return view;
 }
 
-std::vector<std::vector<float>> whisper::WhisperFast::storage_to_vectors(const ctranslate2::StorageView &storage)
+std::vector<std::vector<float>> whisper::WhisperSession::storage_to_vectors(const ctranslate2::StorageView &storage)
 {
     auto shape = storage.shape();
     const float *data = storage.data<float>();
@@ -110,7 +681,7 @@ std::vector<std::vector<float>> whisper::WhisperFast::storage_to_vectors(const c
     return vectors;
 }
 
-std::vector<std::vector<float>> whisper::WhisperFast::read_csv_matrix(const char *file_name)
+std::vector<std::vector<float>> whisper::WhisperSession::read_csv_matrix(const char *file_name)
 {
     // Open the CSV file
     std::ifstream file(file_name);
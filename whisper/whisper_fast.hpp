@@ -1,27 +1,251 @@
 #pragma once
+#include "ctranslate2/devices.h"
 #include "ctranslate2/models/whisper.h"
+#include "encoder_cache.hpp"
 #include "feature_extractor.hpp"
+#include "thread_pool.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 namespace whisper
 {
-    class WhisperFast
+    // everything that differs between deployments, filled from the command line by the tools. The fields down to
+    // thread_pool, the encoder cache and autotune describe the model and are read by WhisperModelHandle, the others
+    // are decoding options that every WhisperSession can set for itself.
+    struct WhisperFastConfig
+    {
+        // ctranslate2 converted model directory, with tokenizer.json next to model.bin
+        std::string model_path;
+        // "cpu", "cuda" or "auto"
+        std::string device = "cpu";
+        // ctranslate2 compute type: "default" keeps the type the model was converted with, "int8", "int8_float32",
+        // "float32", ... quantize the weights when they are loaded
+        std::string compute_type = "default";
+        // copies of the model, each one runs one request at a time
+        size_t num_replicas = 1;
+        // threads ctranslate2 uses inside one generate call, 0 lets ctranslate2 decide
+        size_t intra_threads = 0;
+        // workers of the thread pool running feature extraction, vad and post-processing of concurrent requests
+        size_t inter_threads = 2;
+        // >= 0 pins the pool workers to cores [offset, offset + inter_threads) and the ctranslate2 threads to the
+        // cores after them, so the two never share a core
+        int cpu_core_offset = -1;
+        // pool shared by several models of the application, created from inter_threads if empty
+        std::shared_ptr<ThreadPool> thread_pool;
+
+        ctranslate2::models::WhisperOptions options = default_options();
+        // language code of the audio, eg. "en", empty detects it on multilingual models; english only models ignore
+        // both and only get <|startoftranscript|>
+        std::string language;
+        // "transcribe" or "translate"
+        std::string task = "transcribe";
+
+        // decoding policy, the same as transcribe.py: every window is decoded greedily first and decoded again with
+        // options.beam_size, then sampled at the temperatures above 0, until the result is neither too repetitive
+        // (compression ratio) nor too unlikely (average log probability). A window that is probably silence is
+        // accepted as it is.
+        bool greedy_first = true;
+        std::vector<float> temperatures = {0.0f, 0.2f, 0.4f, 0.6f, 0.8f, 1.0f};
+        // hypotheses sampled per temperature above 0
+        size_t best_of = 5;
+        float compression_ratio_threshold = 2.4f;
+        float log_prob_threshold = -1.0f;
+        float no_speech_threshold = 0.6f;
+        // probe every encoded window with a single decoding step and skip the full decode when its no speech
+        // probability is above no_speech_threshold, hold music and silence then cost one encoder pass
+        bool skip_no_speech = true;
+
+        // align the decoded tokens to the audio and return the words of every segment with their times, one
+        // decoder pass over the cross attention of the cached encoder output
+        bool word_timestamps = false;
+
+        // encode a short input, or the last window of a long one, padded to the smallest of bucket_seconds that
+        // holds it instead of a full 30 s. The encoder cost scales with the window, a 2 s command pays for 5 s,
+        // at some cost in accuracy since the model was trained on 30 s windows.
+        bool short_input_buckets = false;
+        std::vector<int> bucket_seconds = {5, 10, 15, 30};
+
+        // byte budget of the encoder output cache, 0 disables it; a cache passed in is shared with other instances
+        size_t encoder_cache_bytes = 0;
+        std::shared_ptr<EncoderCache> encoder_cache;
+
+        // time a short synthetic window with every compute type below and a few intra_threads values at startup and
+        // keep the fastest, see WhisperModelHandle::autotune
+        bool autotune = false;
+        std::vector<std::string> autotune_compute_types = {"int8", "int8_float32", "float32"};
+
+        static ctranslate2::models::WhisperOptions default_options();
+    };
+
+    // times in seconds from the start of the input, probability is the mean of the token probabilities
+    struct WhisperWord
+    {
+        std::string word;
+        float start = 0.0f;
+        float end = 0.0f;
+        float probability = 0.0f;
+    };
+
+    // one decoded window of the input, times in seconds from its start
+    struct WhisperSegment
+    {
+        float start = 0.0f;
+        float end = 0.0f;
+        std::string text;
+        std::vector<size_t> tokens;
+        // language in the prompt, empty for english only models
+        std::string language;
+        // no speech according to the single step probe, nothing was decoded
+        bool no_speech = false;
+        float no_speech_prob = 0.0f;
+        float avg_logprob = 0.0f;
+        float compression_ratio = 0.0f;
+        float temperature = 0.0f;
+        // with config.word_timestamps
+        std::vector<WhisperWord> words;
+    };
+
+    // called with every segment as soon as its window is decoded, on the thread that runs transcribe
+    using SegmentCallback = std::function<void(const WhisperSegment& segment)>;
+
+    // counters of the decoding policy since the session was created
+    struct WhisperFastMetrics
+    {
+        size_t windows = 0;
+        // windows skipped after the no speech probe
+        size_t no_speech_windows = 0;
+        // windows whose first greedy decode was accepted
+        size_t greedy_accepted = 0;
+        // extra decodes: beam search at temperature 0, sampling above it
+        size_t beam_fallbacks = 0;
+        size_t temperature_fallbacks = 0;
+        double decode_ms = 0.0;
+        // part of decode_ms spent on the decodes after the first one
+        double fallback_ms = 0.0;
+        // word timestamps
+        double align_ms = 0.0;
+    };
+
+    // the weights, the tokenizer and the mel tables of one model, loaded once per process and shared by every
+    // session through a shared_ptr, the last session to let go frees the model. Nothing in it changes after load
+    // and the ctranslate2 replica pool queues concurrent requests, so it is used from any thread without locking.
+    class WhisperModelHandle
     {
     private:
-        std::vector<std::vector<size_t>> prompts_;
-        ctranslate2::models::WhisperOptions options_;
+        // after autotune, with the thread pool and encoder cache in use
+        WhisperFastConfig config_;
+        // identifies the weights in the encoder cache keys
+        std::string model_id_;
+        std::shared_ptr<ThreadPool> thread_pool_;
+        // sessions created on the model and not destroyed yet, counted by WhisperSession itself since the handle
+        // is also held by registries, pools of tasks and the like
+        mutable std::mutex sessions_mtx_;
+        mutable std::condition_variable sessions_cv_;
+        size_t sessions_ = 0;
+
+        friend class WhisperSession;
+        void session_started();
+        void session_finished();
 
     public:
         featureExtractor::Tokenizer tokenizer;
         featureExtractor::FeatureExtractor feature;
-        WhisperFast() = default;
-        WhisperFast(std::string model);
         ctranslate2::models::Whisper whisper_model;
-        int transcribe();
+
+        WhisperModelHandle(const WhisperFastConfig& config);
+        static std::shared_ptr<WhisperModelHandle> load(const WhisperFastConfig& config);
+        // returns config with the compute type and intra_threads that decoded a synthetic window the fastest
+        static WhisperFastConfig autotune(const WhisperFastConfig& config);
+
+        const WhisperFastConfig& config() const { return config_; }
+        const std::string& model_id() const { return model_id_; }
+        ThreadPool& thread_pool() const { return *thread_pool_; }
+        // nullptr without encoder_cache_bytes
+        EncoderCache* encoder_cache() const { return config_.encoder_cache.get(); }
+
+        size_t sessions() const;
+        // waits until no session is left on the model, false if some still are after timeout
+        bool wait_sessions(std::chrono::milliseconds timeout) const;
+    };
+
+    // one request or one stream on a shared model: its decoding options and metrics, no weights, so creating one
+    // costs a copy of the options. transcribe can run on several threads of the same session at once.
+    class WhisperSession
+    {
+    private:
+        std::shared_ptr<WhisperModelHandle> model_;
+        WhisperFastConfig config_;
+        WhisperFastMetrics metrics_;
+        mutable std::mutex metrics_mtx_;
+
+        struct WindowResult
+        {
+            std::vector<size_t> tokens;
+            std::string text;
+            float avg_logprob = 0.0f;
+            float compression_ratio = 0.0f;
+            float no_speech_prob = 0.0f;
+            float temperature = 0.0f;
+        };
+        // features can be the mel window or its encoder output
+        WindowResult decode_window(const ctranslate2::StorageView& features,
+            const std::vector<std::vector<size_t>>& prompts);
+        float no_speech_probability(const ctranslate2::StorageView& encoded,
+            const std::vector<std::vector<size_t>>& prompts);
+        size_t window_frames(size_t remaining_frames) const;
+        std::vector<WhisperWord> align_words(const ctranslate2::StorageView& encoded, const std::vector<size_t>& prompt,
+            const std::vector<size_t>& tokens, size_t num_frames);
+
+    public:
+        // with the decoding options the model was loaded with
+        WhisperSession(std::shared_ptr<WhisperModelHandle> model);
+        // with the decoding options of options, its model fields are replaced by the ones of model
+        WhisperSession(std::shared_ptr<WhisperModelHandle> model, const WhisperFastConfig& options);
+        ~WhisperSession();
+
+        WhisperModelHandle& model() const { return *model_; }
+        const std::shared_ptr<WhisperModelHandle>& model_handle() const { return model_; }
+        ThreadPool& thread_pool() const { return model_->thread_pool(); }
+        // the config in use, the model fields after autotune when it was asked for
+        const WhisperFastConfig& config() const { return config_; }
+        WhisperFastMetrics metrics() const;
+        // the two halves of transcribe, so one encoding can be decoded several times (language detection then
+        // transcription, other prompts): the encoder output of one n_mels x frames window, from the cache when it
+        // was encoded before, and its decode with the no speech probe and the fallback policy. The segment times
+        // are left at 0. An empty language falls back to config.language, then to detect_language. num_frames is
+        // the part of the window that is audio rather than padding, 0 for all of it.
+        std::shared_ptr<const ctranslate2::StorageView> encode(std::vector<std::vector<float>>& window);
+        WhisperSegment decode(const ctranslate2::StorageView& encoded, const std::string& language = "",
+            size_t num_frames = 0);
+        // language codes with their probability, most likely first, from a single decoder step on the encoder
+        // output; empty for english only models
+        std::vector<std::pair<std::string, float>> detect_language(const ctranslate2::StorageView& encoded);
+        // nullptr without encoder_cache_bytes
+        EncoderCache* encoder_cache() const { return model_->encoder_cache(); }
+
+        // every 30 s window of pcmf32 in order, the windows without speech are reported but not decoded. on_segment
+        // gets each segment when its window is done, so long inputs can be consumed while they are transcribed;
+        // the returned vector holds them all.
+        std::vector<WhisperSegment> transcribe(const std::vector<float>& pcmf32,
+            const SegmentCallback& on_segment = nullptr);
+        // text of the speech segments of transcribe
         std::string generate(std::vector<float> pcmf32);
         ctranslate2::StorageView get_ctranslate2_storage(std::vector<std::vector<float>>& segment);
         std::vector<std::vector<float>> storage_to_vectors(const ctranslate2::StorageView& storage);
         std::vector<std::vector<float>> read_csv_matrix(const char* file);
     };
 
+    // a session on a model of its own, for the tools that load one model with one configuration
+    class WhisperFast : public WhisperSession
+    {
+    public:
+        WhisperFast(const WhisperFastConfig& config);
+        WhisperFast(std::string model);
+    };
+
 }
 
@@ -1,19 +1,47 @@
 #include "whisper_stream.hpp"
 
 #include "audio_async.hpp"
-#include "Instrumentor.hpp"
+#include "instrumentor.hpp"
 #include "whisper_fast.hpp"
 
-#include <future>
+#include <cmath>
 #include <iostream>
 
-int whisper::WhisperStream::detect_segment()
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// runs on the thread pool, the capture loop keeps filling pcmf32 meanwhile so the segment is a copy
+void whisper::WhisperStream::detect_segment(std::vector<float> segment)
 {
-    //mtx.lock();
-    
-    text_queue.push(whisper_fast.generate(pcmf32));
-    //mtx.unlock();
-    return 0;
+    std::string text;
+    // the session is gone before the segment is counted as done: once pending_segments reaches 0 the destructor
+    // may release the registry, and a session holding the last reference to the model would then free the model
+    // and its thread pool from this worker of the pool
+    {
+        WhisperSession session = registry->session();
+        for (const auto &result : session.transcribe(segment, on_segment))
+        {
+            if (!result.no_speech)
+            {
+                text += result.text;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    text_queue.push(std::move(text));
+    pending_segments--;
+    pending_cv.notify_all();
+}
+
+void whisper::WhisperStream::submit_segment()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending_segments++;
+    }
+    registry->current()->thread_pool().submit([this, segment = pcmf32]() mutable { detect_segment(std::move(segment)); });
 }
 
 // TODO: improve VAD algorithm
@@ -84,10 +112,24 @@ void whisper::WhisperStream::high_pass_filter(std::vector<float> &data, float cu
     }
 }
 
-whisper::WhisperStream::WhisperStream()
-	: whisper_fast("C:/dev/Resources/Models/whisper-tiny.en-ct2")
+whisper::WhisperStream::WhisperStream(const WhisperFastConfig &config)
+    : WhisperStream(std::make_shared<ModelRegistry>(config))
+{
+}
+
+whisper::WhisperStream::WhisperStream(std::shared_ptr<WhisperModelHandle> model)
+    : WhisperStream(std::make_shared<ModelRegistry>(std::move(model)))
+{
+}
+
+whisper::WhisperStream::WhisperStream(std::shared_ptr<ModelRegistry> registry) : registry(std::move(registry))
 {
-    
+}
+
+whisper::WhisperStream::~WhisperStream()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    pending_cv.wait(lock, [this]() { return pending_segments == 0; });
 }
 
 void whisper::WhisperStream::init()
@@ -102,10 +144,14 @@ void whisper::WhisperStream::init()
     t_last = std::chrono::high_resolution_clock::now();
 }
 
+void whisper::WhisperStream::set_segment_callback(SegmentCallback callback)
+{
+    on_segment = std::move(callback);
+}
+
 int whisper::WhisperStream::get_last_transcribed(std::string &str)
 {
-    //std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
-    //if (lock.owns_lock()) {
+    std::lock_guard<std::mutex> lock(mtx);
     if (!text_queue.empty())
     {
         str = text_queue.front();
@@ -116,7 +162,6 @@ int whisper::WhisperStream::get_last_transcribed(std::string &str)
         str = "";
     }
     return 0;
-    //}
 }
 
 int whisper::WhisperStream::process_audio()
@@ -132,13 +177,13 @@ int whisper::WhisperStream::process_audio()
         if (vad_state == 1)
         {
             audio.get(t_diff, pcmf32);
-            auto future_segment = std::async(std::launch::async, &WhisperStream::detect_segment, this);
+            submit_segment();
         }
         else if (vad_state == 2)
         {
             t_last = std::chrono::high_resolution_clock::now();
             audio.get(t_diff, pcmf32);
-            auto future_segment = std::async(std::launch::async, &WhisperStream::detect_segment, this);
+            submit_segment();
         }
         t_last_attempt = t_now;
         return 1;
@@ -3,9 +3,11 @@
 #include <queue>
 #include <string>
 #include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
 #include "audio_async.hpp"
+#include "model_registry.hpp"
 #include "whisper_fast.hpp"
 
 namespace whisper
@@ -16,26 +18,38 @@ namespace whisper
         // string queue that updates
         std::queue<std::string> text_queue;
         std::mutex mtx;
+        // segments submitted to the thread pool and not transcribed yet, the destructor waits for them
+        int pending_segments = 0;
+        std::condition_variable pending_cv;
 
         std::chrono::high_resolution_clock::time_point t_last;
         std::chrono::high_resolution_clock::time_point t_last_attempt;
         std::vector<float> pcmf32;
         std::vector<float> pcmf32_vad;
         std::thread t;
-        WhisperFast whisper_fast;
+        // every chunk gets a session on the current model, a swap is picked up from the next chunk on
+        std::shared_ptr<ModelRegistry> registry;
+        SegmentCallback on_segment;
 
-        int detect_segment();
+        void detect_segment(std::vector<float> segment);
+        void submit_segment();
         int vad_simple(std::vector<float>& pcmf32, int sample_rate, int last_ms, float vad_thold, float freq_thold,
             bool verbose);
         void high_pass_filter(std::vector<float>& data, float cutoff, float sample_rate);
 
     public:
-        WhisperStream();
+        WhisperStream(const WhisperFastConfig& config);
+        // several streams of the application on one loaded model
+        WhisperStream(std::shared_ptr<WhisperModelHandle> model);
+        WhisperStream(std::shared_ptr<ModelRegistry> registry);
+        ~WhisperStream();
         audioSystem::AudioAsync audio;
         void init();
 
         // function to get the latest string
         int get_last_transcribed(std::string& str);
+        // every segment of every transcribed chunk, from a thread pool worker, times are relative to the chunk
+        void set_segment_callback(SegmentCallback callback);
 
         // async audio processing function that writes to the string queue
         int process_audio();